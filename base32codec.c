@@ -19,63 +19,361 @@
 */
 
 #include "base32codec.h"
+#include "usdt.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int32_t base32decode(const char* input, size_t input_len, char* output, size_t output_len)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE32_X86
+#include <immintrin.h>
+#endif
+
+//Whole quanta (5 bytes <-> 8 characters) are converted by block kernels,
+//picked at runtime for the CPU. What is left over, including padding, goes
+//through the bit-at-a-time loops below.
+
+static const int8_t valtable[256] =
+	{
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,  26,  27,  28,  29,  30,  31,
+                -128,-128,-128,-128,-128,  -1,-128,-128,
+                -128,   0,   1,   2,   3,   4,   5,   6,
+                   7,   8,   9,  10,  11,  12,  13,  14,
+                  15,  16,  17,  18,  19,  20,  21,  22,
+                  23,  24,  25,-128,-128,-128,-128,-128,
+                -128,   0,   1,   2,   3,   4,   5,   6,
+                   7,   8,   9,  10,  11,  12,  13,  14,
+                  15,  16,  17,  18,  19,  20,  21,  22,
+                  23,  24,  25,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128,
+                -128,-128,-128,-128,-128,-128,-128,-128
+	};
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+struct base32_kernels
+{
+	enum base32_impl impl;
+
+	//Encodes nblocks 5 byte blocks to 8 characters each
+	void (*encode_blocks)(const uint8_t* input, size_t nblocks, char* output);
+
+	//Decodes up to nblocks 8 character blocks to 5 bytes each, stopping at
+	//the first block holding padding or an invalid character. Returns the
+	//number of blocks decoded.
+	size_t (*decode_blocks)(const char* input, size_t nblocks, uint8_t* output);
+};
+
+static void encode_blocks_scalar(const uint8_t* input, size_t nblocks, char* output)
+{
+	size_t block = 0;
+	for(; block < nblocks; ++block, input += 5, output += 8)
+	{
+		uint64_t bits = ((uint64_t) input[0] << 32) | ((uint64_t) input[1] << 24) |
+			((uint64_t) input[2] << 16) | ((uint64_t) input[3] << 8) | input[4];
+		size_t idx = 0;
+		for(; idx < 8; ++idx)
+		{
+			output[idx] = alphabet[(bits >> (35 - 5 * idx)) & 0x1f];
+		}
+	}
+}
+
+static size_t decode_blocks_scalar(const char* input, size_t nblocks, uint8_t* output)
+{
+	size_t block = 0;
+	for(; block < nblocks; ++block, input += 8, output += 5)
+	{
+		uint64_t bits = 0;
+		int8_t invalid = 0;
+		size_t idx = 0;
+		for(; idx < 8; ++idx)
+		{
+			int8_t value = valtable[(unsigned char) input[idx]];
+			invalid |= value;
+			bits = (bits << 5) | (value & 0x1f);
+		}
+		if(invalid < 0)
+		{
+			//Padding or invalid character
+			break;
+		}
+		output[0] = bits >> 32;
+		output[1] = bits >> 24;
+		output[2] = bits >> 16;
+		output[3] = bits >> 8;
+		output[4] = bits;
+	}
+	return block;
+}
+
+static const struct base32_kernels kernels_scalar =
+{
+	BASE32_IMPL_SCALAR, encode_blocks_scalar, decode_blocks_scalar
+};
+
+#ifdef BASE32_X86
+
+//Encoding: each 16 bit lane k of a quantum gets the big endian pair of bytes
+//holding character k's 5 bits, shifted left by the field's offset in that
+//pair (via a multiply) so the field lands in the top 5 bits, then >> 11.
+#define B32_ENC_SHUFFLE(g) \
+	1 + (g), 0 + (g), 1 + (g), 0 + (g), 2 + (g), 1 + (g), 2 + (g), 1 + (g), \
+	3 + (g), 2 + (g), 4 + (g), 3 + (g), 4 + (g), 3 + (g), 5 + (g), 4 + (g)
+#define B32_ENC_MULTIPLIERS 1, 32, 4, 128, 16, 2, 64, 8
+
+//Decoding: 8 5-bit values per quantum are merged pairwise into 10 then 20
+//bits, joined into a 40 bit value per 64 bit lane, and shuffled out big endian
+#define B32_DEC_SHUFFLE \
+	4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static inline __m128i encode_quanta_ssse3(__m128i in)
+{
+	const __m128i shuf0 = _mm_setr_epi8(B32_ENC_SHUFFLE(0));
+	const __m128i shuf1 = _mm_setr_epi8(B32_ENC_SHUFFLE(5));
+	const __m128i mul = _mm_setr_epi16(B32_ENC_MULTIPLIERS);
+
+	__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(in, shuf0), mul), 11);
+	__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(in, shuf1), mul), 11);
+	__m128i values = _mm_packus_epi16(lo, hi);
+
+	//0-25 -> 'A'-'Z', 26-31 -> '2'-'7'
+	__m128i digits = _mm_and_si128(_mm_cmpgt_epi8(values, _mm_set1_epi8(25)), _mm_set1_epi8('A' - ('2' - 26)));
+	return _mm_sub_epi8(_mm_add_epi8(values, _mm_set1_epi8('A')), digits);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i decode_values_ssse3(__m128i in, int* valid)
+{
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+	__m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+	__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('2' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('7' + 1)));
+	*valid = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), digit)) == 0xFFFF;
+
+	__m128i offset = _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+		_mm_and_si128(lower, _mm_set1_epi8(-'a'))),
+		_mm_and_si128(digit, _mm_set1_epi8(26 - '2')));
+	return _mm_add_epi8(in, offset);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i decode_pack_ssse3(__m128i values)
+{
+	__m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi16(0x0120));
+	__m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00010400));
+	__m128i joined = _mm_or_si128(
+		_mm_slli_epi64(_mm_and_si128(quads, _mm_set1_epi64x(0xFFFFFFFF)), 20),
+		_mm_srli_epi64(quads, 32));
+	return _mm_shuffle_epi8(joined, _mm_setr_epi8(B32_DEC_SHUFFLE));
+}
+
+__attribute__((target("ssse3")))
+static void encode_blocks_ssse3(const uint8_t* input, size_t nblocks, char* output)
+{
+	//Two blocks per step; a 16 byte load needs 4 blocks left to stay in bounds
+	while(nblocks >= 4)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*) input);
+		_mm_storeu_si128((__m128i*) output, encode_quanta_ssse3(in));
+		input += 10;
+		output += 16;
+		nblocks -= 2;
+	}
+	encode_blocks_scalar(input, nblocks, output);
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_blocks_ssse3(const char* input, size_t nblocks, uint8_t* output)
+{
+	//Two blocks per step; a 16 byte store needs 4 blocks of room
+	size_t done = 0;
+	while(nblocks - done >= 4)
+	{
+		int valid;
+		__m128i values = decode_values_ssse3(_mm_loadu_si128((const __m128i*) input), &valid);
+		if(!valid)
+		{
+			break;
+		}
+		_mm_storeu_si128((__m128i*) output, decode_pack_ssse3(values));
+		input += 16;
+		output += 10;
+		done += 2;
+	}
+	return done + decode_blocks_scalar(input, nblocks - done, output);
+}
+
+static const struct base32_kernels kernels_ssse3 =
+{
+	BASE32_IMPL_SSSE3, encode_blocks_ssse3, decode_blocks_ssse3
+};
+
+__attribute__((target("avx2")))
+static void encode_blocks_avx2(const uint8_t* input, size_t nblocks, char* output)
+{
+	const __m256i shuf0 = _mm256_setr_epi8(B32_ENC_SHUFFLE(0), B32_ENC_SHUFFLE(0));
+	const __m256i shuf1 = _mm256_setr_epi8(B32_ENC_SHUFFLE(5), B32_ENC_SHUFFLE(5));
+	const __m256i mul = _mm256_setr_epi16(B32_ENC_MULTIPLIERS, B32_ENC_MULTIPLIERS);
+
+	//Four blocks per step, two per 128 bit lane; the upper lane's 16 byte
+	//load starts at byte 10 and needs 6 blocks left to stay in bounds
+	while(nblocks >= 6)
+	{
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) input)),
+			_mm_loadu_si128((const __m128i*) (input + 10)), 1);
+
+		__m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(in, shuf0), mul), 11);
+		__m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_shuffle_epi8(in, shuf1), mul), 11);
+		__m256i values = _mm256_packus_epi16(lo, hi);
+
+		__m256i digits = _mm256_and_si256(_mm256_cmpgt_epi8(values, _mm256_set1_epi8(25)), _mm256_set1_epi8('A' - ('2' - 26)));
+		_mm256_storeu_si256((__m256i*) output,
+			_mm256_sub_epi8(_mm256_add_epi8(values, _mm256_set1_epi8('A')), digits));
+
+		input += 20;
+		output += 32;
+		nblocks -= 4;
+	}
+	encode_blocks_ssse3(input, nblocks, output);
+}
+
+__attribute__((target("avx2")))
+static size_t decode_blocks_avx2(const char* input, size_t nblocks, uint8_t* output)
+{
+	//Four blocks per step; the upper lane's store at byte 10 needs 6 blocks of room
+	size_t done = 0;
+	while(nblocks - done >= 6)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i*) input);
+		__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+		__m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('2' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('7' + 1), in));
+		if((uint32_t) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(upper, lower), digit)) != 0xFFFFFFFF)
+		{
+			break;
+		}
+
+		__m256i offset = _mm256_or_si256(_mm256_or_si256(
+			_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+			_mm256_and_si256(lower, _mm256_set1_epi8(-'a'))),
+			_mm256_and_si256(digit, _mm256_set1_epi8(26 - '2')));
+		__m256i values = _mm256_add_epi8(in, offset);
+
+		__m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x0120));
+		__m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00010400));
+		__m256i joined = _mm256_or_si256(
+			_mm256_slli_epi64(_mm256_and_si256(quads, _mm256_set1_epi64x(0xFFFFFFFF)), 20),
+			_mm256_srli_epi64(quads, 32));
+		__m256i packed = _mm256_shuffle_epi8(joined,
+			_mm256_setr_epi8(B32_DEC_SHUFFLE, B32_DEC_SHUFFLE));
+
+		_mm_storeu_si128((__m128i*) output, _mm256_castsi256_si128(packed));
+		_mm_storeu_si128((__m128i*) (output + 10), _mm256_extracti128_si256(packed, 1));
+
+		input += 32;
+		output += 20;
+		done += 4;
+	}
+	return done + decode_blocks_ssse3(input, nblocks - done, output);
+}
+
+static const struct base32_kernels kernels_avx2 =
+{
+	BASE32_IMPL_AVX2, encode_blocks_avx2, decode_blocks_avx2
+};
+
+#endif
+
+static const struct base32_kernels* kernels_for(enum base32_impl impl)
+{
+#ifdef BASE32_X86
+	__builtin_cpu_init();
+	if((impl == BASE32_IMPL_AUTO || impl == BASE32_IMPL_AVX2) &&
+		__builtin_cpu_supports("avx2"))
+	{
+		return &kernels_avx2;
+	}
+	if((impl == BASE32_IMPL_AUTO || impl == BASE32_IMPL_SSSE3) &&
+		__builtin_cpu_supports("ssse3"))
+	{
+		return &kernels_ssse3;
+	}
+#endif
+	if(impl == BASE32_IMPL_AUTO || impl == BASE32_IMPL_SCALAR)
+	{
+		return &kernels_scalar;
+	}
+	return 0;
+}
+
+static const struct base32_kernels* active_kernels = 0;
+
+static const struct base32_kernels* base32_kernels(void)
+{
+	const struct base32_kernels* kernels = __atomic_load_n(&active_kernels, __ATOMIC_ACQUIRE);
+	if(!kernels)
+	{
+		kernels = kernels_for(BASE32_IMPL_AUTO);
+		__atomic_store_n(&active_kernels, kernels, __ATOMIC_RELEASE);
+	}
+	return kernels;
+}
+
+int base32_set_impl(enum base32_impl impl)
+{
+	const struct base32_kernels* kernels = kernels_for(impl);
+	if(!kernels)
+	{
+		return -1;
+	}
+	__atomic_store_n(&active_kernels, kernels, __ATOMIC_RELEASE);
+	return 0;
+}
+
+enum base32_impl base32_get_impl(void)
+{
+	return base32_kernels()->impl;
+}
+
+
+static int32_t base32decode_tail(const char* input, size_t input_len, char* output, size_t output_len)
 {
-	//TODO: This works for little endian only!
-	memset(output, 0, sizeof(output_len));
-	static const char valtable[] =
-		{
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,  26,  27,  28,  29,  30,  31,
-                        -128,-128,-128,-128,-128,  -1,-128,-128,
-                        -128,   0,   1,   2,   3,   4,   5,   6,
-                           7,   8,   9,  10,  11,  12,  13,  14,
-                          15,  16,  17,  18,  19,  20,  21,  22,
-                          23,  24,  25,-128,-128,-128,-128,-128,
-                        -128,   0,   1,   2,   3,   4,   5,   6,
-                           7,   8,   9,  10,  11,  12,  13,  14,
-                          15,  16,  17,  18,  19,  20,  21,  22,
-                          23,  24,  25,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128,
-                        -128,-128,-128,-128,-128,-128,-128,-128
-		};
-
-	int32_t idx = 0, out_idx = 0;
+	int32_t out_idx = 0;
+	size_t idx = 0;
 
 	int32_t uncopiedbits = 0;
 	uint32_t data = 0;
-	uint32_t datactr = 0;
 
 	for(; idx < input_len; ++idx)
 	{
-		char value = valtable[input[idx]];
-		if(value & 0x80)
+		int8_t value = valtable[(unsigned char) input[idx]];
+		if(value < 0)
 		{
-			if(value & 0xFF)
+			if(value == -1)
 			{
 				//Padding
 				continue;
@@ -95,13 +393,13 @@ int32_t base32decode(const char* input, size_t input_len, char* output, size_t o
 			uint32_t remainderbits = 32 - uncopiedbits;
 			uint32_t remainder = data & 0xff;
 			data <<= remainderbits;
-			if(out_idx + 2 >= output_len)
+			if((size_t) out_idx + 2 >= output_len)
 			{
 				return -1;
 			}
-			output[out_idx] = ((unsigned char*) &data)[3];
-			output[out_idx + 1] = ((unsigned char*) &data)[2];
-			output[out_idx + 2] = ((unsigned char*) &data)[1];
+			output[out_idx] = data >> 24;
+			output[out_idx + 1] = data >> 16;
+			output[out_idx + 2] = data >> 8;
 			data = remainder;
 			out_idx += 3;
 			uncopiedbits -= 24;
@@ -116,19 +414,39 @@ int32_t base32decode(const char* input, size_t input_len, char* output, size_t o
 		data <<= remainderbits;
 		size_t idx = 0;
 		size_t uncopiedbytes = uncopiedbits >> 3;
-		if((out_idx + (uncopiedbytes - idx)) >= output_len)
+		if(out_idx + uncopiedbytes > output_len)
 		{
 			return -1;
 		}
 		for(; idx < uncopiedbytes; ++idx)
 		{
-			output[out_idx + idx] = ((unsigned char*) &data)[3 - idx];
+			output[out_idx + idx] = data >> (24 - 8 * idx);
 		}
 		out_idx += uncopiedbytes;
 	}
 	return out_idx;
 }
 
+int32_t base32decode(const char* input, size_t input_len, char* output, size_t output_len)
+{
+	MUTOTP_PROBE2(base32decode_entry, input_len, output_len);
+	size_t blocks = input_len / 8 < output_len / 5 ? input_len / 8 : output_len / 5;
+	blocks = base32_kernels()->decode_blocks(input, blocks, (uint8_t*) output);
+
+	int32_t tail = base32decode_tail(&input[blocks * 8], input_len - blocks * 8,
+					&output[blocks * 5], output_len - blocks * 5);
+	if(tail < 0)
+	{
+		MUTOTP_PROBE2(base32decode_return, -1, blocks);
+		return -1;
+	}
+
+	size_t decoded = blocks * 5 + tail;
+	memset(&output[decoded], 0, output_len - decoded);
+	MUTOTP_PROBE2(base32decode_return, decoded, blocks);
+	return decoded;
+}
+
 static inline int32_t nextmultipleof8(int32_t dividend)
 {
 	int32_t r = dividend - (dividend & ~7); // ((dividend >> 3) << 3);
@@ -140,12 +458,10 @@ static inline int32_t nextmultipleof5(int32_t dividend)
 	return (dividend - (dividend % 5)) + 5;
 }
 
-int32_t base32encode(const char* input, size_t input_len, char* output, size_t output_len)
+static int32_t base32encode_tail(const char* input, size_t input_len, char* output, size_t output_len)
 {
-	//TODO: This works for little endian only!
-	static const char* valtable = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
 	size_t idx = 0, out_idx = 0;
-	int32_t data = 0, bread = 0;
+	uint32_t data = 0, bread = 0;
 	for(; idx < input_len; ++idx)
 	{
 		data |= input[idx] & 0x0FF;
@@ -159,11 +475,11 @@ int32_t base32encode(const char* input, size_t input_len, char* output, size_t o
 			{
 				return -1;
 			}
-			output[out_idx] = valtable[(data & 0xF8000000) >> 27];
-			output[out_idx + 1] = valtable[(data & 0x7c00000) >> 22];
-			output[out_idx + 2] = valtable[(data & 0x3e0000) >> 17];
-			output[out_idx + 3] = valtable[(data & 0x1f000) >> 12];
-			output[out_idx + 4] = valtable[(data & 0xf80) >> 7];
+			output[out_idx] = alphabet[(data & 0xF8000000) >> 27];
+			output[out_idx + 1] = alphabet[(data & 0x7c00000) >> 22];
+			output[out_idx + 2] = alphabet[(data & 0x3e0000) >> 17];
+			output[out_idx + 3] = alphabet[(data & 0x1f000) >> 12];
+			output[out_idx + 4] = alphabet[(data & 0xf80) >> 7];
 			out_idx += 5;
 			data = remainder;
 			bread -= 25;
@@ -178,7 +494,7 @@ int32_t base32encode(const char* input, size_t input_len, char* output, size_t o
 		uint32_t remainderbits = 32 - (bread + 8);
 		size_t idx = 0;
 
-		size_t times = bread % 5 ? (nextmultipleof5(bread) / 5) : bread/5;
+		size_t times = bread % 5 ? (size_t) (nextmultipleof5(bread) / 5) : bread / 5;
 
 		data <<= remainderbits;
 
@@ -190,7 +506,7 @@ int32_t base32encode(const char* input, size_t input_len, char* output, size_t o
 		for(; idx < times; ++idx)
 		{
 			uint32_t bitshift = 5 * idx;
-			output[out_idx + idx] = valtable[(data & (0xF8000000 >> bitshift)) >> (27 - bitshift)];
+			output[out_idx + idx] = alphabet[(data & (0xF8000000 >> bitshift)) >> (27 - bitshift)];
 			bread -= 5;
 		}
 		out_idx += idx;
@@ -202,7 +518,7 @@ int32_t base32encode(const char* input, size_t input_len, char* output, size_t o
 
 		if(nextmultiple != ((out_idx - 1) + 8))
 		{
-			if(nextmultiple + 1 >= output_len)
+			if(nextmultiple >= output_len)
 			{
 				return -1;
 			}
@@ -218,3 +534,223 @@ int32_t base32encode(const char* input, size_t input_len, char* output, size_t o
 
 	return out_idx;
 }
+
+int32_t base32encode(const char* input, size_t input_len, char* output, size_t output_len)
+{
+	//Whole blocks go through the kernel as long as their output still
+	//leaves room for the terminator
+	size_t blocks = input_len / 5;
+	size_t room = output_len ? (output_len - 1) / 8 : 0;
+	if(blocks > room)
+	{
+		blocks = room;
+	}
+
+	if(blocks)
+	{
+		base32_kernels()->encode_blocks((const uint8_t*) input, blocks, output);
+	}
+	if(output_len)
+	{
+		output[blocks * 8] = 0;
+	}
+
+	int32_t tail = base32encode_tail(&input[blocks * 5], input_len - blocks * 5,
+					&output[blocks * 8], output_len - blocks * 8);
+	return tail < 0 ? -1 : (int32_t) (blocks * 8) + tail;
+}
+
+//Characters used by a final quantum holding 0-4 bytes; the rest is padding
+static const uint8_t partialchars[5] = {0, 2, 4, 5, 7};
+
+void base32_encoder_init(struct base32_encoder* enc)
+{
+	memset(enc, 0, sizeof(struct base32_encoder));
+}
+
+int32_t base32_encode_update(struct base32_encoder* enc, struct base32_span input,
+		char* output, size_t output_len)
+{
+	const uint8_t* in = (const uint8_t*) input.data;
+	size_t len = input.len;
+	size_t blocks = (enc->npending + len) / 5;
+	if(blocks > output_len / 8 || blocks * 8 > INT32_MAX)
+	{
+		return -1;
+	}
+
+	const struct base32_kernels* kernels = base32_kernels();
+	size_t out_idx = 0;
+	if(enc->npending && blocks)
+	{
+		size_t take = 5 - enc->npending;
+		memcpy(&enc->pending[enc->npending], in, take);
+		kernels->encode_blocks(enc->pending, 1, output);
+		enc->npending = 0;
+		in += take;
+		len -= take;
+		out_idx = 8;
+	}
+
+	kernels->encode_blocks(in, len / 5, &output[out_idx]);
+	out_idx += (len / 5) * 8;
+	in += (len / 5) * 5;
+	len %= 5;
+
+	memcpy(&enc->pending[enc->npending], in, len);
+	enc->npending += len;
+	return out_idx;
+}
+
+int32_t base32_encode_final(struct base32_encoder* enc, char* output, size_t output_len)
+{
+	size_t chars = enc->npending ? 8 : 0;
+	if(chars > output_len)
+	{
+		return -1;
+	}
+	if(chars)
+	{
+		memset(&enc->pending[enc->npending], 0, 5 - enc->npending);
+		encode_blocks_scalar(enc->pending, 1, output);
+		memset(&output[partialchars[enc->npending]], '=', 8 - partialchars[enc->npending]);
+	}
+	base32_encoder_init(enc);
+	return chars;
+}
+
+void base32_decoder_init(struct base32_decoder* dec)
+{
+	memset(dec, 0, sizeof(struct base32_decoder));
+}
+
+static int32_t decode_last_quantum(const char* input, size_t len, uint8_t* output)
+{
+	//The len (under 8) characters of the last quantum, without padding
+	size_t nbytes = len * 5 / 8;
+	if(len >= 8 || partialchars[nbytes] != len)
+	{
+		return -1;
+	}
+
+	char block[8];
+	uint8_t bytes[5];
+	memcpy(block, input, len);
+	memset(&block[len], 'A', 8 - len);
+	if(decode_blocks_scalar(block, 1, bytes) != 1)
+	{
+		return -1;
+	}
+	memcpy(output, bytes, nbytes);
+	return nbytes;
+}
+
+static int32_t decode_quantum(struct base32_decoder* dec, const char* block, uint8_t* output)
+{
+	//One 8 character quantum, which may be the padded last one of the stream
+	if(dec->finished)
+	{
+		return -1;
+	}
+	if(decode_blocks_scalar(block, 1, output) == 1)
+	{
+		return 5;
+	}
+
+	size_t len = 0;
+	while(len < 8 && block[len] != '=')
+	{
+		++len;
+	}
+	size_t end = len;
+	while(end < 8 && block[end] == '=')
+	{
+		++end;
+	}
+	//No padding means the quantum failed on an invalid character
+	if(!len || len == 8 || end != 8)
+	{
+		return -1;
+	}
+	dec->finished = 1;
+	return decode_last_quantum(block, len, output);
+}
+
+int32_t base32_decode_update(struct base32_decoder* dec, struct base32_span input,
+		char* output, size_t output_len)
+{
+	const char* in = input.data;
+	size_t len = input.len;
+	size_t quanta = (dec->npending + len) / 8;
+	if(quanta > output_len / 5 || quanta * 5 > INT32_MAX)
+	{
+		return -1;
+	}
+
+	const struct base32_kernels* kernels = base32_kernels();
+	uint8_t* out = (uint8_t*) output;
+	size_t out_idx = 0;
+	if(dec->npending && quanta)
+	{
+		size_t take = 8 - dec->npending;
+		memcpy(&dec->pending[dec->npending], in, take);
+		dec->npending = 0;
+		in += take;
+		len -= take;
+
+		int32_t decoded = decode_quantum(dec, dec->pending, out);
+		if(decoded < 0)
+		{
+			return -1;
+		}
+		out_idx = decoded;
+	}
+
+	while(len >= 8)
+	{
+		if(dec->finished)
+		{
+			return -1;
+		}
+
+		//The kernels stop at the first quantum with padding or an invalid
+		//character; that one is sorted out by decode_quantum
+		size_t blocks = kernels->decode_blocks(in, len / 8, &out[out_idx]);
+		in += blocks * 8;
+		len -= blocks * 8;
+		out_idx += blocks * 5;
+
+		if(len >= 8)
+		{
+			int32_t decoded = decode_quantum(dec, in, &out[out_idx]);
+			if(decoded < 0)
+			{
+				return -1;
+			}
+			in += 8;
+			len -= 8;
+			out_idx += decoded;
+		}
+	}
+
+	if(len && dec->finished)
+	{
+		//Data after the padding
+		return -1;
+	}
+	memcpy(&dec->pending[dec->npending], in, len);
+	dec->npending += len;
+	return out_idx;
+}
+
+int32_t base32_decode_final(struct base32_decoder* dec, char* output, size_t output_len)
+{
+	int32_t decoded = 0;
+	if(dec->npending)
+	{
+		decoded = (size_t) dec->npending * 5 / 8 > output_len ? -1 :
+			decode_last_quantum(dec->pending, dec->npending, (uint8_t*) output);
+	}
+	base32_decoder_init(dec);
+	return decoded;
+}
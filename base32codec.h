@@ -24,6 +24,11 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 //Returns -1 on error, otherwise returns amount of bytes in output
 int32_t base32decode(const char* input, size_t input_len,
 		char* output, size_t output_len);
@@ -31,4 +36,93 @@ int32_t base32decode(const char* input, size_t input_len,
 int32_t base32encode(const char* input, size_t input_len,
 		char* output, size_t output_len);
 
+enum base32_impl
+{
+	BASE32_IMPL_AUTO = 0,
+	BASE32_IMPL_SCALAR,
+	BASE32_IMPL_SSSE3,
+	BASE32_IMPL_AVX2
+};
+
+int base32_set_impl(enum base32_impl impl);
+/* base32_set_impl: selects the kernels used for whole 5 byte/8 character
+ * blocks. BASE32_IMPL_AUTO (the default) picks the widest the CPU supports.
+ * Returns 0 on success and -1 if impl is not available on this CPU or build.
+ * Every implementation produces identical output.
+ */
+
+enum base32_impl base32_get_impl(void);
+/* base32_get_impl: returns the implementation currently in use */
+
+//Streaming codec. Input is passed as spans that are read in place; whole
+//blocks go straight from the span to the output through the block kernels
+//and only a partial quantum (under 5 bytes or 8 characters) is carried over
+//between calls, so a stream of any size is coded in constant memory.
+
+struct base32_span
+{
+	const char* data;
+	size_t len;
+};
+
+//Output space that always suffices for an update with len bytes of input
+#define BASE32_ENCODE_BOUND(len) ((((len) + 4) / 5) * 8)
+#define BASE32_DECODE_BOUND(len) ((((len) + 7) / 8) * 5)
+
+//Output space that always suffices for final()
+#define BASE32_ENCODE_FINAL_MAX 8
+#define BASE32_DECODE_FINAL_MAX 4
+
+struct base32_encoder
+{
+	uint8_t pending[5];
+	uint8_t npending;
+};
+
+struct base32_decoder
+{
+	char pending[8];
+	uint8_t npending;
+	uint8_t finished;	//A padded quantum was decoded; only the end may follow
+};
+
+void base32_encoder_init(struct base32_encoder* enc);
+
+int32_t base32_encode_update(struct base32_encoder* enc, struct base32_span input,
+		char* output, size_t output_len);
+/* base32_encode_update: encodes as many whole quanta as the bytes carried
+ * over plus input make up, and keeps the rest for the next call. Returns the
+ * number of characters written (never NUL-terminated), or -1 if output_len is
+ * below BASE32_ENCODE_BOUND(input.len) and the output did not fit.
+ */
+
+int32_t base32_encode_final(struct base32_encoder* enc, char* output, size_t output_len);
+/* base32_encode_final: encodes the carried over bytes, padded with '=' to a
+ * multiple of 8 characters, and resets enc for a new stream. Returns the
+ * number of characters written (0 to 8), or -1 if they did not fit.
+ */
+
+void base32_decoder_init(struct base32_decoder* dec);
+
+int32_t base32_decode_update(struct base32_decoder* dec, struct base32_span input,
+		char* output, size_t output_len);
+/* base32_decode_update: decodes as many whole 8 character quanta as the
+ * characters carried over plus input make up, and keeps the rest for the next
+ * call. Upper and lower case are accepted. '=' is only accepted as padding of
+ * the last quantum of the stream. Returns the number of bytes written, or -1
+ * on an invalid character, misplaced padding, data after the padding or if the
+ * output did not fit. After an error the decoder must be initialized again.
+ */
+
+int32_t base32_decode_final(struct base32_decoder* dec, char* output, size_t output_len);
+/* base32_decode_final: decodes an unpadded partial quantum left at the end of
+ * the stream, if any, and resets dec for a new stream. Returns the number of
+ * bytes written (0 to 4), or -1 if the leftover characters cannot end a
+ * base32 stream or the output did not fit.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
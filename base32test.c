@@ -93,6 +93,153 @@ int check_decode()
 	}
 	return 0;
 }
+//Every kernel must match the scalar one, on lengths covering the SIMD loops,
+//their scalar tails and the padded remainder
+int check_impls()
+{
+	static const enum base32_impl impls[] = {
+		BASE32_IMPL_SSSE3, BASE32_IMPL_AVX2
+	};
+	char input[300], expected[512], encoded[512], decoded[300];
+	size_t len = 0;
+	srand(1);
+	for(; len < sizeof(input); ++len)
+	{
+		size_t idx = 0;
+		for(; idx < len; ++idx)
+		{
+			input[idx] = rand();
+		}
+
+		base32_set_impl(BASE32_IMPL_SCALAR);
+		int32_t enclen = base32encode(input, len, expected, sizeof(expected));
+		if(enclen < 0 || base32decode(expected, enclen, decoded, len) != (int32_t) len ||
+			memcmp(input, decoded, len) != 0)
+		{
+			return -1;
+		}
+
+		for(idx = 0; idx < sizeof(impls)/sizeof(impls[0]); ++idx)
+		{
+			if(base32_set_impl(impls[idx]) < 0)
+			{
+				continue;
+			}
+			memset(encoded, 0, sizeof(encoded));
+			if(base32encode(input, len, encoded, sizeof(encoded)) != enclen ||
+				strcmp(encoded, expected) != 0)
+			{
+				return -1;
+			}
+
+			//Lowercase input decodes the same
+			size_t cidx = 0;
+			for(; cidx < (size_t) enclen; ++cidx)
+			{
+				encoded[cidx] = (cidx & 1) && encoded[cidx] >= 'A' ? encoded[cidx] | 0x20 : encoded[cidx];
+			}
+			if(base32decode(encoded, enclen, decoded, len) != (int32_t) len ||
+				memcmp(input, decoded, len) != 0)
+			{
+				return -1;
+			}
+
+			//An invalid character anywhere is rejected
+			if(enclen > 0)
+			{
+				encoded[len % enclen] = '1';
+				if(base32decode(encoded, enclen, decoded, len) >= 0)
+				{
+					return -1;
+				}
+			}
+		}
+	}
+	base32_set_impl(BASE32_IMPL_AUTO);
+	return 0;
+}
+
+//Feeding the stream codecs in random chunks must give the one-shot output
+int check_stream()
+{
+	char input[1000], expected[1700], encoded[1700], decoded[1000];
+	size_t len = 0;
+	srand(2);
+	for(; len < sizeof(input); len += 1 + len / 8)
+	{
+		size_t idx = 0;
+		for(; idx < len; ++idx)
+		{
+			input[idx] = rand();
+		}
+		int32_t enclen = base32encode(input, len, expected, sizeof(expected));
+
+		struct base32_encoder enc;
+		base32_encoder_init(&enc);
+		size_t pos = 0, out = 0;
+		while(pos < len)
+		{
+			size_t chunk = 1 + rand() % 40;
+			chunk = chunk < len - pos ? chunk : len - pos;
+			struct base32_span span = {&input[pos], chunk};
+			int32_t n = base32_encode_update(&enc, span, &encoded[out], sizeof(encoded) - out);
+			if(n < 0)
+			{
+				return -1;
+			}
+			pos += chunk;
+			out += n;
+		}
+		int32_t n = base32_encode_final(&enc, &encoded[out], sizeof(encoded) - out);
+		if(n < 0 || (int32_t) (out + n) != enclen || memcmp(encoded, expected, enclen) != 0)
+		{
+			return -1;
+		}
+
+		struct base32_decoder dec;
+		base32_decoder_init(&dec);
+		for(pos = 0, out = 0; pos < (size_t) enclen;)
+		{
+			size_t chunk = 1 + rand() % 40;
+			chunk = chunk < enclen - pos ? chunk : enclen - pos;
+			struct base32_span span = {&encoded[pos], chunk};
+			n = base32_decode_update(&dec, span, &decoded[out], sizeof(decoded) - out);
+			if(n < 0)
+			{
+				return -1;
+			}
+			pos += chunk;
+			out += n;
+		}
+		n = base32_decode_final(&dec, &decoded[out], sizeof(decoded) - out);
+		if(n < 0 || out + n != len || memcmp(decoded, input, len) != 0)
+		{
+			return -1;
+		}
+	}
+
+	//Unpadded streams decode; padding anywhere but the end does not
+	static const char* valid[] = {"MZXW6YQ", "MZXW6YTBOI", "mzxw6ytboi======"};
+	static const char* invalid[] = {"MY======MZXQ====", "MZ=XW6==", "MZXW6YTBO", "========",
+		"ABCDEFG!", "MZXW6YTBABCDEFG!", "MZXW6Y!"};
+	size_t idx = 0;
+	for(; idx < sizeof(valid)/sizeof(valid[0]) + sizeof(invalid)/sizeof(invalid[0]); ++idx)
+	{
+		int isvalid = idx < sizeof(valid)/sizeof(valid[0]);
+		const char* str = isvalid ? valid[idx] : invalid[idx - sizeof(valid)/sizeof(valid[0])];
+		struct base32_decoder dec;
+		struct base32_span span = {str, strlen(str)};
+		base32_decoder_init(&dec);
+		int32_t n = base32_decode_update(&dec, span, decoded, sizeof(decoded));
+		int32_t last = n < 0 ? -1 : base32_decode_final(&dec, &decoded[n], sizeof(decoded) - n);
+		if((last >= 0) != isvalid)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
 Suite* b32_test_suite(void)
 {
@@ -119,8 +266,14 @@ int main(void)
 
 	return tests_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 	*/
-	printf("Decoder test %s.\n", check_decode() < 0 ? "failed" : "passed");
-	printf("Encoder test %s.\n", check_encode() < 0 ? "failed" : "passed");
+	int decodefailed = check_decode() < 0;
+	printf("Decoder test %s.\n", decodefailed ? "failed" : "passed");
+	int encodefailed = check_encode() < 0;
+	printf("Encoder test %s.\n", encodefailed ? "failed" : "passed");
+	int kernelfailed = check_impls() < 0;
+	printf("Kernel test %s.\n", kernelfailed ? "failed" : "passed");
+	int streamfailed = check_stream() < 0;
+	printf("Stream test %s.\n", streamfailed ? "failed" : "passed");
 
-	return 0;
+	return decodefailed || encodefailed || kernelfailed || streamfailed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,600 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+//totp_bench: microbenchmarks for the TOTP crypto path.
+//
+//Every case is warmed up, calibrated to a batch of iterations that takes
+//about --batch-us, then timed over a number of runs. ns/op is reported as
+//min, mean, p50, p90, p99 and max over the runs, ops/s from the median.
+//Results go to stdout as a table and optionally to a JSON file, and can be
+//compared against a JSON file from an earlier run. With -p, hardware counters
+//(cycles, instructions, branch and L1D misses) are read around the timed runs
+//and reported per op along with IPC.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sha1.h"
+#include "totp.h"
+#include "base32codec.h"
+#include "ratelimit.h"
+#include "replay.h"
+#include "perfevents.h"
+
+struct bench_case
+{
+	const char* name;
+	void (*run)(size_t iters);
+};
+
+struct bench_result
+{
+	const char* name;
+	size_t iters;	//Per run
+	size_t runs;
+	double min, mean, p50, p90, p99, max;	//ns per op
+	int counted;				//Whether perop holds hardware counts
+	double perop[PERF_COUNTER_COUNT];	//Counter events per op
+};
+
+//Results are folded in here so that nothing is optimized away
+static volatile uint32_t bench_sink;
+
+static uint8_t bench_key[20];
+static struct hmacsha1_key bench_hmac_key;
+static uint8_t bench_block[64];
+static char bench_secret[33];
+static char bench_bulk[4096];
+static char bench_bulkencoded[BASE32_ENCODE_BOUND(4096) + 1];
+static struct ratelimit* bench_users;
+static struct replay_table* bench_replay;
+
+static void bench_init(void)
+{
+	size_t idx = 0;
+	srand(1);
+	for(; idx < sizeof(bench_key); ++idx)
+	{
+		bench_key[idx] = rand();
+	}
+	hmacsha1_key_init(&bench_hmac_key, (const char*) bench_key, sizeof(bench_key));
+	for(idx = 0; idx < sizeof(bench_block); ++idx)
+	{
+		bench_block[idx] = rand();
+	}
+	for(idx = 0; idx < sizeof(bench_bulk); ++idx)
+	{
+		bench_bulk[idx] = rand();
+	}
+	base32encode((const char*) bench_key, sizeof(bench_key), bench_secret, sizeof(bench_secret));
+	base32encode(bench_bulk, sizeof(bench_bulk), bench_bulkencoded, sizeof(bench_bulkencoded));
+
+	//One attempt, then locked out for longer than any run
+	struct ratelimit_options rlopts = {1024, 1, 0.001, 3600000, 3600000};
+	bench_users = ratelimit_create(&rlopts);
+	ratelimit_acquire(bench_users, 1, ratelimit_now());
+
+	//Only this process maps the table, so its segment can go straight away
+	char replayname[64];
+	snprintf(replayname, sizeof(replayname), "/totp_bench-%d", (int) getpid());
+	bench_replay = replay_table_open(replayname, 1 << 16);
+	replay_table_unlink(replayname);
+}
+
+static void run_sha1_transform(size_t iters)
+{
+	uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		SHA1Transform(state, bench_block);
+	}
+	bench_sink += state[0];
+}
+
+static void run_hmacsha1(size_t iters)
+{
+	char mac[64];
+	uint64_t counter = 0;
+	size_t idx = 0;
+	for(; idx < iters; ++idx, ++counter)
+	{
+		hmacsha1(mac, (const char*) bench_key, sizeof(bench_key),
+			(const char*) &counter, sizeof(counter));
+		bench_sink += mac[0];
+	}
+}
+
+static void run_hmacsha1_midstate(size_t iters)
+{
+	char mac[HMACSHA1_DIGEST_SIZE];
+	uint64_t counter = 0;
+	size_t idx = 0;
+	for(; idx < iters; ++idx, ++counter)
+	{
+		hmacsha1_key_mac(&bench_hmac_key, mac, (const char*) &counter, sizeof(counter));
+		bench_sink += mac[0];
+	}
+}
+
+static void run_compute_totp(size_t iters)
+{
+	time_t now = 1600000000;
+	size_t idx = 0;
+	for(; idx < iters; ++idx, now += 30)
+	{
+		bench_sink += compute_totp((const char*) bench_key, sizeof(bench_key), now, 30, 6);
+	}
+}
+
+static void run_hotp_resync_200(size_t iters)
+{
+	//Worst case: the pair is at the far end of a 200 counter window
+	int32_t code = compute_hotp((const char*) bench_key, sizeof(bench_key), 199, 6);
+	int32_t nextcode = compute_hotp((const char*) bench_key, sizeof(bench_key), 200, 6);
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		uint64_t counter = 0;
+		bench_sink += hotp_resync((const char*) bench_key, sizeof(bench_key), code, nextcode,
+					6, 200, &counter);
+	}
+}
+
+static void run_verify_derived(size_t iters)
+{
+	//Derivation from the master key midstate, then a window of three steps
+	time_t now = 1600000000;
+	size_t idx = 0;
+	for(; idx < iters; ++idx, now += 30)
+	{
+		bench_sink += totp_verify_derived(&bench_hmac_key, "player#12345", 12, 0, 123456,
+						now, 30, 6, 1, 0);
+	}
+}
+
+static void run_verify_throttled(size_t iters)
+{
+	//A guess from a locked out user, turned away before any hashing
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		bench_sink += totp_verify_limited(bench_users, 1, 0, 0, (const char*) bench_key,
+						sizeof(bench_key), 123456, 1600000000, 30, 6, 1, 0);
+	}
+}
+
+static void run_replay_commit(size_t iters)
+{
+	//Accepting a new step for one of 4096 users in the shared table; the
+	//step keeps rising across runs so every commit succeeds
+	static uint64_t counter = 0;
+	size_t idx = 0;
+	for(; bench_replay && idx < iters; ++idx)
+	{
+		counter += !(idx & 4095);
+		bench_sink += replay_table_commit(bench_replay, idx & 4095, counter, 0);
+	}
+}
+
+static void run_base32decode(size_t iters)
+{
+	char out[21];
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		bench_sink += base32decode(bench_secret, 32, out, sizeof(out));
+	}
+}
+
+static void run_base32decode_4k(size_t iters)
+{
+	static char out[4097];
+	size_t len = strlen(bench_bulkencoded);
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		bench_sink += base32decode(bench_bulkencoded, len, out, sizeof(out));
+	}
+}
+
+static void run_base32encode(size_t iters)
+{
+	char out[33];
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		bench_sink += base32encode((const char*) bench_key, sizeof(bench_key), out, sizeof(out));
+	}
+}
+
+static void run_generate_random_secret(size_t iters)
+{
+	char out[33];
+	size_t idx = 0;
+	for(; idx < iters; ++idx)
+	{
+		bench_sink += generate_random_secret(out, sizeof(out), 0);
+	}
+}
+
+static const struct bench_case bench_cases[] =
+{
+	{"sha1_transform", run_sha1_transform},
+	{"hmacsha1", run_hmacsha1},
+	{"hmacsha1_midstate", run_hmacsha1_midstate},
+	{"compute_totp", run_compute_totp},
+	{"hotp_resync_200", run_hotp_resync_200},
+	{"verify_derived", run_verify_derived},
+	{"verify_throttled", run_verify_throttled},
+	{"replay_commit", run_replay_commit},
+	{"base32decode", run_base32decode},
+	{"base32decode_4k", run_base32decode_4k},
+	{"base32encode", run_base32encode},
+	{"generate_random_secret", run_generate_random_secret}
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_batch(const struct bench_case* bc, size_t iters)
+{
+	double start = now_ns();
+	bc->run(iters);
+	return now_ns() - start;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, size_t count, double pct)
+{
+	//Nearest rank
+	size_t rank = (size_t) (pct / 100.0 * count + 0.999999);
+	return sorted[rank ? rank - 1 : 0];
+}
+
+static void bench_measure(const struct bench_case* bc, double warmupns, double batchns,
+		size_t runs, double* samples, struct perf_counters* pc, struct bench_result* result)
+{
+	//Warm caches, branch predictors and clocks up before anything counts
+	double start = now_ns();
+	size_t iters = 1;
+	while(now_ns() - start < warmupns)
+	{
+		time_batch(bc, iters);
+		iters = iters < (1 << 20) ? iters * 2 : iters;
+	}
+
+	//Grow the batch until one takes at least batchns
+	iters = 1;
+	for(;;)
+	{
+		double elapsed = time_batch(bc, iters);
+		if(elapsed >= batchns || iters >= ((size_t) 1 << 32))
+		{
+			break;
+		}
+		double scale = elapsed > 0 ? batchns / elapsed : 16;
+		iters = (size_t) (iters * (scale > 16 ? 16 : scale * 1.1)) + 1;
+	}
+
+	//Counters are switched on around each timed run but outside its clock
+	//reads, so they cost the timings nothing
+	uint64_t counts[PERF_COUNTER_COUNT] = {0};
+	size_t run = 0;
+	double sum = 0;
+	for(; run < runs; ++run)
+	{
+		if(pc)
+		{
+			perf_counters_start(pc);
+		}
+		samples[run] = time_batch(bc, iters) / iters;
+		if(pc)
+		{
+			perf_counters_stop(pc, counts);
+		}
+		sum += samples[run];
+	}
+	qsort(samples, runs, sizeof(double), compare_double);
+
+	result->name = bc->name;
+	result->iters = iters;
+	result->runs = runs;
+	result->min = samples[0];
+	result->mean = sum / runs;
+	result->p50 = percentile(samples, runs, 50);
+	result->p90 = percentile(samples, runs, 90);
+	result->p99 = percentile(samples, runs, 99);
+	result->max = samples[runs - 1];
+	result->counted = pc != 0;
+	for(run = 0; run < PERF_COUNTER_COUNT; ++run)
+	{
+		result->perop[run] = (double) counts[run] / ((double) iters * runs);
+	}
+}
+
+static void print_counter(const struct perf_counters* pc, const struct bench_result* r,
+		enum perf_counter counter)
+{
+	if(perf_counters_has(pc, counter))
+	{
+		printf(" %10.2f", r->perop[counter]);
+	}
+	else
+	{
+		printf(" %10s", "-");
+	}
+}
+
+static void write_json(FILE* fp, const struct bench_result* results, size_t count,
+		const struct perf_counters* pc)
+{
+	//One benchmark per line, which is what read_baseline relies on
+	fprintf(fp, "{\"benchmarks\": [\n");
+	size_t idx = 0;
+	for(; idx < count; ++idx)
+	{
+		const struct bench_result* r = &results[idx];
+		fprintf(fp, "  {\"name\": \"%s\", \"iterations\": %zu, \"runs\": %zu, "
+			"\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"min\": %.3f, \"mean\": %.3f, "
+			"\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f",
+			r->name, r->iters, r->runs, r->p50, 1e9 / r->p50, r->min, r->mean,
+			r->p50, r->p90, r->p99, r->max);
+		size_t counter = 0;
+		for(; r->counted && counter < PERF_COUNTER_COUNT; ++counter)
+		{
+			if(perf_counters_has(pc, counter))
+			{
+				fprintf(fp, ", \"%s_per_op\": %.3f", perf_counter_name(counter),
+					r->perop[counter]);
+			}
+		}
+		if(r->counted && perf_counters_has(pc, PERF_CYCLES) &&
+			perf_counters_has(pc, PERF_INSTRUCTIONS) && r->perop[PERF_CYCLES] > 0)
+		{
+			fprintf(fp, ", \"ipc\": %.3f", r->perop[PERF_INSTRUCTIONS] / r->perop[PERF_CYCLES]);
+		}
+		fprintf(fp, "}%s\n", idx + 1 < count ? "," : "");
+	}
+	fprintf(fp, "]}\n");
+}
+
+static char* read_file(const char* path)
+{
+	FILE* fp = fopen(path, "r");
+	if(!fp)
+	{
+		return 0;
+	}
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	char* buf = len >= 0 ? (char*) malloc(len + 1) : 0;
+	if(buf)
+	{
+		buf[fread(buf, 1, len, fp)] = 0;
+	}
+	fclose(fp);
+	return buf;
+}
+
+static int read_baseline(const char* json, const char* name, double* nsperop)
+{
+	//Finds "name": "<name>" and the ns_per_op on the same line
+	char key[128];
+	snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+	const char* entry = strstr(json, key);
+	if(!entry)
+	{
+		return -1;
+	}
+	const char* eol = strchr(entry, '\n');
+	const char* field = strstr(entry, "\"ns_per_op\": ");
+	if(!field || (eol && field > eol))
+	{
+		return -1;
+	}
+	*nsperop = strtod(field + strlen("\"ns_per_op\": "), 0);
+	return *nsperop > 0 ? 0 : -1;
+}
+
+static int selected(const char* name, int argc, char** argv, int first)
+{
+	if(first >= argc)
+	{
+		return 1;
+	}
+	int idx = first;
+	for(; idx < argc; ++idx)
+	{
+		if(strstr(name, argv[idx]))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [-o json] [-b baseline] [-t pct] [-r runs] [-w ms] [-u us] [-p] [case...]\n"
+		"  -o json      write results as JSON\n"
+		"  -b baseline  compare against an earlier JSON result\n"
+		"  -t pct       median slowdown counted as a regression (default: 10)\n"
+		"  -r runs      timed runs per case (default: 30)\n"
+		"  -w ms        warmup per case (default: 100)\n"
+		"  -u us        minimum time per run (default: 2000)\n"
+		"  -p           count cycles, instructions, branch and L1D misses per op\n"
+		"  case         only run cases whose names contain one of these\n",
+		argv0);
+}
+
+int main(int argc, char** argv)
+{
+	const char* jsonpath = 0;
+	const char* baselinepath = 0;
+	double threshold = 10, warmupms = 100, batchus = 2000;
+	size_t runs = 30;
+	int useperf = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "o:b:t:r:w:u:ph")) != -1)
+	{
+		switch(opt)
+		{
+		case 'o': jsonpath = optarg; break;
+		case 'b': baselinepath = optarg; break;
+		case 't': threshold = strtod(optarg, 0); break;
+		case 'r': runs = strtoul(optarg, 0, 10); break;
+		case 'w': warmupms = strtod(optarg, 0); break;
+		case 'u': batchus = strtod(optarg, 0); break;
+		case 'p': useperf = 1; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(!runs)
+	{
+		runs = 1;
+	}
+
+	char* baseline = 0;
+	if(baselinepath && !(baseline = read_file(baselinepath)))
+	{
+		perror(baselinepath);
+		return EXIT_FAILURE;
+	}
+
+	const size_t ncases = sizeof(bench_cases) / sizeof(bench_cases[0]);
+	struct bench_result results[sizeof(bench_cases) / sizeof(bench_cases[0])];
+	double* samples = (double*) malloc(runs * sizeof(double));
+	if(!samples)
+	{
+		free(baseline);
+		return EXIT_FAILURE;
+	}
+
+	//Without counters (no PMU, or perf_event_paranoid forbids them) the
+	//timings are still worth having
+	struct perf_counters counters;
+	struct perf_counters* pc = 0;
+	if(useperf)
+	{
+		if(perf_counters_open(&counters) > 0)
+		{
+			pc = &counters;
+		}
+		else
+		{
+			fprintf(stderr, "Hardware counters unavailable (%s), timing only; see "
+				"/proc/sys/kernel/perf_event_paranoid\n", strerror(counters.err));
+			perf_counters_close(&counters);
+		}
+	}
+
+	bench_init();
+	printf("%-24s %12s %14s %10s %10s %10s", "benchmark", "ns/op", "ops/s",
+		"min", "p90", "p99");
+	if(pc)
+	{
+		printf(" %10s %10s %6s %10s %10s", "cycles/op", "instr/op", "IPC",
+			"brmiss/op", "l1dmiss/op");
+	}
+	printf(" %10s\n", baseline ? "vs base" : "");
+
+	size_t count = 0, regressions = 0, idx = 0;
+	for(; idx < ncases; ++idx)
+	{
+		if(!selected(bench_cases[idx].name, argc, argv, optind))
+		{
+			continue;
+		}
+		struct bench_result* r = &results[count++];
+		bench_measure(&bench_cases[idx], warmupms * 1e6, batchus * 1e3, runs, samples, pc, r);
+
+		printf("%-24s %12.2f %14.0f %10.2f %10.2f %10.2f", r->name, r->p50,
+			1e9 / r->p50, r->min, r->p90, r->p99);
+		if(pc)
+		{
+			print_counter(pc, r, PERF_CYCLES);
+			print_counter(pc, r, PERF_INSTRUCTIONS);
+			if(perf_counters_has(pc, PERF_CYCLES) && perf_counters_has(pc, PERF_INSTRUCTIONS) &&
+				r->perop[PERF_CYCLES] > 0)
+			{
+				printf(" %6.2f", r->perop[PERF_INSTRUCTIONS] / r->perop[PERF_CYCLES]);
+			}
+			else
+			{
+				printf(" %6s", "-");
+			}
+			print_counter(pc, r, PERF_BRANCH_MISSES);
+			print_counter(pc, r, PERF_L1D_MISSES);
+		}
+		double base;
+		if(baseline && read_baseline(baseline, r->name, &base) == 0)
+		{
+			double change = (r->p50 - base) / base * 100.0;
+			int regressed = change > threshold;
+			regressions += regressed;
+			printf(" %+9.1f%%%s", change, regressed ? "  REGRESSION" : "");
+		}
+		printf("\n");
+	}
+
+	if(jsonpath)
+	{
+		FILE* fp = fopen(jsonpath, "w");
+		if(!fp)
+		{
+			perror(jsonpath);
+		}
+		else
+		{
+			write_json(fp, results, count, pc);
+			fclose(fp);
+		}
+	}
+
+	if(regressions)
+	{
+		fprintf(stderr, "%zu benchmark(s) slower than the baseline by more than %.1f%%\n",
+			regressions, threshold);
+	}
+	if(pc)
+	{
+		perf_counters_close(pc);
+	}
+	free(samples);
+	free(baseline);
+	return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include "csprng.h"
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+struct csprng_state
+{
+	uint32_t key[8];
+	uint8_t buf[CSPRNG_BUFFER_SIZE];
+	size_t pos;		//Next unserved byte in buf
+	size_t sinceseed;	//Bytes served since the last reseed
+	uint32_t forkgen;	//csprng_forkgen at the last reseed
+	int seeded;
+};
+
+static __thread struct csprng_state csprng;
+
+//Bumped in the child after fork() so that every thread state copied into it
+//(only the forking thread's survives) reseeds before serving anything
+static uint32_t csprng_forkgen = 0;
+static pthread_once_t csprng_atfork_once = PTHREAD_ONCE_INIT;
+
+static void csprng_atfork_child(void)
+{
+	__atomic_add_fetch(&csprng_forkgen, 1, __ATOMIC_RELAXED);
+}
+
+static void csprng_register_atfork(void)
+{
+	pthread_atfork(0, 0, csprng_atfork_child);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_block(const uint32_t key[8], uint32_t counter,
+		const uint32_t nonce[3], uint8_t out[64])
+{
+	//RFC 8439 section 2.3, output serialized little endian
+	uint32_t input[16] =
+	{
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		counter, nonce[0], nonce[1], nonce[2]
+	};
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+
+	int round = 0;
+	for(; round < 10; ++round)
+	{
+		QUARTERROUND(x[0], x[4], x[8], x[12]);
+		QUARTERROUND(x[1], x[5], x[9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[8], x[13]);
+		QUARTERROUND(x[3], x[4], x[9], x[14]);
+	}
+
+	size_t idx = 0;
+	for(; idx < 16; ++idx)
+	{
+		uint32_t v = x[idx] + input[idx];
+		out[4 * idx] = v & 0xff;
+		out[4 * idx + 1] = (v >> 8) & 0xff;
+		out[4 * idx + 2] = (v >> 16) & 0xff;
+		out[4 * idx + 3] = (v >> 24) & 0xff;
+	}
+}
+
+static void csprng_refill(struct csprng_state* state)
+{
+	//Each refill uses a fresh key, so the counter and nonce can restart at 0
+	static const uint32_t nonce[3] = {0, 0, 0};
+	uint32_t block = 0;
+	for(; block < CSPRNG_BUFFER_SIZE / 64; ++block)
+	{
+		chacha20_block(state->key, block, nonce, &state->buf[64 * block]);
+	}
+
+	//Fast key erasure: the first 32 bytes of keystream become the next key
+	size_t idx = 0;
+	for(; idx < 8; ++idx)
+	{
+		const uint8_t* k = &state->buf[4 * idx];
+		state->key[idx] = k[0] | (k[1] << 8) | (k[2] << 16) | ((uint32_t) k[3] << 24);
+	}
+	memset(state->buf, 0, sizeof(state->key));
+	state->pos = sizeof(state->key);
+}
+
+static int csprng_seed(struct csprng_state* state)
+{
+	pthread_once(&csprng_atfork_once, csprng_register_atfork);
+
+	uint32_t seed[8];
+	size_t got = 0;
+	while(got < sizeof(seed))
+	{
+		ssize_t r = getrandom((uint8_t*) seed + got, sizeof(seed) - got, 0);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			memset(seed, 0, sizeof(seed));
+			return -1;
+		}
+		got += r;
+	}
+
+	//Mix rather than replace, so a reseed never loses existing entropy
+	size_t idx = 0;
+	for(; idx < 8; ++idx)
+	{
+		state->key[idx] ^= seed[idx];
+	}
+	memset(seed, 0, sizeof(seed));
+
+	state->forkgen = __atomic_load_n(&csprng_forkgen, __ATOMIC_RELAXED);
+	state->sinceseed = 0;
+	state->seeded = 1;
+	csprng_refill(state);
+	return 0;
+}
+
+int csprng_reseed(void)
+{
+	return csprng_seed(&csprng);
+}
+
+int32_t csprng_fill(uint8_t* out, size_t outlen)
+{
+	struct csprng_state* state = &csprng;
+
+	if(!state->seeded || state->sinceseed >= CSPRNG_RESEED_BYTES ||
+		state->forkgen != __atomic_load_n(&csprng_forkgen, __ATOMIC_RELAXED))
+	{
+		if(csprng_seed(state) < 0)
+		{
+			return -1;
+		}
+	}
+
+	size_t filled = 0;
+	while(filled < outlen)
+	{
+		if(state->pos == CSPRNG_BUFFER_SIZE)
+		{
+			csprng_refill(state);
+		}
+
+		size_t avail = CSPRNG_BUFFER_SIZE - state->pos;
+		size_t n = outlen - filled < avail ? outlen - filled : avail;
+		memcpy(&out[filled], &state->buf[state->pos], n);
+		memset(&state->buf[state->pos], 0, n);
+		state->pos += n;
+		filled += n;
+	}
+	state->sinceseed += outlen;
+
+	return outlen > INT32_MAX ? INT32_MAX : (int32_t) outlen;
+}
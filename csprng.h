@@ -0,0 +1,60 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef CSPRNG_H_
+#define CSPRNG_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Keystream bytes generated per refill; the first 32 become the next key
+#define CSPRNG_BUFFER_SIZE 1024
+
+//Output after which a thread mixes fresh getrandom() bytes into its key
+#define CSPRNG_RESEED_BYTES (1 << 20)
+
+int32_t csprng_fill(uint8_t* out, size_t outlen);
+/* csprng_fill: fills out with cryptographically secure random bytes.
+ * Returns outlen (truncated to int32_t) on success, -1 if the kernel random
+ * source could not be read. Its signature matches the rgen argument of
+ * generate_random_secret, which uses it when rgen is NULL.
+ *
+ * Every thread runs its own ChaCha20 generator, seeded from getrandom() on
+ * first use, after every CSPRNG_RESEED_BYTES of output and after fork(). Bytes
+ * are served from a buffered keystream with fast key erasure: each refill of
+ * CSPRNG_BUFFER_SIZE bytes replaces the key, and served bytes are wiped, so a
+ * later compromise of the thread's state does not reveal earlier output.
+ */
+
+int csprng_reseed(void);
+/* csprng_reseed: mixes fresh kernel randomness into the calling thread's
+ * generator now and discards its buffered keystream. Returns 0 on success
+ * and -1 on failure.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
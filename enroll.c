@@ -0,0 +1,346 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include "enroll.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "totp.h"
+#include "qrcode/qrcode.h"
+
+enum
+{
+	SLOT_FREE = 0,	//Owned by the generator
+	SLOT_FILLED,	//Waiting for (or in) a QR encoding thread
+	SLOT_DONE	//Waiting for the writer
+};
+
+struct enroll_slot
+{
+	struct totpuri uri;
+	int32_t ansilen;
+	char ansi[TOTP_QRCODE_ANSI_MAX];
+};
+
+struct enroll_pipeline
+{
+	const char* const* labels;
+	size_t count;
+	const char* issuer;
+	int32_t (*rgen)(uint8_t*, size_t);
+	int render;
+
+	//Record seq always uses slot seq % depth, so records leave the
+	//pipeline in order and at most depth of them are in flight
+	struct enroll_slot* slots;
+	uint8_t* slotstate;
+	size_t depth;
+
+	//Sequence numbers waiting for a QR encoding thread. Never holds more
+	//than depth entries, since every entry owns a slot.
+	size_t* encodequeue;
+	size_t encodehead, encodetail;
+	int generated;
+	int failed;
+
+	pthread_mutex_t lock;
+	pthread_cond_t slotfree;
+	pthread_cond_t encodable;
+	pthread_cond_t done;
+};
+
+static void enroll_wipe(void* p, size_t len)
+{
+	//Volatile so that wiping memory about to be freed is not elided
+	volatile uint8_t* bytes = (volatile uint8_t*) p;
+	size_t idx = 0;
+	for(; idx < len; ++idx)
+	{
+		bytes[idx] = 0;
+	}
+}
+
+static void enroll_free_slots(struct enroll_pipeline* p)
+{
+	//Slots hold secrets, the URIs carrying them and their QR codes
+	if(p->slots)
+	{
+		enroll_wipe(p->slots, p->depth * sizeof(struct enroll_slot));
+	}
+	free(p->slots);
+}
+
+static void enroll_fail(struct enroll_pipeline* p)
+{
+	//Caller holds p->lock
+	p->failed = 1;
+	pthread_cond_broadcast(&p->slotfree);
+	pthread_cond_broadcast(&p->encodable);
+	pthread_cond_broadcast(&p->done);
+}
+
+static void* enroll_generate(void* arg)
+{
+	//Stages 1-3: random generation, base32 encoding, URI build
+	struct enroll_pipeline* p = (struct enroll_pipeline*) arg;
+	size_t seq = 0;
+	for(; seq < p->count; ++seq)
+	{
+		size_t slotidx = seq % p->depth;
+		struct enroll_slot* slot = &p->slots[slotidx];
+
+		pthread_mutex_lock(&p->lock);
+		while(p->slotstate[slotidx] != SLOT_FREE && !p->failed)
+		{
+			pthread_cond_wait(&p->slotfree, &p->lock);
+		}
+		int failed = p->failed;
+		pthread_mutex_unlock(&p->lock);
+		if(failed)
+		{
+			break;
+		}
+
+		char secret[33] = {0};
+		if(generate_random_secret(secret, sizeof(secret), p->rgen) < 0)
+		{
+			pthread_mutex_lock(&p->lock);
+			enroll_fail(p);
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		totpuri_init(&slot->uri, p->labels[seq], p->issuer, secret);
+		enroll_wipe(secret, sizeof(secret));
+		slot->ansilen = 0;
+
+		pthread_mutex_lock(&p->lock);
+		if(p->render)
+		{
+			p->slotstate[slotidx] = SLOT_FILLED;
+			p->encodequeue[p->encodetail++ % p->depth] = seq;
+			pthread_cond_signal(&p->encodable);
+		}
+		else
+		{
+			p->slotstate[slotidx] = SLOT_DONE;
+			pthread_cond_signal(&p->done);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->generated = 1;
+	pthread_cond_broadcast(&p->encodable);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+static void* enroll_encode(void* arg)
+{
+	//Stages 4-5: QR encode and render, with a workspace owned by this thread
+	struct enroll_pipeline* p = (struct enroll_pipeline*) arg;
+
+	uint8_t workspacebytes[QRCODE_WORKSPACE_SIZE(5)];
+	qrcode_workspace workspace;
+	qrcode_initWorkspace(&workspace, workspacebytes, 5);
+
+	for(;;)
+	{
+		pthread_mutex_lock(&p->lock);
+		while(p->encodehead == p->encodetail && !p->generated && !p->failed)
+		{
+			pthread_cond_wait(&p->encodable, &p->lock);
+		}
+		if(p->failed || p->encodehead == p->encodetail)
+		{
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		size_t slotidx = p->encodequeue[p->encodehead++ % p->depth] % p->depth;
+		pthread_mutex_unlock(&p->lock);
+
+		struct enroll_slot* slot = &p->slots[slotidx];
+		slot->ansilen = totpuri_render_ansi(&slot->uri, slot->ansi,
+						sizeof(slot->ansi), &workspace);
+
+		pthread_mutex_lock(&p->lock);
+		if(slot->ansilen < 0)
+		{
+			enroll_fail(p);
+		}
+		else
+		{
+			p->slotstate[slotidx] = SLOT_DONE;
+			pthread_cond_signal(&p->done);
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	return 0;
+}
+
+static int enroll_write(struct enroll_pipeline* p, FILE* out)
+{
+	//Final stage, on the calling thread: stream records out in order
+	size_t seq = 0;
+	for(; seq < p->count; ++seq)
+	{
+		size_t slotidx = seq % p->depth;
+		struct enroll_slot* slot = &p->slots[slotidx];
+
+		pthread_mutex_lock(&p->lock);
+		while(p->slotstate[slotidx] != SLOT_DONE && !p->failed)
+		{
+			pthread_cond_wait(&p->done, &p->lock);
+		}
+		int failed = p->failed;
+		pthread_mutex_unlock(&p->lock);
+		if(failed)
+		{
+			return -1;
+		}
+
+		int werr = fprintf(out, "%s\t%s\t%s\n", p->labels[seq],
+				slot->uri.secret, slot->uri.uristr) < 0;
+		if(p->render && !werr)
+		{
+			werr = fwrite(slot->ansi, 1, slot->ansilen, out) < (size_t) slot->ansilen ||
+				fputc('\n', out) == EOF;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if(werr)
+		{
+			enroll_fail(p);
+		}
+		p->slotstate[slotidx] = SLOT_FREE;
+		pthread_cond_signal(&p->slotfree);
+		pthread_mutex_unlock(&p->lock);
+		if(werr)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int totp_enroll_bulk(const char* const* labels, size_t count,
+		const struct totp_enroll_options* options, FILE* out)
+{
+	const char* issuer = options->issuer ? options->issuer : "";
+	size_t idx = 0;
+	for(; idx < count; ++idx)
+	{
+		if(strlen(labels[idx]) > TOTP_ENROLL_LABEL_MAX)
+		{
+			return -1;
+		}
+	}
+	if(strlen(issuer) > TOTP_ENROLL_LABEL_MAX)
+	{
+		return -1;
+	}
+
+	size_t threads = options->threads;
+	if(!threads)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? (size_t) online : 1;
+	}
+	if(!options->render_qrcode)
+	{
+		threads = 0;
+	}
+
+	struct enroll_pipeline p;
+	memset(&p, 0, sizeof(p));
+	p.labels = labels;
+	p.count = count;
+	p.issuer = issuer;
+	p.rgen = options->rgen;
+	p.render = options->render_qrcode;
+	p.depth = options->queue_depth ? options->queue_depth : 4 * (threads ? threads : 1);
+
+	p.slots = (struct enroll_slot*) malloc(p.depth * sizeof(struct enroll_slot));
+	p.slotstate = (uint8_t*) calloc(p.depth, sizeof(uint8_t));
+	p.encodequeue = (size_t*) malloc(p.depth * sizeof(size_t));
+	pthread_t* workers = (pthread_t*) malloc((threads + 1) * sizeof(pthread_t));
+	if(!p.slots || !p.slotstate || !p.encodequeue || !workers)
+	{
+		enroll_free_slots(&p);
+		free(p.slotstate);
+		free(p.encodequeue);
+		free(workers);
+		return -1;
+	}
+
+	pthread_mutex_init(&p.lock, 0);
+	pthread_cond_init(&p.slotfree, 0);
+	pthread_cond_init(&p.encodable, 0);
+	pthread_cond_init(&p.done, 0);
+
+	pthread_t generator;
+	int result = 0;
+	size_t started = 0;
+	if(pthread_create(&generator, 0, enroll_generate, &p) != 0)
+	{
+		result = -1;
+	}
+	else
+	{
+		for(; started < threads; ++started)
+		{
+			if(pthread_create(&workers[started], 0, enroll_encode, &p) != 0)
+			{
+				break;
+			}
+		}
+
+		if(threads && !started)
+		{
+			pthread_mutex_lock(&p.lock);
+			enroll_fail(&p);
+			pthread_mutex_unlock(&p.lock);
+			result = -1;
+		}
+		else
+		{
+			result = enroll_write(&p, out);
+		}
+
+		pthread_join(generator, 0);
+		for(idx = 0; idx < started; ++idx)
+		{
+			pthread_join(workers[idx], 0);
+		}
+	}
+
+	pthread_cond_destroy(&p.done);
+	pthread_cond_destroy(&p.encodable);
+	pthread_cond_destroy(&p.slotfree);
+	pthread_mutex_destroy(&p.lock);
+
+	free(workers);
+	free(p.encodequeue);
+	free(p.slotstate);
+	enroll_free_slots(&p);
+	return result;
+}
@@ -0,0 +1,74 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef ENROLL_H_
+#define ENROLL_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Longest label or issuer, the limit of the fields in struct totpuri
+#define TOTP_ENROLL_LABEL_MAX 16
+
+struct totp_enroll_options
+{
+	const char* issuer;
+	size_t threads;
+	size_t queue_depth;
+	int render_qrcode;
+	int32_t (*rgen)(uint8_t*, size_t);
+};
+/* Options for totp_enroll_bulk
+ *
+ * issuer - null-terminated issuer name written into every URI
+ * threads - QR encoding/rendering threads; 0 uses one per online CPU
+ * queue_depth - records in flight between the stages; 0 uses 4 per thread
+ * render_qrcode - nonzero to write each record's ANSI QR code after it
+ * rgen - random source, as for generate_random_secret (NULL for csprng_fill)
+ */
+
+int totp_enroll_bulk(const char* const* labels, size_t count,
+		const struct totp_enroll_options* options, FILE* out);
+/* totp_enroll_bulk: provisions a new secret (and QR code) for every label and
+ * streams the results to out, in the order of labels. Returns 0 on success and
+ * -1 if the random source, an encode or a write failed. Nothing is written if
+ * a label or the issuer is longer than TOTP_ENROLL_LABEL_MAX, as the URI would
+ * cut it short and give accounts sharing a prefix identical entries.
+ *
+ * Work runs as a pipeline: one thread generates the random secret, base32
+ * encodes it and builds the URI; a pool of threads encodes and renders the QR
+ * codes, each with its own encoder workspace; the calling thread writes the
+ * records out. The stages hand off through a fixed ring of queue_depth record
+ * slots allocated up front, so nothing is allocated per record.
+ *
+ * Each record is written as "label<TAB>secret<TAB>uri\n", followed by the ANSI
+ * QR code graphic and a newline when render_qrcode is set.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,500 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+//totp_loadgen: login storm load generator for totp_verify.
+//
+//Simulates a population of enrolled users and drives verification attempts
+//at them from several threads, either as fast as possible or at a fixed
+//total rate. Attempts are a configurable mix of:
+//  correct - the OTP of the user's next time step
+//  stale   - an OTP from well outside the accepted window
+//  replay  - the user's last accepted OTP again
+//  garbage - a random number
+//Users are split evenly between threads, so every user's replay state is
+//only touched by one thread, the way a sharded auth server would keep it.
+//Each user's phone clock can be set off by up to -s steps, and -D verifies
+//with totp_verify_drift so that the skew is learned. A verdict other than the
+//one its kind calls for counts as wrong only if no code in the window
+//explains it, so chance matches and skew past the window are not failures.
+//
+//Latency is recorded per attempt in a log-linear (HDR style) histogram. At a
+//fixed rate it is measured from when the attempt was due, not when it was
+//sent, so a stalled thread shows up as latency instead of a lower rate.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "totp.h"
+#include "csprng.h"
+#include "metrics.h"
+
+#define LOADGEN_TIMESTEP 30
+#define LOADGEN_DIGITS 6
+
+//Histogram: values below 2 * LAT_SUB_BUCKETS are exact, above that every
+//power of two is split into LAT_SUB_BUCKETS buckets (about 3% resolution)
+#define LAT_SUB_BITS 5
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 2) * LAT_SUB_BUCKETS)
+
+enum
+{
+	KIND_CORRECT = 0,
+	KIND_STALE,
+	KIND_REPLAY,
+	KIND_GARBAGE,
+	KIND_COUNT
+};
+
+static const char* kind_names[KIND_COUNT] = {"correct", "stale", "replay", "garbage"};
+
+struct latency_histogram
+{
+	uint64_t counts[LAT_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+struct loadgen_user
+{
+	uint8_t secret[20];
+	time_t clock;		//The user's simulated time
+	uint64_t lastcounter;	//Replay state kept for totp_verify
+	int32_t lastcode;	//Last accepted OTP, for replays
+	int32_t skew;		//Steps the user's phone clock is off by
+	struct totp_drift drift;	//Estimate kept for totp_verify_drift
+};
+
+struct loadgen_thread
+{
+	pthread_t thread;
+	struct loadgen_config* config;
+	struct loadgen_user* users;
+	size_t nusers;
+	uint64_t attempts;
+	uint64_t outcomes[KIND_COUNT][3];	//By kind, then OK/INVALID/REPLAYED
+	uint64_t wrong;		//Verdicts no correct verifier could reach
+	uint64_t windowed;	//Unexpected verdicts the window accounts for
+	struct latency_histogram latency;
+};
+
+struct loadgen_config
+{
+	size_t users;
+	size_t threads;
+	double rate;		//Attempts per second over all threads; 0 for no limit
+	double duration;	//Seconds
+	uint32_t window;
+	uint32_t maxskew;	//Largest user clock skew, in steps
+	int drift;		//Verify with totp_verify_drift
+	unsigned mix[KIND_COUNT];	//Relative weights
+	unsigned mixtotal;
+};
+
+static size_t latency_bucket(uint64_t ns)
+{
+	if(ns < 2 * LAT_SUB_BUCKETS)
+	{
+		return ns;
+	}
+	unsigned msb = 63 - __builtin_clzll(ns);
+	unsigned shift = msb - LAT_SUB_BITS;
+	return LAT_SUB_BUCKETS * (shift + 1) + (ns >> shift);
+}
+
+static uint64_t latency_bucket_value(size_t bucket)
+{
+	//Midpoint of the values that land in bucket
+	if(bucket < 2 * LAT_SUB_BUCKETS)
+	{
+		return bucket;
+	}
+	unsigned shift = bucket / LAT_SUB_BUCKETS - 2;
+	uint64_t low = (uint64_t) (bucket - LAT_SUB_BUCKETS * (shift + 1)) << shift;
+	return low + ((1ull << shift) >> 1);
+}
+
+static void latency_record(struct latency_histogram* h, uint64_t ns)
+{
+	size_t bucket = latency_bucket(ns);
+	h->counts[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1] += 1;
+	h->total += 1;
+	h->max = ns > h->max ? ns : h->max;
+}
+
+static void latency_merge(struct latency_histogram* into, const struct latency_histogram* h)
+{
+	size_t idx = 0;
+	for(; idx < LAT_BUCKETS; ++idx)
+	{
+		into->counts[idx] += h->counts[idx];
+	}
+	into->total += h->total;
+	into->max = h->max > into->max ? h->max : into->max;
+}
+
+static uint64_t latency_percentile(const struct latency_histogram* h, double pct)
+{
+	uint64_t rank = (uint64_t) (pct / 100.0 * h->total + 0.5);
+	uint64_t seen = 0;
+	size_t idx = 0;
+	for(; idx < LAT_BUCKETS; ++idx)
+	{
+		seen += h->counts[idx];
+		if(seen >= rank && seen)
+		{
+			uint64_t value = latency_bucket_value(idx);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t xorshift64(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static int pick_kind(const struct loadgen_config* config, uint64_t* rng)
+{
+	unsigned roll = xorshift64(rng) % config->mixtotal;
+	int kind = 0;
+	for(; kind < KIND_COUNT - 1 && roll >= config->mix[kind]; ++kind)
+	{
+		roll -= config->mix[kind];
+	}
+	return kind;
+}
+
+static int verdict_possible(const struct loadgen_config* config, const struct loadgen_user* user,
+		int32_t code, time_t at, uint64_t lastcounter, int result)
+{
+	//Whether a correct verifier could reach result. A six digit code
+	//matches one of the window's steps by chance about once in a million
+	//tries per step, and a clock skewed past the window puts a user's own
+	//code outside it, so any match in the window can decide the verdict.
+	uint64_t counter = at / LOADGEN_TIMESTEP;
+	uint64_t step = counter > config->window ? counter - config->window : 0;
+	int newer = 0, older = 0;
+	for(; step <= counter + config->window; ++step)
+	{
+		if(compute_hotp((const char*) user->secret, sizeof(user->secret), step,
+				LOADGEN_DIGITS) == code)
+		{
+			newer |= step > lastcounter;
+			older |= step <= lastcounter;
+		}
+	}
+	return result == TOTP_VERIFY_OK ? newer :
+		result == TOTP_VERIFY_REPLAYED ? older : !newer && !older;
+}
+
+static void* loadgen_run(void* arg)
+{
+	struct loadgen_thread* t = (struct loadgen_thread*) arg;
+	const struct loadgen_config* config = t->config;
+	uint64_t rng = 0x9E3779B97F4A7C15ull ^ (uintptr_t) t;
+	double interval = config->rate > 0 ? 1e9 * config->threads / config->rate : 0;
+
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t) (config->duration * 1e9);
+	uint64_t due = start;
+	for(;;)
+	{
+		uint64_t sent = now_ns();
+		if(interval > 0)
+		{
+			//Open loop: wait for the attempt's due time, but never skip
+			//attempts that fell behind
+			due = start + (uint64_t) (t->attempts * interval);
+			while(sent < due)
+			{
+				struct timespec pause = {0, due - sent > 50000 ? 50000 : (long) (due - sent)};
+				nanosleep(&pause, 0);
+				sent = now_ns();
+			}
+		}
+		else
+		{
+			due = sent;
+		}
+		if(due >= end)
+		{
+			break;
+		}
+
+		struct loadgen_user* user = &t->users[xorshift64(&rng) % t->nusers];
+		int kind = pick_kind(config, &rng);
+		if(kind == KIND_REPLAY && !user->lastcounter)
+		{
+			kind = KIND_CORRECT;
+		}
+
+		int32_t code;
+		time_t at = user->clock;
+		switch(kind)
+		{
+		case KIND_CORRECT:
+			//The user logs in again one time step later
+			at = user->clock += LOADGEN_TIMESTEP;
+			code = compute_totp((const char*) user->secret, sizeof(user->secret),
+					at + user->skew * LOADGEN_TIMESTEP, LOADGEN_TIMESTEP, LOADGEN_DIGITS);
+			break;
+		case KIND_STALE:
+			code = compute_totp((const char*) user->secret, sizeof(user->secret),
+					at - LOADGEN_TIMESTEP * (config->window + 2),
+					LOADGEN_TIMESTEP, LOADGEN_DIGITS);
+			break;
+		case KIND_REPLAY:
+			code = user->lastcode;
+			break;
+		default:
+			code = xorshift64(&rng) % 1000000;
+			break;
+		}
+
+		//Only the verification itself is on the server's side of the clock
+		uint64_t before = interval > 0 ? due : now_ns();
+		uint64_t lastcounter = user->lastcounter;
+		int result = config->drift ?
+			totp_verify_drift((const char*) user->secret, sizeof(user->secret), code,
+				at, LOADGEN_TIMESTEP, LOADGEN_DIGITS, config->window,
+				&user->lastcounter, &user->drift) :
+			totp_verify((const char*) user->secret, sizeof(user->secret), code,
+				at, LOADGEN_TIMESTEP, LOADGEN_DIGITS, config->window, &user->lastcounter);
+		latency_record(&t->latency, now_ns() - before);
+
+		if(result == TOTP_VERIFY_OK)
+		{
+			user->lastcode = code;
+		}
+		t->outcomes[kind][-result] += 1;
+		t->attempts += 1;
+
+		//Correct codes kept out, or anything else let in, is either down to
+		//the window or a bug
+		if(kind == KIND_CORRECT ? result != TOTP_VERIFY_OK : result == TOTP_VERIFY_OK)
+		{
+			if(verdict_possible(config, user, code, at, lastcounter, result))
+			{
+				t->windowed += 1;
+			}
+			else
+			{
+				t->wrong += 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int parse_mix(const char* arg, struct loadgen_config* config)
+{
+	//correct:stale:replay:garbage
+	if(sscanf(arg, "%u:%u:%u:%u", &config->mix[0], &config->mix[1],
+			&config->mix[2], &config->mix[3]) != 4)
+	{
+		return -1;
+	}
+	config->mixtotal = config->mix[0] + config->mix[1] + config->mix[2] + config->mix[3];
+	return config->mixtotal ? 0 : -1;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [-u users] [-r rate] [-t threads] [-d seconds] [-w window] [-s skew] [-D] [-m mix] [-p]\n"
+		"  -u users    enrolled users (default: 10000)\n"
+		"  -r rate     attempts per second over all threads (default: unlimited)\n"
+		"  -t threads  threads (default: one per CPU)\n"
+		"  -d seconds  duration (default: 5)\n"
+		"  -w window   time steps accepted either side (default: 1)\n"
+		"  -s skew     users' clocks are off by up to this many steps (default: 0)\n"
+		"  -D          verify with drift tracking (totp_verify_drift)\n"
+		"  -m mix      correct:stale:replay:garbage weights (default: 70:10:10:10)\n"
+		"  -p          print the library's metrics in Prometheus format at the end\n",
+		argv0);
+}
+
+int main(int argc, char** argv)
+{
+	struct loadgen_config config;
+	memset(&config, 0, sizeof(config));
+	config.users = 10000;
+	config.duration = 5;
+	config.window = 1;
+	parse_mix("70:10:10:10", &config);
+	int prometheus = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "u:r:t:d:w:s:Dm:ph")) != -1)
+	{
+		switch(opt)
+		{
+		case 'u': config.users = strtoul(optarg, 0, 10); break;
+		case 'r': config.rate = strtod(optarg, 0); break;
+		case 't': config.threads = strtoul(optarg, 0, 10); break;
+		case 'd': config.duration = strtod(optarg, 0); break;
+		case 'w': config.window = strtoul(optarg, 0, 10); break;
+		case 's': config.maxskew = strtoul(optarg, 0, 10); break;
+		case 'D': config.drift = 1; break;
+		case 'p': prometheus = 1; break;
+		case 'm':
+			if(parse_mix(optarg, &config) < 0)
+			{
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(!config.threads)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		config.threads = online > 0 ? (size_t) online : 1;
+	}
+	if(config.users < config.threads)
+	{
+		config.users = config.threads;
+	}
+
+	struct loadgen_user* users = (struct loadgen_user*) calloc(config.users, sizeof(struct loadgen_user));
+	struct loadgen_thread* threads = (struct loadgen_thread*) calloc(config.threads, sizeof(struct loadgen_thread));
+	struct latency_histogram* total = (struct latency_histogram*) calloc(1, sizeof(struct latency_histogram));
+	if(!users || !threads || !total)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	time_t now = time(0);
+	size_t idx = 0;
+	for(; idx < config.users; ++idx)
+	{
+		if(csprng_fill(users[idx].secret, sizeof(users[idx].secret)) < 0)
+		{
+			fprintf(stderr, "Random source failed\n");
+			return EXIT_FAILURE;
+		}
+		users[idx].clock = now;
+		uint32_t r = users[idx].secret[0] | (users[idx].secret[1] << 8);
+		users[idx].skew = config.maxskew ? (int32_t) (r % (2 * config.maxskew + 1)) -
+			(int32_t) config.maxskew : 0;
+	}
+
+	size_t started = 0, first = 0;
+	uint64_t start = now_ns();
+	for(; started < config.threads; ++started)
+	{
+		struct loadgen_thread* t = &threads[started];
+		t->config = &config;
+		t->users = &users[first];
+		t->nusers = config.users / config.threads + (started < config.users % config.threads);
+		first += t->nusers;
+		if(pthread_create(&t->thread, 0, loadgen_run, t) != 0)
+		{
+			break;
+		}
+	}
+	for(idx = 0; idx < started; ++idx)
+	{
+		pthread_join(threads[idx].thread, 0);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	uint64_t attempts = 0, outcomes[KIND_COUNT][3] = {{0}};
+	uint64_t wrong = 0, windowed = 0;
+	for(idx = 0; idx < started; ++idx)
+	{
+		attempts += threads[idx].attempts;
+		wrong += threads[idx].wrong;
+		windowed += threads[idx].windowed;
+		latency_merge(total, &threads[idx].latency);
+		int kind = 0;
+		for(; kind < KIND_COUNT; ++kind)
+		{
+			outcomes[kind][0] += threads[idx].outcomes[kind][0];
+			outcomes[kind][1] += threads[idx].outcomes[kind][1];
+			outcomes[kind][2] += threads[idx].outcomes[kind][2];
+		}
+	}
+
+	printf("users %zu, threads %zu, window %u, skew %u%s, %.1f s\n", config.users, started,
+		config.window, config.maxskew, config.drift ? " (drift tracking)" : "", elapsed);
+	printf("attempts %llu, %.0f verifications/s (%.0f per thread)\n",
+		(unsigned long long) attempts, attempts / elapsed,
+		started ? attempts / elapsed / started : 0);
+	printf("%-8s %12s %12s %12s %12s\n", "kind", "attempts", "ok", "invalid", "replayed");
+	int kind = 0;
+	for(; kind < KIND_COUNT; ++kind)
+	{
+		printf("%-8s %12llu %12llu %12llu %12llu\n", kind_names[kind],
+			(unsigned long long) (outcomes[kind][0] + outcomes[kind][1] + outcomes[kind][2]),
+			(unsigned long long) outcomes[kind][0], (unsigned long long) outcomes[kind][1],
+			(unsigned long long) outcomes[kind][2]);
+	}
+	printf("latency us: p50 %.2f  p90 %.2f  p99 %.2f  p999 %.2f  max %.2f\n",
+		latency_percentile(total, 50) / 1e3, latency_percentile(total, 90) / 1e3,
+		latency_percentile(total, 99) / 1e3, latency_percentile(total, 99.9) / 1e3,
+		total->max / 1e3);
+
+	if(prometheus)
+	{
+		static char text[METRICS_PROMETHEUS_MAX];
+		struct metrics_snapshot snapshot;
+		metrics_snapshot(&snapshot);
+		if(metrics_prometheus(&snapshot, text, sizeof(text)) >= 0)
+		{
+			fputs(text, stdout);
+		}
+	}
+
+	if(windowed)
+	{
+		printf("%llu verdicts were decided by the window: codes matching another step by\n"
+			"chance, or clocks skewed beyond it\n", (unsigned long long) windowed);
+	}
+	if(wrong)
+	{
+		fprintf(stderr, "%llu attempts got the wrong verdict\n", (unsigned long long) wrong);
+	}
+
+	free(total);
+	free(threads);
+	free(users);
+	return wrong || started < config.threads ? EXIT_FAILURE : EXIT_SUCCESS;
+}
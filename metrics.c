@@ -0,0 +1,248 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+struct metrics_shard
+{
+	struct metrics_snapshot values;
+	struct metrics_shard* next;
+} __attribute__((aligned(64)));
+
+static __thread struct metrics_shard* metrics_local;
+
+//Live shards, and the totals of threads that have exited
+static struct metrics_shard* metrics_shards = 0;
+static struct metrics_snapshot metrics_retired;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+static void metrics_add_snapshot(struct metrics_snapshot* into, const struct metrics_snapshot* from)
+{
+	//Loads are atomic as the owning threads may be updating from
+	size_t idx = 0, bucket;
+	for(; idx < METRICS_COUNTER_COUNT; ++idx)
+	{
+		into->counters[idx] += __atomic_load_n(&from->counters[idx], __ATOMIC_RELAXED);
+	}
+	for(idx = 0; idx < METRICS_TIMER_COUNT; ++idx)
+	{
+		const struct metrics_histogram* h = &from->timers[idx];
+		for(bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; ++bucket)
+		{
+			into->timers[idx].buckets[bucket] += __atomic_load_n(&h->buckets[bucket], __ATOMIC_RELAXED);
+		}
+		into->timers[idx].count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+		into->timers[idx].sum_ns += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+	}
+}
+
+static void metrics_retire(void* arg)
+{
+	//Thread exit: fold the shard into the retired totals
+	struct metrics_shard* shard = (struct metrics_shard*) arg;
+	pthread_mutex_lock(&metrics_lock);
+	struct metrics_shard** link = &metrics_shards;
+	while(*link && *link != shard)
+	{
+		link = &(*link)->next;
+	}
+	if(*link)
+	{
+		*link = shard->next;
+	}
+	metrics_add_snapshot(&metrics_retired, &shard->values);
+	pthread_mutex_unlock(&metrics_lock);
+	//Destructors run on the exiting thread, so a later count from another
+	//destructor must allocate a fresh shard rather than reuse this one
+	if(metrics_local == shard)
+	{
+		metrics_local = 0;
+	}
+	free(shard);
+}
+
+static void metrics_create_key(void)
+{
+	pthread_key_create(&metrics_key, metrics_retire);
+}
+
+static struct metrics_shard* metrics_shard(void)
+{
+	struct metrics_shard* shard = metrics_local;
+	if(shard)
+	{
+		return shard;
+	}
+
+	pthread_once(&metrics_key_once, metrics_create_key);
+	void* mem = 0;
+	if(posix_memalign(&mem, 64, sizeof(struct metrics_shard)) != 0)
+	{
+		return 0;
+	}
+	shard = (struct metrics_shard*) mem;
+	memset(shard, 0, sizeof(struct metrics_shard));
+
+	pthread_mutex_lock(&metrics_lock);
+	shard->next = metrics_shards;
+	metrics_shards = shard;
+	pthread_mutex_unlock(&metrics_lock);
+	pthread_setspecific(metrics_key, shard);
+	metrics_local = shard;
+	return shard;
+}
+
+static inline void metrics_bump(uint64_t* value, uint64_t n)
+{
+	//Only the owning thread writes, so a plain load and store will do
+	__atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_count(enum metrics_counter counter, uint64_t n)
+{
+	struct metrics_shard* shard = metrics_shard();
+	if(shard)
+	{
+		metrics_bump(&shard->values.counters[counter], n);
+	}
+}
+
+void metrics_time(enum metrics_timer timer, uint64_t start_ns)
+{
+	struct metrics_shard* shard = metrics_shard();
+	if(!shard)
+	{
+		return;
+	}
+	uint64_t ns = metrics_now() - start_ns;
+	struct metrics_histogram* h = &shard->values.timers[timer];
+	metrics_bump(&h->buckets[63 - __builtin_clzll(ns | 1)], 1);
+	metrics_bump(&h->count, 1);
+	metrics_bump(&h->sum_ns, ns);
+}
+
+void metrics_snapshot(struct metrics_snapshot* out)
+{
+	memset(out, 0, sizeof(struct metrics_snapshot));
+	pthread_mutex_lock(&metrics_lock);
+	metrics_add_snapshot(out, &metrics_retired);
+	struct metrics_shard* shard = metrics_shards;
+	for(; shard; shard = shard->next)
+	{
+		metrics_add_snapshot(out, &shard->values);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static const struct
+{
+	const char* name;
+	const char* help;
+} counter_info[METRICS_COUNTER_COUNT] =
+{
+	{"mutotp_totp_computed_total", "TOTP values computed by compute_totp"},
+	{"mutotp_hmacs_total", "HMAC-SHA1 computations"},
+	{"mutotp_verifications_total", "Calls to totp_verify"},
+	{"mutotp_verify_ok_total", "Codes accepted by totp_verify"},
+	{"mutotp_verify_window_misses_total", "Codes matching no time step in the window"},
+	{"mutotp_verify_replays_total", "Codes rejected as already used"},
+	{"mutotp_verify_widened_total", "Drift guided verifications that missed the expected steps"},
+	{"mutotp_throttled_total", "Attempts rejected by rate limiting before any hashing"},
+	{"mutotp_qrcode_renders_total", "ANSI QR codes rendered"},
+	{"mutotp_qrcode_failures_total", "URIs that did not fit in a QR code"}
+};
+
+static const struct
+{
+	const char* name;
+	const char* help;
+} timer_info[METRICS_TIMER_COUNT] =
+{
+	{"mutotp_compute_totp_seconds", "Latency of compute_totp"},
+	{"mutotp_verify_seconds", "Latency of totp_verify"},
+	{"mutotp_qrcode_seconds", "Latency of encoding and rendering an ANSI QR code"}
+};
+
+//Histogram buckets exposed: le = 2^8 ns (256 ns) to 2^35 ns (34 s)
+#define PROMETHEUS_FIRST_BUCKET 7
+#define PROMETHEUS_LAST_BUCKET 34
+
+int32_t metrics_prometheus(const struct metrics_snapshot* snapshot, char* out, size_t outlen)
+{
+	size_t used = 0;
+	int n;
+#define EMIT(...) \
+	do \
+	{ \
+		n = snprintf(&out[used], used < outlen ? outlen - used : 0, __VA_ARGS__); \
+		if(n < 0 || (used += n) >= outlen) \
+		{ \
+			return -1; \
+		} \
+	} \
+	while(0)
+
+	size_t idx = 0;
+	for(; idx < METRICS_COUNTER_COUNT; ++idx)
+	{
+		EMIT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[idx].name,
+			counter_info[idx].help, counter_info[idx].name, counter_info[idx].name,
+			(unsigned long long) snapshot->counters[idx]);
+	}
+
+	for(idx = 0; idx < METRICS_TIMER_COUNT; ++idx)
+	{
+		const struct metrics_histogram* h = &snapshot->timers[idx];
+		const char* name = timer_info[idx].name;
+		EMIT("# HELP %s %s\n# TYPE %s histogram\n", name, timer_info[idx].help, name);
+
+		uint64_t cumulative = 0;
+		size_t bucket = 0;
+		for(; bucket <= PROMETHEUS_LAST_BUCKET; ++bucket)
+		{
+			cumulative += h->buckets[bucket];
+			if(bucket >= PROMETHEUS_FIRST_BUCKET)
+			{
+				EMIT("%s_bucket{le=\"%.9g\"} %llu\n", name,
+					(double) (1ull << (bucket + 1)) / 1e9, (unsigned long long) cumulative);
+			}
+		}
+		EMIT("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+			(unsigned long long) h->count, name, h->sum_ns / 1e9, name,
+			(unsigned long long) h->count);
+	}
+#undef EMIT
+	return used;
+}
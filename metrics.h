@@ -0,0 +1,112 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef METRICS_H_
+#define METRICS_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Runtime counters and latency histograms for the library's hot paths. Each
+//thread updates its own cache line aligned shard without atomic read-modify-
+//write operations; shards are only summed when a snapshot is taken. Building
+//with -DMUTOTP_NO_METRICS compiles the instrumentation out.
+
+enum metrics_counter
+{
+	METRICS_TOTP_COMPUTED = 0,	//compute_totp calls
+	METRICS_HMACS,			//HMAC-SHA1 computations
+	METRICS_VERIFICATIONS,		//totp_verify calls
+	METRICS_VERIFY_OK,
+	METRICS_VERIFY_WINDOW_MISSES,	//Codes matching no step in the window
+	METRICS_VERIFY_REPLAYS,		//Codes rejected as already used
+	METRICS_VERIFY_WIDENED,		//Drift guided checks that searched the whole window
+	METRICS_THROTTLED,		//Attempts turned away by ratelimit_acquire
+	METRICS_QRCODE_RENDERS,		//ANSI QR codes made
+	METRICS_QRCODE_FAILURES,	//URIs that did not fit a QR code
+	METRICS_COUNTER_COUNT
+};
+
+enum metrics_timer
+{
+	METRICS_TIME_COMPUTE_TOTP = 0,
+	METRICS_TIME_VERIFY,
+	METRICS_TIME_QRCODE,		//Encoding and rendering an ANSI QR code
+	METRICS_TIMER_COUNT
+};
+
+//Bucket i counts latencies in [2^i, 2^(i+1)) ns (bucket 0 also counts 0)
+#define METRICS_HISTOGRAM_BUCKETS 64
+
+struct metrics_histogram
+{
+	uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+struct metrics_snapshot
+{
+	uint64_t counters[METRICS_COUNTER_COUNT];
+	struct metrics_histogram timers[METRICS_TIMER_COUNT];
+};
+
+void metrics_snapshot(struct metrics_snapshot* out);
+/* metrics_snapshot: sums the shards of all live threads, and of the threads
+ * that have exited, into out. Counts since the process started.
+ */
+
+int32_t metrics_prometheus(const struct metrics_snapshot* snapshot, char* out, size_t outlen);
+/* metrics_prometheus: writes snapshot in the Prometheus text exposition
+ * format (counters as mutotp_*_total, timers as mutotp_*_seconds histograms)
+ * into out, null terminated. Returns its length, or -1 if outlen is too
+ * small; METRICS_PROMETHEUS_MAX is always enough.
+ */
+
+#define METRICS_PROMETHEUS_MAX 16384
+
+uint64_t metrics_now(void);
+/* metrics_now: monotonic clock in ns, for timing with metrics_time */
+
+void metrics_count(enum metrics_counter counter, uint64_t n);
+/* metrics_count: adds n to counter in the calling thread's shard */
+
+void metrics_time(enum metrics_timer timer, uint64_t start_ns);
+/* metrics_time: records the time since start_ns (from metrics_now) */
+
+#ifdef MUTOTP_NO_METRICS
+#define METRICS_COUNT(counter, n) ((void) 0)
+#define METRICS_START(var) ((void) 0)
+#define METRICS_TIME(timer, var) ((void) 0)
+#else
+#define METRICS_COUNT(counter, n) metrics_count((counter), (n))
+#define METRICS_START(var) uint64_t var = metrics_now()
+#define METRICS_TIME(timer, var) metrics_time((timer), (var))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef MUTOTP_HPP_
+#define MUTOTP_HPP_
+
+//C++17 front end to the TOTP API. The number of digits and the time step are
+//template parameters, so the modulo and the timestamp division compile to
+//multiplications, and keys are move-only RAII objects holding the HMAC
+//midstates (see hmacsha1_key in totp.h). Nothing here allocates. With C++20,
+//std::span<const std::uint8_t> is accepted wherever raw bytes are.
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <string_view>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+#include "totp.h"
+#include "base32codec.h"
+
+namespace mutotp
+{
+
+struct sha1
+{
+	using context = hmacsha1_key;
+	static constexpr std::size_t digest_size = HMACSHA1_DIGEST_SIZE;
+
+	static void init(context& ctx, const char* key, std::size_t len) noexcept
+	{
+		hmacsha1_key_init(&ctx, key, len);
+	}
+
+	static void mac(const context& ctx, char* out, const char* message, std::size_t len) noexcept
+	{
+		hmacsha1_key_mac(&ctx, out, message, len);
+	}
+
+	static void wipe(context& ctx) noexcept
+	{
+		hmacsha1_key_wipe(&ctx);
+	}
+};
+/* The Hash parameter of hmac_key and totp: a context type holding a prepared
+ * key, the digest size, and init, mac and wipe functions over the context.
+ * HMAC-SHA1 is the only one the library implements.
+ */
+
+template<typename Hash = sha1>
+class hmac_key
+{
+public:
+	using digest = std::array<std::uint8_t, Hash::digest_size>;
+
+	//Longest base32 secret from_base32 decodes, in raw bytes
+	static constexpr std::size_t max_base32_key = 128;
+
+	explicit hmac_key(std::string_view key) noexcept
+	{
+		Hash::init(ctx_, key.data(), key.size());
+	}
+
+#ifdef __cpp_lib_span
+	explicit hmac_key(std::span<const std::uint8_t> key) noexcept
+	{
+		Hash::init(ctx_, reinterpret_cast<const char*>(key.data()), key.size());
+	}
+#endif
+
+	static std::optional<hmac_key> from_base32(std::string_view secret) noexcept
+	{
+		//Decodes on the stack; the raw key never outlives this call
+		char raw[max_base32_key];
+		if(secret.size() > BASE32_ENCODE_BOUND(max_base32_key))
+		{
+			return std::nullopt;
+		}
+		std::int32_t len = base32decode(secret.data(), secret.size(), raw, sizeof(raw));
+		if(len < 0)
+		{
+			return std::nullopt;
+		}
+		std::optional<hmac_key> key(std::in_place, std::string_view(raw, len));
+		volatile char* wipe = raw;
+		for(std::size_t idx = 0; idx < sizeof(raw); ++idx)
+		{
+			wipe[idx] = 0;
+		}
+		return key;
+	}
+
+	hmac_key(const hmac_key&) = delete;
+	hmac_key& operator=(const hmac_key&) = delete;
+
+	hmac_key(hmac_key&& other) noexcept : ctx_(other.ctx_)
+	{
+		Hash::wipe(other.ctx_);
+	}
+
+	hmac_key& operator=(hmac_key&& other) noexcept
+	{
+		if(this != &other)
+		{
+			ctx_ = other.ctx_;
+			Hash::wipe(other.ctx_);
+		}
+		return *this;
+	}
+
+	~hmac_key()
+	{
+		Hash::wipe(ctx_);
+	}
+
+	digest mac(std::string_view message) const noexcept
+	{
+		digest out;
+		Hash::mac(ctx_, reinterpret_cast<char*>(out.data()), message.data(), message.size());
+		return out;
+	}
+
+#ifdef __cpp_lib_span
+	digest mac(std::span<const std::uint8_t> message) const noexcept
+	{
+		return mac(std::string_view(reinterpret_cast<const char*>(message.data()), message.size()));
+	}
+#endif
+
+private:
+	typename Hash::context ctx_;
+};
+/* hmac_key: a prepared HMAC key. Copying is disabled so the key material
+ * exists in one place; moving leaves the source wiped, and the destructor
+ * wipes what is left.
+ */
+
+enum class verify_result
+{
+	ok = TOTP_VERIFY_OK,
+	invalid = TOTP_VERIFY_INVALID,
+	replayed = TOTP_VERIFY_REPLAYED
+};
+
+template<unsigned Digits = 6, unsigned Period = 30, typename Hash = sha1>
+class totp
+{
+	static_assert(Digits >= 1 && Digits <= 8, "codes have 1 to 8 digits, as with compute_totp");
+	static_assert(Period > 0, "the time step must be at least a second");
+
+	static constexpr std::uint32_t pow10(unsigned n)
+	{
+		return n ? 10 * pow10(n - 1) : 1;
+	}
+
+public:
+	using key_type = hmac_key<Hash>;
+	using code_string = std::array<char, Digits + 1>;
+
+	static constexpr unsigned digits = Digits;
+	static constexpr unsigned period = Period;
+	static constexpr std::uint32_t modulus = pow10(Digits);
+
+	static constexpr std::uint64_t counter_at(std::int64_t timestamp) noexcept
+	{
+		return static_cast<std::uint64_t>(timestamp) / Period;
+	}
+
+	static std::uint32_t at_counter(const key_type& key, std::uint64_t counter) noexcept
+	{
+		//RFC 4226 dynamic truncation of the MAC of the big endian counter
+		std::array<std::uint8_t, 8> message;
+		for(std::size_t idx = 0; idx < 8; ++idx)
+		{
+			message[idx] = static_cast<std::uint8_t>(counter >> (56 - 8 * idx));
+		}
+		auto mac = key.mac(std::string_view(reinterpret_cast<const char*>(message.data()),
+							message.size()));
+		std::size_t offset = mac[Hash::digest_size - 1] & 0x0f;
+		std::uint32_t truncated = (static_cast<std::uint32_t>(mac[offset] & 0x7f) << 24) |
+			(static_cast<std::uint32_t>(mac[offset + 1]) << 16) |
+			(static_cast<std::uint32_t>(mac[offset + 2]) << 8) |
+			mac[offset + 3];
+		return truncated % modulus;
+	}
+
+	static std::uint32_t at(const key_type& key, std::int64_t timestamp) noexcept
+	{
+		return at_counter(key, counter_at(timestamp));
+	}
+
+	static std::uint32_t now(const key_type& key) noexcept
+	{
+		return at(key, std::chrono::duration_cast<std::chrono::seconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+
+	static verify_result verify(const key_type& key, std::uint32_t code, std::int64_t timestamp,
+			std::uint32_t window = 1, std::uint64_t* lastcounter = nullptr) noexcept
+	{
+		//Same rules as totp_verify: every step in the window is computed,
+		//and a step no later than *lastcounter counts as a replay
+		if(timestamp < 0)
+		{
+			return verify_result::invalid;
+		}
+		std::uint64_t counter = counter_at(timestamp);
+		std::uint64_t first = counter > window ? counter - window : 0;
+		std::uint64_t matched = 0;
+		bool found = false;
+		for(std::uint64_t step = first; step <= counter + window; ++step)
+		{
+			bool match = at_counter(key, step) == code;
+			matched = match && !found ? step : matched;
+			found |= match;
+		}
+
+		if(!found)
+		{
+			return verify_result::invalid;
+		}
+		if(lastcounter && matched <= *lastcounter)
+		{
+			return verify_result::replayed;
+		}
+		if(lastcounter)
+		{
+			*lastcounter = matched;
+		}
+		return verify_result::ok;
+	}
+
+	static constexpr code_string format(std::uint32_t code) noexcept
+	{
+		//Zero padded to Digits, null terminated
+		code_string out{};
+		for(unsigned idx = Digits; idx > 0; --idx, code /= 10)
+		{
+			out[idx - 1] = static_cast<char>('0' + code % 10);
+		}
+		return out;
+	}
+};
+/* totp: RFC 6238 codes of Digits digits for Period second time steps. at and
+ * verify take UNIX timestamps, as compute_totp and totp_verify do, and give
+ * the same results.
+ */
+
+} // namespace mutotp
+
+#endif
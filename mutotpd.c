@@ -0,0 +1,1030 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+
+//mutotpd: TOTP verification daemon. Owns the secrets of every user on the
+//host, so that the processes using them neither load them nor do their own
+//hashing, and serves verify, enroll and render requests over a Unix socket
+//in the pipelined binary protocol of mutotpd.h.
+//
+//Secrets are read at startup from a store file of "user<TAB>secret" lines
+//(what totp_enroll writes; anything after the secret is ignored), and users
+//enrolled through the daemon are appended to it. Replay and clock drift state
+//is kept in memory.
+//
+//One thread serves every connection from an epoll loop. All requests that
+//arrive in one wakeup are dispatched as a batch: user records are looked up
+//and prefetched first, the codes verified back to back against the same
+//clock reading, and every connection's responses then leave in one write.
+//
+//A client may also hand over a shared memory channel (see mutotpd_ring.h) for
+//its verifications. Each channel is served by a thread of its own that drains
+//the request ring in batches; the store is shared under a mutex.
+
+//accept4
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "mutotpd.h"
+#include "mutotpd_ring.h"
+#include "totp.h"
+#include "base32codec.h"
+#include "ratelimit.h"
+#include "qrcode/qrcode.h"
+
+#define TIMESTEP 30
+#define DIGITS 6
+
+#define MAX_EVENTS 256
+#define MAX_BATCH 1024
+#define CONN_INPUT_SIZE (1 << 16)
+#define CONN_OUTPUT_HIGH (1 << 20)	//Pending output above which reading stops
+
+struct user
+{
+	char name[MUTOTPD_USER_MAX + 1];
+	uint8_t namelen;
+	uint8_t secretlen;
+	char secret[HMACSHA1_DIGEST_SIZE];
+	char encoded[33];
+	uint64_t lastcounter;
+	struct totp_drift drift;
+};
+
+struct store
+{
+	struct user* users;
+	size_t count, cap;
+	uint32_t* index;	//Open addressing, user index + 1 or 0 for empty
+	size_t indexmask;
+	FILE* file;
+};
+
+struct daemon;
+
+struct channel
+{
+	struct daemon* d;
+	struct mutotpd_channel* shm;
+	pthread_t thread;
+	int closed;
+};
+
+struct conn
+{
+	int fd;
+	int passedfd;		//Latest descriptor received, -1 for none
+	struct channel* channel;
+	uint32_t events;	//Registered with epoll
+	int dead;
+	int dirty;		//On the list of connections to flush
+	struct conn* nextdirty;
+	struct conn* prev;	//All open connections
+	struct conn* next;
+
+	char in[CONN_INPUT_SIZE];
+	size_t inlen;
+
+	char* out;
+	size_t outpos, outlen, outcap;
+};
+
+struct request
+{
+	struct conn* conn;
+	uint32_t id;
+	uint8_t op;
+	uint8_t userlen;
+	int32_t code;
+	char user[MUTOTPD_USER_MAX];
+	struct user* found;
+};
+
+struct daemon
+{
+	//Held by the epoll thread while dispatching, and by channel threads
+	//while serving a batch
+	pthread_mutex_t lock;
+	struct store store;
+	const char* issuer;
+	uint32_t window;
+	int spins;		//Empty polls before a channel thread sleeps
+	struct ratelimit* limits;
+	int epfd;
+
+	struct request batch[MAX_BATCH];
+	size_t batchlen;
+	struct conn* dirty;
+	struct conn* conns;
+
+	uint8_t workspacebytes[QRCODE_WORKSPACE_SIZE(5)];
+	qrcode_workspace workspace;
+	char ansi[TOTP_QRCODE_ANSI_MAX];
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+	(void) sig;
+	running = 0;
+}
+
+static void put16(char* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(char* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint16_t get16(const char* p)
+{
+	const uint8_t* b = (const uint8_t*) p;
+	return b[0] | (b[1] << 8);
+}
+
+static uint32_t get32(const char* p)
+{
+	const uint8_t* b = (const uint8_t*) p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static int valid_name(const char* name, size_t len)
+{
+	//Names end up in tab separated store lines and in URI labels
+	size_t idx = 0;
+	if(!len || len > MUTOTPD_USER_MAX)
+	{
+		return 0;
+	}
+	for(; idx < len; ++idx)
+	{
+		if((unsigned char) name[idx] < ' ' || name[idx] == ':')
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static struct user* store_find(const struct store* store, const char* name, size_t len)
+{
+	if(!store->index)
+	{
+		return 0;
+	}
+	size_t idx = ratelimit_hash(name, len) & store->indexmask;
+	for(; store->index[idx]; idx = (idx + 1) & store->indexmask)
+	{
+		struct user* user = &store->users[store->index[idx] - 1];
+		if(user->namelen == len && !memcmp(user->name, name, len))
+		{
+			return user;
+		}
+	}
+	return 0;
+}
+
+static int store_reindex(struct store* store, size_t size)
+{
+	uint32_t* index = (uint32_t*) calloc(size, sizeof(uint32_t));
+	if(!index)
+	{
+		return -1;
+	}
+	free(store->index);
+	store->index = index;
+	store->indexmask = size - 1;
+
+	size_t user = 0;
+	for(; user < store->count; ++user)
+	{
+		size_t idx = ratelimit_hash(store->users[user].name, store->users[user].namelen) &
+			store->indexmask;
+		while(index[idx])
+		{
+			idx = (idx + 1) & store->indexmask;
+		}
+		index[idx] = user + 1;
+	}
+	return 0;
+}
+
+static struct user* store_add(struct store* store, const char* name, size_t len, const char* encoded)
+{
+	//Callers check the name is valid and new
+	char secret[33];
+	int32_t secretlen = base32decode(encoded, strlen(encoded), secret, sizeof(secret));
+	if(secretlen <= 0 || secretlen > HMACSHA1_DIGEST_SIZE || strlen(encoded) > 32 ||
+		store->count >= UINT32_MAX - 1)
+	{
+		return 0;
+	}
+
+	if(store->count == store->cap)
+	{
+		size_t cap = store->cap ? store->cap * 2 : 1024;
+		struct user* users = (struct user*) realloc(store->users, cap * sizeof(struct user));
+		if(!users)
+		{
+			return 0;
+		}
+		store->users = users;
+		store->cap = cap;
+	}
+	//The index stays at most half full
+	if(!store->index || 2 * (store->count + 1) > store->indexmask + 1)
+	{
+		if(store_reindex(store, store->index ? 2 * (store->indexmask + 1) : 2048) < 0)
+		{
+			return 0;
+		}
+	}
+
+	struct user* user = &store->users[store->count];
+	memset(user, 0, sizeof(struct user));
+	memcpy(user->name, name, len);
+	user->namelen = len;
+	memcpy(user->secret, secret, secretlen);
+	user->secretlen = secretlen;
+	strcpy(user->encoded, encoded);
+	memset(secret, 0, sizeof(secret));
+
+	size_t idx = ratelimit_hash(name, len) & store->indexmask;
+	while(store->index[idx])
+	{
+		idx = (idx + 1) & store->indexmask;
+	}
+	store->index[idx] = ++store->count;
+	return user;
+}
+
+static int store_open(struct store* store, const char* path)
+{
+	//The store holds every user's secret in the clear, so it is created
+	//private and an existing one others can read is refused
+	memset(store, 0, sizeof(struct store));
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	if(fstat(fd, &st) < 0 || (st.st_mode & (S_IRWXG | S_IRWXO)))
+	{
+		fprintf(stderr, "%s: store must not be accessible to group or others (chmod 600)\n", path);
+		close(fd);
+		return -1;
+	}
+	store->file = fdopen(fd, "a+");
+	if(!store->file)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	char* line = 0;
+	size_t linecap = 0;
+	ssize_t len;
+	size_t lineno = 0;
+	rewind(store->file);
+	while((len = getline(&line, &linecap, store->file)) >= 0)
+	{
+		++lineno;
+		char* tab = memchr(line, '\t', len);
+		if(!tab)
+		{
+			continue;
+		}
+		char* secret = tab + 1;
+		secret[strcspn(secret, "\t\r\n")] = 0;
+		size_t namelen = tab - line;
+		if(!valid_name(line, namelen) || store_find(store, line, namelen) ||
+			!store_add(store, line, namelen, secret))
+		{
+			fprintf(stderr, "%s:%zu: skipped an invalid or repeated user\n", path, lineno);
+		}
+	}
+	free(line);
+	return 0;
+}
+
+static void conn_queue(struct daemon* d, struct conn* conn)
+{
+	if(!conn->dirty)
+	{
+		conn->dirty = 1;
+		conn->nextdirty = d->dirty;
+		d->dirty = conn;
+	}
+}
+
+static void respond(struct daemon* d, struct conn* conn, uint8_t op, uint32_t id,
+		int8_t status, const char* payload, size_t len)
+{
+	size_t framelen = MUTOTPD_HEADER_SIZE + len;
+	if(conn->outlen + framelen > conn->outcap)
+	{
+		size_t cap = conn->outcap ? conn->outcap : 4096;
+		while(cap < conn->outlen + framelen)
+		{
+			cap <<= 1;
+		}
+		char* grown = (char*) realloc(conn->out, cap);
+		if(!grown)
+		{
+			conn->dead = 1;
+			conn_queue(d, conn);
+			return;
+		}
+		conn->out = grown;
+		conn->outcap = cap;
+	}
+
+	char* frame = &conn->out[conn->outlen];
+	frame[0] = op;
+	frame[1] = status;
+	put16(&frame[2], len);
+	put32(&frame[4], id);
+	if(len)
+	{
+		memcpy(&frame[MUTOTPD_HEADER_SIZE], payload, len);
+	}
+	conn->outlen += framelen;
+	conn_queue(d, conn);
+}
+
+static int verify_user(struct daemon* d, struct user* user, int32_t code,
+		time_t now, uint64_t nowms)
+{
+	uint64_t key = user ? (uint64_t) (user - d->store.users) + 1 : 0;
+	if(!user)
+	{
+		return MUTOTPD_UNKNOWN_USER;
+	}
+	if(d->limits && ratelimit_acquire(d->limits, key, nowms) != RATELIMIT_OK)
+	{
+		return TOTP_VERIFY_THROTTLED;
+	}
+
+	int result = totp_verify_drift(user->secret, user->secretlen, code, now, TIMESTEP,
+				DIGITS, d->window, &user->lastcounter, &user->drift);
+	if(result == TOTP_VERIFY_OK && d->limits)
+	{
+		ratelimit_success(d->limits, key);
+	}
+	return result;
+}
+
+static void handle_enroll(struct daemon* d, struct request* req)
+{
+	if(!valid_name(req->user, req->userlen))
+	{
+		respond(d, req->conn, req->op, req->id, MUTOTPD_BAD_REQUEST, 0, 0);
+		return;
+	}
+	if(store_find(&d->store, req->user, req->userlen))
+	{
+		respond(d, req->conn, req->op, req->id, MUTOTPD_EXISTS, 0, 0);
+		return;
+	}
+
+	char name[MUTOTPD_USER_MAX + 1];
+	memcpy(name, req->user, req->userlen);
+	name[req->userlen] = 0;
+
+	char secret[33] = {0};
+	struct totpuri uri;
+	struct user* user = 0;
+	if(generate_random_secret(secret, sizeof(secret), 0) >= 0)
+	{
+		totpuri_init(&uri, name, d->issuer, secret);
+		//Written out before the user can log in with it
+		if(fprintf(d->store.file, "%s\t%s\t%s\n", name, secret, uri.uristr) >= 0 &&
+			fflush(d->store.file) == 0)
+		{
+			user = store_add(&d->store, req->user, req->userlen, secret);
+		}
+	}
+	if(!user)
+	{
+		respond(d, req->conn, req->op, req->id, MUTOTPD_SERVER_ERROR, 0, 0);
+		return;
+	}
+
+	char payload[sizeof(secret) + sizeof(uri.uristr)];
+	int len = snprintf(payload, sizeof(payload), "%s\t%s", secret, uri.uristr);
+	respond(d, req->conn, req->op, req->id, MUTOTPD_OK, payload, len);
+	memset(secret, 0, sizeof(secret));
+	memset(&uri, 0, sizeof(uri));
+}
+
+static void handle_render(struct daemon* d, struct request* req)
+{
+	if(!req->found)
+	{
+		respond(d, req->conn, req->op, req->id, MUTOTPD_UNKNOWN_USER, 0, 0);
+		return;
+	}
+
+	struct totpuri uri;
+	totpuri_init(&uri, req->found->name, d->issuer, req->found->encoded);
+	int32_t len = totpuri_render_ansi(&uri, d->ansi, sizeof(d->ansi), &d->workspace);
+	memset(&uri, 0, sizeof(uri));
+	if(len < 0)
+	{
+		respond(d, req->conn, req->op, req->id, MUTOTPD_SERVER_ERROR, 0, 0);
+		return;
+	}
+	respond(d, req->conn, req->op, req->id, MUTOTPD_OK, d->ansi, len);
+}
+
+static void* channel_serve(void* arg)
+{
+	//The client can write to the channel at any time, so everything in it
+	//is copied out before it is checked, and bad indices end the channel
+	struct channel* chan = (struct channel*) arg;
+	struct daemon* d = chan->d;
+	struct mutotpd_channel* shm = chan->shm;
+	uint32_t tail = 0, head = 0;
+	int spins = 0;
+	while(!__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+	{
+		uint32_t count = mutotpd_ring_readable(&shm->requests, tail);
+		uint32_t room = mutotpd_ring_writable(&shm->responses, head);
+		if(count > MUTOTPD_RING_SLOTS || room > MUTOTPD_RING_SLOTS)
+		{
+			break;
+		}
+		count = count < room ? count : room;
+		if(!count)
+		{
+			if(++spins < d->spins)
+			{
+				mutotpd_ring_relax();
+			}
+			else
+			{
+				//Woken by the client, or by the connection closing
+				struct timespec timeout = {1, 0};
+				mutotpd_ring_sleep(&shm->requests, tail, &timeout);
+				spins = 0;
+			}
+			continue;
+		}
+		spins = 0;
+
+		pthread_mutex_lock(&d->lock);
+		time_t now = time(0);
+		uint64_t nowms = d->limits ? ratelimit_now() : 0;
+		uint32_t idx = 0;
+		for(; idx < count; ++idx)
+		{
+			char frame[MUTOTPD_RING_REQUEST_SLOT];
+			memcpy(frame, shm->request_slots[(tail + idx) & (MUTOTPD_RING_SLOTS - 1)],
+				sizeof(frame));
+			size_t len = get16(&frame[2]);
+			int result = MUTOTPD_BAD_REQUEST;
+			if(frame[0] == MUTOTPD_OP_VERIFY && len >= 4 && len - 4 <= MUTOTPD_USER_MAX)
+			{
+				struct user* user = store_find(&d->store, &frame[MUTOTPD_HEADER_SIZE + 4], len - 4);
+				result = verify_user(d, user, (int32_t) get32(&frame[MUTOTPD_HEADER_SIZE]),
+						now, nowms);
+			}
+
+			char* response = shm->response_slots[(head + idx) & (MUTOTPD_RING_SLOTS - 1)];
+			response[0] = frame[0];
+			response[1] = result;
+			put16(&response[2], 0);
+			memcpy(&response[4], &frame[4], 4);
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		mutotpd_ring_consume(&shm->requests, tail += count);
+		mutotpd_ring_publish(&shm->responses, head += count);
+	}
+	return 0;
+}
+
+static void channel_close(struct channel* chan)
+{
+	__atomic_store_n(&chan->closed, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &chan->shm->requests.head, FUTEX_WAKE, 1, 0, 0, 0);
+	pthread_join(chan->thread, 0);
+	munmap(chan->shm, sizeof(struct mutotpd_channel));
+	free(chan);
+}
+
+static void handle_ring(struct daemon* d, struct request* req)
+{
+	//Takes the memfd that came with the request. It must be sealed at the
+	//channel's size, so that the client cannot shrink it under the mapping.
+	struct conn* conn = req->conn;
+	int fd = conn->passedfd;
+	conn->passedfd = -1;
+
+	struct stat st;
+	struct channel* chan = 0;
+	struct mutotpd_channel* shm = MAP_FAILED;
+	int seals = fd >= 0 ? fcntl(fd, F_GET_SEALS) : -1;
+	if(!conn->channel && seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_SEAL)) ==
+		(F_SEAL_SHRINK | F_SEAL_SEAL) && fstat(fd, &st) == 0 &&
+		st.st_size == sizeof(struct mutotpd_channel))
+	{
+		shm = (struct mutotpd_channel*) mmap(0, sizeof(struct mutotpd_channel),
+						PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+
+	if(shm != MAP_FAILED && shm->magic == MUTOTPD_RING_MAGIC && shm->slots == MUTOTPD_RING_SLOTS &&
+		(chan = (struct channel*) calloc(1, sizeof(struct channel))))
+	{
+		chan->d = d;
+		chan->shm = shm;
+		if(pthread_create(&chan->thread, 0, channel_serve, chan) == 0)
+		{
+			conn->channel = chan;
+			respond(d, conn, req->op, req->id, MUTOTPD_OK, 0, 0);
+			return;
+		}
+		free(chan);
+	}
+	if(shm != MAP_FAILED)
+	{
+		munmap(shm, sizeof(struct mutotpd_channel));
+	}
+	respond(d, conn, req->op, req->id, MUTOTPD_BAD_REQUEST, 0, 0);
+}
+
+static void dispatch(struct daemon* d)
+{
+	if(!d->batchlen)
+	{
+		return;
+	}
+	pthread_mutex_lock(&d->lock);
+
+	//Look every user up first and prefetch their records, so that the
+	//verifications below run without waiting on memory
+	size_t idx = 0;
+	for(; idx < d->batchlen; ++idx)
+	{
+		struct request* req = &d->batch[idx];
+		req->found = req->op == MUTOTPD_OP_ENROLL ? 0 :
+			store_find(&d->store, req->user, req->userlen);
+		if(req->found)
+		{
+			__builtin_prefetch(req->found, 1);
+		}
+	}
+
+	time_t now = time(0);
+	uint64_t nowms = d->limits ? ratelimit_now() : 0;
+	int enrolled = 0;
+	for(idx = 0; idx < d->batchlen; ++idx)
+	{
+		struct request* req = &d->batch[idx];
+		if(req->conn->dead)
+		{
+			continue;
+		}
+		//An enrollment may have added the user, or moved the records
+		if(enrolled && req->op != MUTOTPD_OP_ENROLL)
+		{
+			req->found = store_find(&d->store, req->user, req->userlen);
+		}
+
+		switch(req->op)
+		{
+		case MUTOTPD_OP_VERIFY:
+			respond(d, req->conn, req->op, req->id,
+				verify_user(d, req->found, req->code, now, nowms), 0, 0);
+			break;
+		case MUTOTPD_OP_ENROLL:
+			handle_enroll(d, req);
+			enrolled = 1;
+			break;
+		case MUTOTPD_OP_RENDER:
+			handle_render(d, req);
+			break;
+		case MUTOTPD_OP_RING:
+			handle_ring(d, req);
+			break;
+		default:
+			respond(d, req->conn, req->op, req->id, MUTOTPD_BAD_REQUEST, 0, 0);
+		}
+	}
+	d->batchlen = 0;
+	pthread_mutex_unlock(&d->lock);
+}
+
+static void conn_read(struct daemon* d, struct conn* conn)
+{
+	//Descriptors are only expected with MUTOTPD_OP_RING; the latest one is
+	//kept for it
+	struct iovec iov = {&conn->in[conn->inlen], sizeof(conn->in) - conn->inlen};
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(4 * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+
+	struct cmsghdr* cmsg = n >= 0 ? CMSG_FIRSTHDR(&msg) : 0;
+	for(; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		{
+			continue;
+		}
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), idx = 0;
+		for(; idx < count; ++idx)
+		{
+			if(conn->passedfd >= 0)
+			{
+				close(conn->passedfd);
+			}
+			memcpy(&conn->passedfd, CMSG_DATA(cmsg) + idx * sizeof(int), sizeof(int));
+		}
+	}
+
+	if(n <= 0)
+	{
+		if(!n || (errno != EAGAIN && errno != EINTR))
+		{
+			conn->dead = 1;
+			conn_queue(d, conn);
+		}
+		return;
+	}
+	conn->inlen += n;
+
+	size_t pos = 0;
+	while(conn->inlen - pos >= MUTOTPD_HEADER_SIZE)
+	{
+		const char* frame = &conn->in[pos];
+		size_t len = get16(&frame[2]);
+		if(len > MUTOTPD_REQUEST_MAX)
+		{
+			conn->dead = 1;
+			conn_queue(d, conn);
+			return;
+		}
+		if(conn->inlen - pos < MUTOTPD_HEADER_SIZE + len)
+		{
+			break;
+		}
+
+		if(d->batchlen == MAX_BATCH)
+		{
+			dispatch(d);
+		}
+		struct request* req = &d->batch[d->batchlen++];
+		req->conn = conn;
+		req->op = frame[0];
+		req->id = get32(&frame[4]);
+		const char* user = &frame[MUTOTPD_HEADER_SIZE];
+		size_t userlen = len;
+		req->code = -1;
+		if(req->op == MUTOTPD_OP_VERIFY)
+		{
+			if(len < 4)
+			{
+				req->op = 0;
+				userlen = 0;
+			}
+			else
+			{
+				req->code = (int32_t) get32(user);
+				user += 4;
+				userlen -= 4;
+			}
+		}
+		if(userlen > MUTOTPD_USER_MAX)
+		{
+			//Answered as a bad request by dispatch
+			req->op = 0;
+			userlen = 0;
+		}
+		memcpy(req->user, user, userlen);
+		req->userlen = userlen;
+		pos += MUTOTPD_HEADER_SIZE + len;
+	}
+
+	memmove(conn->in, &conn->in[pos], conn->inlen - pos);
+	conn->inlen -= pos;
+}
+
+static void conn_close(struct daemon* d, struct conn* conn)
+{
+	if(conn->prev)
+	{
+		conn->prev->next = conn->next;
+	}
+	else
+	{
+		d->conns = conn->next;
+	}
+	if(conn->next)
+	{
+		conn->next->prev = conn->prev;
+	}
+	if(conn->channel)
+	{
+		channel_close(conn->channel);
+	}
+	if(conn->passedfd >= 0)
+	{
+		close(conn->passedfd);
+	}
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, conn->fd, 0);
+	close(conn->fd);
+	free(conn->out);
+	free(conn);
+}
+
+static void conn_flush(struct daemon* d, struct conn* conn)
+{
+	while(!conn->dead && conn->outpos < conn->outlen)
+	{
+		ssize_t n = send(conn->fd, &conn->out[conn->outpos], conn->outlen - conn->outpos,
+				MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				conn->dead = 1;
+			}
+			break;
+		}
+		conn->outpos += n;
+	}
+	if(conn->outpos == conn->outlen)
+	{
+		conn->outpos = conn->outlen = 0;
+	}
+
+	//Wait for room to write while output is pending, and stop reading
+	//requests from a client that is not reading its responses
+	size_t pending = conn->outlen - conn->outpos;
+	uint32_t events = (pending ? EPOLLOUT : 0) | (pending < CONN_OUTPUT_HIGH ? EPOLLIN : 0);
+	if(!conn->dead && events != conn->events)
+	{
+		struct epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = conn;
+		if(epoll_ctl(d->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0)
+		{
+			conn->events = events;
+		}
+	}
+}
+
+static void accept_all(struct daemon* d, int listenfd)
+{
+	for(;;)
+	{
+		int fd = accept4(listenfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0)
+		{
+			return;
+		}
+
+		struct conn* conn = (struct conn*) calloc(1, sizeof(struct conn));
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if(!conn || epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->passedfd = -1;
+		conn->events = EPOLLIN;
+		conn->next = d->conns;
+		if(d->conns)
+		{
+			d->conns->prev = conn;
+		}
+		d->conns = conn;
+	}
+}
+
+static int listen_on(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(path);
+	//Only the owner and its group may connect
+	mode_t mask = umask(007);
+	int bound = fd >= 0 && bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+	umask(mask);
+	if(!bound || listen(fd, SOMAXCONN) < 0)
+	{
+		perror(path);
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s -f store [-s socket] [-i issuer] [-w window] [-L]\n"
+		"  -f store    file of user<TAB>secret lines; enrollments are appended\n"
+		"  -s socket   Unix socket to listen on (default: mutotpd.sock)\n"
+		"  -i issuer   issuer name in enrollment URIs\n"
+		"  -w window   time steps accepted either side of the current one (default: 1)\n"
+		"  -L          rate limit guesses per user (see ratelimit.h)\n",
+		argv0);
+}
+
+int main(int argc, char** argv)
+{
+	const char* storepath = 0;
+	const char* sockpath = "mutotpd.sock";
+	int limit = 0;
+
+	struct daemon* d = (struct daemon*) calloc(1, sizeof(struct daemon));
+	if(!d)
+	{
+		return EXIT_FAILURE;
+	}
+	d->issuer = "";
+	d->window = 1;
+	pthread_mutex_init(&d->lock, 0);
+	d->spins = mutotpd_ring_spins();
+
+	int opt;
+	while((opt = getopt(argc, argv, "f:s:i:w:Lh")) != -1)
+	{
+		switch(opt)
+		{
+		case 'f': storepath = optarg; break;
+		case 's': sockpath = optarg; break;
+		case 'i': d->issuer = optarg; break;
+		case 'w': d->window = strtoul(optarg, 0, 10); break;
+		case 'L': limit = 1; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(!storepath)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if(limit)
+	{
+		//Five guesses, then one every 30 s, with lockouts from a minute
+		//doubling up to an hour
+		struct ratelimit_options options = {65536, 5, 1.0 / 30, 60000, 3600000};
+		d->limits = ratelimit_create(&options);
+	}
+	qrcode_initWorkspace(&d->workspace, d->workspacebytes, 5);
+
+	if((limit && !d->limits) || store_open(&d->store, storepath) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+	int listenfd = listen_on(sockpath);
+	d->epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if(listenfd < 0 || d->epfd < 0 || epoll_ctl(d->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	{
+		return EXIT_FAILURE;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "mutotpd: %zu users, listening on %s\n", d->store.count, sockpath);
+
+	struct epoll_event events[MAX_EVENTS];
+	while(running)
+	{
+		int n = epoll_wait(d->epfd, events, MAX_EVENTS, -1);
+		int idx = 0;
+		for(; idx < n; ++idx)
+		{
+			struct conn* conn = (struct conn*) events[idx].data.ptr;
+			if(!conn)
+			{
+				accept_all(d, listenfd);
+				continue;
+			}
+			if(events[idx].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			{
+				conn_read(d, conn);
+			}
+			if(events[idx].events & EPOLLOUT)
+			{
+				conn_queue(d, conn);
+			}
+		}
+		dispatch(d);
+
+		while(d->dirty)
+		{
+			struct conn* conn = d->dirty;
+			d->dirty = conn->nextdirty;
+			conn->dirty = 0;
+			conn_flush(d, conn);
+			if(conn->dead)
+			{
+				conn_close(d, conn);
+			}
+		}
+	}
+
+	while(d->conns)
+	{
+		conn_close(d, d->conns);
+	}
+	close(listenfd);
+	close(d->epfd);
+	unlink(sockpath);
+
+	fclose(d->store.file);
+	memset(d->store.users, 0, d->store.count * sizeof(struct user));
+	free(d->store.users);
+	free(d->store.index);
+	ratelimit_destroy(d->limits);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#ifndef MUTOTPD_H_
+#define MUTOTPD_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Protocol of the mutotpd verification daemon, and a non-blocking client.
+//
+//Requests and responses are frames of an 8 byte header and a payload, all
+//little endian:
+//	uint8 op, int8 status (0 in requests), uint16 payload length,
+//	uint32 id (chosen by the client, echoed in the response)
+//A client may send any number of requests without waiting; the daemon
+//answers each connection's requests in the order they were sent.
+//
+//	op		request payload			response payload
+//	VERIFY		int32 code, user name		-
+//	ENROLL		user name			"secret<TAB>otpauth URI"
+//	RENDER		user name			ANSI QR code of the URI
+//	RING		- (a memfd passed along)	-
+//
+//A response's status is MUTOTPD_OK, one of the TOTP_VERIFY_* results for a
+//verification, or one of the errors below.
+
+#define MUTOTPD_OP_VERIFY 1
+#define MUTOTPD_OP_ENROLL 2
+#define MUTOTPD_OP_RENDER 3
+#define MUTOTPD_OP_RING 4
+
+#define MUTOTPD_OK 0
+#define MUTOTPD_UNKNOWN_USER -4
+#define MUTOTPD_EXISTS -5		//ENROLL of a user who already has a secret
+#define MUTOTPD_BAD_REQUEST -6
+#define MUTOTPD_SERVER_ERROR -7
+
+#define MUTOTPD_HEADER_SIZE 8
+#define MUTOTPD_USER_MAX 16		//Longest user name, the URI label limit
+#define MUTOTPD_REQUEST_MAX (4 + MUTOTPD_USER_MAX)
+
+struct mutotpd_response
+{
+	uint32_t id;
+	uint8_t op;
+	int8_t status;
+	uint16_t len;
+	const char* data;	//Payload, valid until the next mutotpd_read
+};
+
+struct mutotpd_client;
+
+struct mutotpd_client* mutotpd_connect(const char* path);
+/* mutotpd_connect: connects to the daemon's Unix socket at path. Returns NULL
+ * on failure. The socket is non-blocking from then on.
+ */
+
+void mutotpd_close(struct mutotpd_client* client);
+
+int mutotpd_fd(const struct mutotpd_client* client);
+/* mutotpd_fd: the socket, for the caller's own poll or epoll loop. Wait for
+ * it to be readable to read responses, and writable while mutotpd_flush
+ * reports output pending.
+ */
+
+int mutotpd_send_verify(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen, int32_t code);
+int mutotpd_send_enroll(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen);
+int mutotpd_send_render(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen);
+/* mutotpd_send_*: queue a request and write as much of the queue as the
+ * socket takes without blocking. Return 0, or -1 if the user name is too
+ * long or the connection failed.
+ */
+
+int mutotpd_flush(struct mutotpd_client* client);
+/* mutotpd_flush: writes queued requests without blocking. Returns 0 once the
+ * queue is empty, 1 if some is left and -1 if the connection failed.
+ */
+
+int mutotpd_read(struct mutotpd_client* client, struct mutotpd_response* response);
+/* mutotpd_read: fills response with the next complete response, reading the
+ * socket without blocking if none is buffered. Returns 1 if response was
+ * filled, 0 if none has arrived yet and -1 if the connection failed or the
+ * daemon closed it.
+ */
+
+//Shared memory channel. After mutotpd_ring_open, verifications can also go
+//through a pair of rings in memory shared with the daemon, at about the cost
+//of a function call: neither side makes a system call while the other is
+//busy, and a side that has gone idle is woken with a futex. The socket stays
+//usable for everything else.
+
+int mutotpd_ring_open(struct mutotpd_client* client);
+/* mutotpd_ring_open: sets up the channel and waits (up to a second) for the
+ * daemon to accept it. Call it before sending anything on the socket. Returns
+ * 0 on success and -1 on failure.
+ */
+
+int mutotpd_ring_send_verify(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen, int32_t code);
+/* mutotpd_ring_send_verify: queues a verification on the channel. Returns 0,
+ * or -1 if the name is too long, there is no channel or all of its 1024
+ * slots hold requests still waiting for their responses.
+ */
+
+int mutotpd_ring_read(struct mutotpd_client* client, struct mutotpd_response* response);
+/* mutotpd_ring_read: fills response with the next response from the channel.
+ * Returns 1 if it did and 0 if none is ready. Responses have no payload.
+ */
+
+int mutotpd_ring_wait(struct mutotpd_client* client, int timeout_ms);
+/* mutotpd_ring_wait: waits for a response on the channel, spinning briefly
+ * before sleeping. Returns 1 once one is ready and 0 on timeout.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
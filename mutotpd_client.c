@@ -0,0 +1,442 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+//memfd_create
+#define _GNU_SOURCE
+#include "mutotpd.h"
+#include "mutotpd_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//Holds the largest response, an ANSI QR code, several times over
+#define CLIENT_INPUT_SIZE (1 << 16)
+
+struct mutotpd_client
+{
+	int fd;
+
+	//Requests queued for writing: out[outpos, outlen)
+	char* out;
+	size_t outpos, outlen, outcap;
+
+	//Responses read but not yet returned: in[inpos, inlen)
+	char in[CLIENT_INPUT_SIZE];
+	size_t inpos, inlen;
+
+	//Shared memory channel, if open. The client produces requests and
+	//consumes responses; the indices are its own copies of those it writes.
+	struct mutotpd_channel* ring;
+	uint32_t ringhead;
+	uint32_t ringtail;
+	uint32_t outstanding;
+	int ringspins;
+};
+
+static void put16(char* p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(char* p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint16_t get16(const char* p)
+{
+	const uint8_t* b = (const uint8_t*) p;
+	return b[0] | (b[1] << 8);
+}
+
+static uint32_t get32(const char* p)
+{
+	const uint8_t* b = (const uint8_t*) p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+struct mutotpd_client* mutotpd_connect(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		return 0;
+	}
+	strcpy(addr.sun_path, path);
+
+	struct mutotpd_client* client = (struct mutotpd_client*) calloc(1, sizeof(struct mutotpd_client));
+	if(!client)
+	{
+		return 0;
+	}
+
+	//A local connect completes (or fails) at once, so it is done blocking
+	client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(client->fd < 0 || connect(client->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+		fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK) < 0)
+	{
+		if(client->fd >= 0)
+		{
+			close(client->fd);
+		}
+		free(client);
+		return 0;
+	}
+	return client;
+}
+
+void mutotpd_close(struct mutotpd_client* client)
+{
+	if(client)
+	{
+		if(client->ring)
+		{
+			munmap(client->ring, sizeof(struct mutotpd_channel));
+		}
+		close(client->fd);
+		free(client->out);
+		free(client);
+	}
+}
+
+int mutotpd_fd(const struct mutotpd_client* client)
+{
+	return client->fd;
+}
+
+int mutotpd_flush(struct mutotpd_client* client)
+{
+	while(client->outpos < client->outlen)
+	{
+		ssize_t n = send(client->fd, &client->out[client->outpos],
+				client->outlen - client->outpos, MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+		client->outpos += n;
+	}
+	client->outpos = client->outlen = 0;
+	return 0;
+}
+
+static int mutotpd_send(struct mutotpd_client* client, uint8_t op, uint32_t id,
+		const char* prefix, size_t prefixlen, const char* user, size_t userlen)
+{
+	if(userlen > MUTOTPD_USER_MAX)
+	{
+		return -1;
+	}
+
+	size_t framelen = MUTOTPD_HEADER_SIZE + prefixlen + userlen;
+	if(client->outlen + framelen > client->outcap)
+	{
+		size_t cap = client->outcap ? client->outcap : 4096;
+		while(cap < client->outlen + framelen)
+		{
+			cap <<= 1;
+		}
+		char* grown = (char*) realloc(client->out, cap);
+		if(!grown)
+		{
+			return -1;
+		}
+		client->out = grown;
+		client->outcap = cap;
+	}
+
+	char* frame = &client->out[client->outlen];
+	frame[0] = op;
+	frame[1] = 0;
+	put16(&frame[2], prefixlen + userlen);
+	put32(&frame[4], id);
+	if(prefixlen)
+	{
+		memcpy(&frame[MUTOTPD_HEADER_SIZE], prefix, prefixlen);
+	}
+	memcpy(&frame[MUTOTPD_HEADER_SIZE + prefixlen], user, userlen);
+	client->outlen += framelen;
+
+	return mutotpd_flush(client) < 0 ? -1 : 0;
+}
+
+int mutotpd_send_verify(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen, int32_t code)
+{
+	char prefix[4];
+	put32(prefix, (uint32_t) code);
+	return mutotpd_send(client, MUTOTPD_OP_VERIFY, id, prefix, sizeof(prefix), user, userlen);
+}
+
+int mutotpd_send_enroll(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen)
+{
+	return mutotpd_send(client, MUTOTPD_OP_ENROLL, id, 0, 0, user, userlen);
+}
+
+int mutotpd_send_render(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen)
+{
+	return mutotpd_send(client, MUTOTPD_OP_RENDER, id, 0, 0, user, userlen);
+}
+
+int mutotpd_read(struct mutotpd_client* client, struct mutotpd_response* response)
+{
+	for(;;)
+	{
+		size_t avail = client->inlen - client->inpos;
+		if(avail >= MUTOTPD_HEADER_SIZE)
+		{
+			const char* frame = &client->in[client->inpos];
+			size_t len = get16(&frame[2]);
+			if(avail >= MUTOTPD_HEADER_SIZE + len)
+			{
+				response->op = frame[0];
+				response->status = frame[1];
+				response->len = len;
+				response->id = get32(&frame[4]);
+				response->data = &frame[MUTOTPD_HEADER_SIZE];
+				client->inpos += MUTOTPD_HEADER_SIZE + len;
+				return 1;
+			}
+		}
+
+		//Move the partial frame to the front (earlier responses handed
+		//out are no longer in use) and read more behind it
+		memmove(client->in, &client->in[client->inpos], avail);
+		client->inpos = 0;
+		client->inlen = avail;
+
+		ssize_t n = read(client->fd, &client->in[avail], sizeof(client->in) - avail);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if(!n)
+		{
+			return -1;
+		}
+		client->inlen += n;
+	}
+}
+
+int mutotpd_ring_open(struct mutotpd_client* client)
+{
+	if(client->ring || client->outlen)
+	{
+		return -1;
+	}
+
+	//Sealed against resizing, so the daemon can map it without risking a
+	//SIGBUS from a file truncated under it
+	int fd = memfd_create("mutotpd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd < 0)
+	{
+		return -1;
+	}
+	struct mutotpd_channel* ring = MAP_FAILED;
+	if(ftruncate(fd, sizeof(struct mutotpd_channel)) == 0 &&
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+	{
+		ring = (struct mutotpd_channel*) mmap(0, sizeof(struct mutotpd_channel),
+						PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	if(ring == MAP_FAILED)
+	{
+		close(fd);
+		return -1;
+	}
+	ring->magic = MUTOTPD_RING_MAGIC;
+	ring->slots = MUTOTPD_RING_SLOTS;
+
+	char frame[MUTOTPD_HEADER_SIZE];
+	frame[0] = MUTOTPD_OP_RING;
+	frame[1] = 0;
+	put16(&frame[2], 0);
+	put32(&frame[4], 0);
+
+	struct iovec iov = {frame, sizeof(frame)};
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	//Nothing else is queued, so the frame goes out whole or not at all
+	ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	close(fd);
+
+	struct mutotpd_response response;
+	int got = 0;
+	if(sent == sizeof(frame))
+	{
+		while(!(got = mutotpd_read(client, &response)))
+		{
+			struct pollfd pfd = {client->fd, POLLIN, 0};
+			if(poll(&pfd, 1, 1000) <= 0)
+			{
+				break;
+			}
+		}
+	}
+	if(got != 1 || response.op != MUTOTPD_OP_RING || response.status != MUTOTPD_OK)
+	{
+		munmap(ring, sizeof(struct mutotpd_channel));
+		return -1;
+	}
+
+	client->ring = ring;
+	client->ringspins = mutotpd_ring_spins();
+	client->ringhead = client->ringtail = 0;
+	client->outstanding = 0;
+	return 0;
+}
+
+int mutotpd_ring_send_verify(struct mutotpd_client* client, uint32_t id,
+		const char* user, size_t userlen, int32_t code)
+{
+	//Keeping requests in flight to the ring size means the daemon always
+	//finds room for their responses
+	struct mutotpd_channel* ring = client->ring;
+	if(!ring || userlen > MUTOTPD_USER_MAX || client->outstanding == MUTOTPD_RING_SLOTS ||
+		!mutotpd_ring_writable(&ring->requests, client->ringhead))
+	{
+		return -1;
+	}
+
+	char* frame = ring->request_slots[client->ringhead & (MUTOTPD_RING_SLOTS - 1)];
+	frame[0] = MUTOTPD_OP_VERIFY;
+	frame[1] = 0;
+	put16(&frame[2], 4 + userlen);
+	put32(&frame[4], id);
+	put32(&frame[MUTOTPD_HEADER_SIZE], (uint32_t) code);
+	memcpy(&frame[MUTOTPD_HEADER_SIZE + 4], user, userlen);
+
+	++client->outstanding;
+	mutotpd_ring_publish(&ring->requests, ++client->ringhead);
+	return 0;
+}
+
+int mutotpd_ring_read(struct mutotpd_client* client, struct mutotpd_response* response)
+{
+	struct mutotpd_channel* ring = client->ring;
+	if(!ring || !mutotpd_ring_readable(&ring->responses, client->ringtail))
+	{
+		return 0;
+	}
+
+	const char* frame = ring->response_slots[client->ringtail & (MUTOTPD_RING_SLOTS - 1)];
+	response->op = frame[0];
+	response->status = frame[1];
+	response->len = 0;
+	response->id = get32(&frame[4]);
+	response->data = 0;
+
+	--client->outstanding;
+	mutotpd_ring_consume(&ring->responses, ++client->ringtail);
+	return 1;
+}
+
+int mutotpd_ring_wait(struct mutotpd_client* client, int timeout_ms)
+{
+	struct mutotpd_channel* ring = client->ring;
+	if(!ring)
+	{
+		return 0;
+	}
+
+	//A response to a verification usually arrives within microseconds, so
+	//spin first rather than pay for sleeping and being woken
+	int spins = 0;
+	for(; spins < client->ringspins; ++spins)
+	{
+		if(mutotpd_ring_readable(&ring->responses, client->ringtail))
+		{
+			return 1;
+		}
+		mutotpd_ring_relax();
+	}
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000)
+	{
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	for(;;)
+	{
+		if(mutotpd_ring_readable(&ring->responses, client->ringtail))
+		{
+			return 1;
+		}
+		struct timespec now, left;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left.tv_sec = deadline.tv_sec - now.tv_sec;
+		left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if(left.tv_nsec < 0)
+		{
+			--left.tv_sec;
+			left.tv_nsec += 1000000000;
+		}
+		if(left.tv_sec < 0)
+		{
+			return 0;
+		}
+		mutotpd_ring_sleep(&ring->responses, client->ringtail, &left);
+	}
+}
@@ -0,0 +1,129 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#ifndef MUTOTPD_RING_H_
+#define MUTOTPD_RING_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mutotpd.h"
+
+//Shared memory channel between mutotpd and one client, internal to the two.
+//
+//The client creates a sealed memfd holding a mutotpd_channel and passes it to
+//the daemon with MUTOTPD_OP_RING. Each direction is a single producer, single
+//consumer ring of fixed size slots, holding frames in the socket protocol's
+//format: requests carry a VERIFY frame, responses just the header.
+//
+//Indices run freely and are masked on use. A consumer that finds its ring
+//empty spins for a while, then sets waiting and sleeps on a futex on head; a
+//producer makes the futex call only when it sees waiting set, so a busy
+//channel costs no system calls at all.
+
+#define MUTOTPD_RING_MAGIC 0x676e6952	//"Ring"
+#define MUTOTPD_RING_SLOTS 1024
+#define MUTOTPD_RING_REQUEST_SLOT 32
+#define MUTOTPD_RING_RESPONSE_SLOT MUTOTPD_HEADER_SIZE
+
+//Empty polls before a consumer goes to sleep. Only worth it when the other
+//side can run at the same time; with one CPU, spinning just delays it.
+#define MUTOTPD_RING_SPINS 4096
+
+static inline int mutotpd_ring_spins(void)
+{
+	return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MUTOTPD_RING_SPINS : 0;
+}
+
+struct mutotpd_ring
+{
+	uint32_t head __attribute__((aligned(64)));	//Written by the producer
+	uint32_t tail __attribute__((aligned(64)));	//Written by the consumer
+	uint32_t waiting;				//The consumer sleeps on head
+};
+
+struct mutotpd_channel
+{
+	uint32_t magic;
+	uint32_t slots;
+	struct mutotpd_ring requests __attribute__((aligned(64)));
+	struct mutotpd_ring responses;
+	char request_slots[MUTOTPD_RING_SLOTS][MUTOTPD_RING_REQUEST_SLOT];
+	char response_slots[MUTOTPD_RING_SLOTS][MUTOTPD_RING_RESPONSE_SLOT];
+};
+
+static inline void mutotpd_ring_relax(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline uint32_t mutotpd_ring_readable(struct mutotpd_ring* ring, uint32_t tail)
+{
+	//Consumer side: slots published since tail
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static inline uint32_t mutotpd_ring_writable(struct mutotpd_ring* ring, uint32_t head)
+{
+	//Producer side: free slots ahead of head
+	return MUTOTPD_RING_SLOTS - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline void mutotpd_ring_publish(struct mutotpd_ring* ring, uint32_t head)
+{
+	//The fence orders the head store before the waiting load; paired with
+	//the one in mutotpd_ring_sleep, either the consumer sees the new head
+	//or the producer sees it waiting
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED))
+	{
+		syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, 0, 0, 0);
+	}
+}
+
+static inline void mutotpd_ring_consume(struct mutotpd_ring* ring, uint32_t tail)
+{
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static inline void mutotpd_ring_sleep(struct mutotpd_ring* ring, uint32_t tail,
+		const struct timespec* timeout)
+{
+	//Sleeps until head moves past tail, the timeout passes or a wakeup.
+	//Not a private futex: the two sides are different processes.
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail)
+	{
+		syscall(SYS_futex, &ring->head, FUTEX_WAIT, tail, timeout, 0, 0);
+	}
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+}
+
+#endif
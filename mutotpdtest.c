@@ -0,0 +1,212 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "mutotpd.h"
+#include "totp.h"
+#include "base32codec.h"
+
+static char sockpath[64];
+static char storepath[64];
+
+static pid_t start_daemon(void)
+{
+	pid_t pid = fork();
+	if(!pid)
+	{
+		execl("./mutotpd", "mutotpd", "-f", storepath, "-s", sockpath, "-i", "Test", (char*) 0);
+		_exit(127);
+	}
+	return pid;
+}
+
+static struct mutotpd_client* connect_daemon(void)
+{
+	//Give the daemon a moment to bind its socket
+	int tries = 0;
+	for(; tries < 200; ++tries)
+	{
+		struct mutotpd_client* client = mutotpd_connect(sockpath);
+		if(client)
+		{
+			return client;
+		}
+		usleep(10000);
+	}
+	return 0;
+}
+
+static int stop_daemon(pid_t pid)
+{
+	int status = 0;
+	kill(pid, SIGTERM);
+	return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status) ? 0 : -1;
+}
+
+static int wait_response(struct mutotpd_client* client, struct mutotpd_response* response)
+{
+	for(;;)
+	{
+		int got = mutotpd_read(client, response);
+		if(got)
+		{
+			return got;
+		}
+		struct pollfd pfd = {mutotpd_fd(client), POLLIN, 0};
+		if(poll(&pfd, 1, 5000) <= 0)
+		{
+			return -1;
+		}
+	}
+}
+
+int check_daemon()
+{
+	pid_t pid = start_daemon();
+	struct mutotpd_client* client = connect_daemon();
+	if(pid < 0 || !client)
+	{
+		return -1;
+	}
+
+	struct mutotpd_response response;
+	int result = 0;
+	result |= mutotpd_send_enroll(client, 1, "alice", 5) < 0;
+	result |= wait_response(client, &response) != 1 || response.id != 1 ||
+		response.status != MUTOTPD_OK || response.len < 33 || response.data[32] != '\t';
+
+	char secret[21];
+	time_t now = time(0);
+	int32_t code = -1;
+	if(!result && base32decode(response.data, 32, secret, sizeof(secret)) == 20)
+	{
+		code = compute_totp(secret, 20, now, 30, 6);
+	}
+
+	//Pipelined: everything is sent before any response is read, and the
+	//responses come back in order
+	result |= mutotpd_send_enroll(client, 2, "alice", 5) < 0;
+	result |= mutotpd_send_verify(client, 3, "alice", 5, code) < 0;
+	result |= mutotpd_send_verify(client, 4, "alice", 5, code) < 0;
+	result |= mutotpd_send_verify(client, 5, "bob", 3, code) < 0;
+	result |= mutotpd_send_render(client, 6, "alice", 5) < 0;
+	result |= mutotpd_send_enroll(client, 7, "a\tb", 3) < 0;
+	result |= mutotpd_send_enroll(client, 8, "a_name_too_long_for_a_uri", 25) != -1;
+
+	static const int8_t expected[] =
+	{
+		MUTOTPD_EXISTS, TOTP_VERIFY_OK, TOTP_VERIFY_REPLAYED, MUTOTPD_UNKNOWN_USER,
+		MUTOTPD_OK, MUTOTPD_BAD_REQUEST
+	};
+	static const int8_t expected_ring[] =
+	{
+		TOTP_VERIFY_OK, TOTP_VERIFY_REPLAYED, MUTOTPD_UNKNOWN_USER
+	};
+	uint32_t id = 2;
+	for(; id <= 7 && !result; ++id)
+	{
+		result |= wait_response(client, &response) != 1 || response.id != id ||
+			response.status != expected[id - 2];
+		if(!result && id == 6)
+		{
+			result |= response.len < 1000;
+		}
+	}
+	mutotpd_close(client);
+
+	//The same through a shared memory channel, which the rest of the test
+	//drives past the ring size several times
+	client = connect_daemon();
+	result |= !client || mutotpd_ring_open(client) < 0;
+	if(!result)
+	{
+		int32_t nextcode = compute_totp(secret, 20, now + 30, 30, 6);
+		result |= mutotpd_ring_send_verify(client, 10, "alice", 5, nextcode) < 0;
+		result |= mutotpd_ring_send_verify(client, 11, "alice", 5, nextcode) < 0;
+		result |= mutotpd_ring_send_verify(client, 12, "bob", 3, nextcode) < 0;
+		for(id = 10; id <= 12 && !result; ++id)
+		{
+			result |= mutotpd_ring_wait(client, 5000) != 1 ||
+				mutotpd_ring_read(client, &response) != 1 || response.id != id ||
+				response.status != expected_ring[id - 10];
+		}
+
+		uint32_t sent = 0, received = 0;
+		while(received < 5000 && !result)
+		{
+			while(sent < 5000 && mutotpd_ring_send_verify(client, sent, "alice", 5, 0) == 0)
+			{
+				++sent;
+			}
+			result |= mutotpd_ring_wait(client, 5000) != 1;
+			while(mutotpd_ring_read(client, &response) == 1)
+			{
+				result |= response.id != received++ || response.status != TOTP_VERIFY_INVALID;
+			}
+		}
+	}
+	mutotpd_close(client);
+	result |= stop_daemon(pid) < 0;
+
+	//Enrollments survive a restart
+	pid = start_daemon();
+	client = connect_daemon();
+	if(pid < 0 || !client)
+	{
+		return -1;
+	}
+	result |= mutotpd_send_enroll(client, 9, "alice", 5) < 0;
+	result |= wait_response(client, &response) != 1 || response.status != MUTOTPD_EXISTS;
+	mutotpd_close(client);
+	result |= stop_daemon(pid) < 0;
+
+	//The store of secrets is private, and the daemon will not load one that
+	//others can read
+	struct stat st;
+	result |= stat(storepath, &st) < 0 || (st.st_mode & 0777) != 0600;
+	int status = 0;
+	pid = chmod(storepath, 0644) == 0 ? start_daemon() : -1;
+	result |= pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		!WEXITSTATUS(status);
+
+	return result ? -1 : 0;
+}
+
+int main(void)
+{
+	snprintf(sockpath, sizeof(sockpath), "/tmp/mutotpdtest-%d.sock", (int) getpid());
+	snprintf(storepath, sizeof(storepath), "/tmp/mutotpdtest-%d.store", (int) getpid());
+
+	int daemonfailed = check_daemon() < 0;
+	printf("Daemon test %s.\n", daemonfailed ? "failed" : "passed");
+	unlink(storepath);
+
+	return daemonfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,109 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include "mutotp.hpp"
+
+using totp8 = mutotp::totp<8, 30>;
+using totp6 = mutotp::totp<6, 30>;
+
+static_assert(!std::is_copy_constructible_v<mutotp::hmac_key<>>);
+static_assert(std::is_nothrow_move_constructible_v<mutotp::hmac_key<>>);
+static_assert(totp6::format(42)[0] == '0' && totp6::format(42)[5] == '2');
+
+int check_vectors()
+{
+	//RFC 6238 appendix B, SHA1
+	static const struct
+	{
+		std::int64_t time;
+		std::uint32_t code;
+	} vectors[] =
+	{
+		{59, 94287082}, {1111111109, 7081804}, {1111111111, 14050471},
+		{1234567890, 89005924}, {2000000000, 69279037}, {20000000000, 65353130}
+	};
+	static const char secret[] = "12345678901234567890";
+	mutotp::hmac_key<> key(std::string_view(secret, 20));
+	for(const auto& v : vectors)
+	{
+		if(totp8::at(key, v.time) != v.code ||
+			static_cast<std::int32_t>(totp6::at(key, v.time)) !=
+				compute_totp(secret, 20, v.time, 30, 6))
+		{
+			return -1;
+		}
+	}
+	if(std::strcmp(totp8::format(7081804).data(), "07081804") != 0)
+	{
+		return -1;
+	}
+
+	//Moving hands the key over
+	mutotp::hmac_key<> moved(std::move(key));
+	if(totp8::at(moved, 59) != 94287082)
+	{
+		return -1;
+	}
+
+	//The same secret in base32
+	auto decoded = mutotp::hmac_key<>::from_base32("GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ");
+	if(!decoded || totp8::at(*decoded, 1234567890) != 89005924 ||
+		mutotp::hmac_key<>::from_base32("not base32!"))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int check_verify()
+{
+	static const char secret[] = "12345678901234567890";
+	mutotp::hmac_key<> key(std::string_view(secret, 20));
+	std::uint64_t last = 0;
+	std::uint32_t code = totp6::at(key, 1234567890 - 30);
+	if(totp6::verify(key, code, 1234567890, 1, &last) != mutotp::verify_result::ok ||
+		last != (1234567890 - 30) / 30 ||
+		totp6::verify(key, code, 1234567890, 1, &last) != mutotp::verify_result::replayed ||
+		totp6::verify(key, code, 1234567890, 0) != mutotp::verify_result::invalid ||
+		totp6::verify(key, code, 1234567890 + 60, 1) != mutotp::verify_result::invalid)
+	{
+		return -1;
+	}
+
+	//Agrees with the C implementation
+	std::uint64_t clast = 0;
+	return totp_verify(secret, 20, code, 1234567890, 30, 6, 1, &clast) == TOTP_VERIFY_OK &&
+		clast == last ? 0 : -1;
+}
+
+int main()
+{
+	int vectorsfailed = check_vectors() < 0;
+	std::printf("Template test %s.\n", vectorsfailed ? "failed" : "passed");
+	int verifyfailed = check_verify() < 0;
+	std::printf("Template verify test %s.\n", verifyfailed ? "failed" : "passed");
+
+	return vectorsfailed || verifyfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,367 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include "otpauth.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int span_equals(const char* data, size_t len, const char* str)
+{
+	size_t strlength = strlen(str);
+	return len == strlength && memcmp(data, str, len) == 0;
+}
+
+static int span_has_prefix_nocase(const char* data, size_t len, const char* prefix)
+{
+	//Only letters fold, so that e.g. 0x1a does not pass for ':'
+	size_t idx = 0;
+	for(; prefix[idx]; ++idx)
+	{
+		if(idx >= len)
+		{
+			return 0;
+		}
+		char c = data[idx];
+		if((c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c) != prefix[idx])
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int parse_number(struct otpauth_span span, uint64_t max, uint64_t* out)
+{
+	if(!span.len)
+	{
+		return -1;
+	}
+	uint64_t value = 0;
+	size_t idx = 0;
+	for(; idx < span.len; ++idx)
+	{
+		unsigned digit = (unsigned char) span.data[idx] - '0';
+		if(digit > 9 || digit > max || value > (max - digit) / 10)
+		{
+			return -1;
+		}
+		value = value * 10 + digit;
+	}
+	*out = value;
+	return 0;
+}
+
+static void split_label(struct otpauth_uri* out, struct otpauth_span* prefix)
+{
+	//"issuer:account", where the colon may be escaped and spaces may follow it
+	const char* label = out->label.data;
+	size_t len = out->label.len;
+	size_t idx = 0, after = 0;
+	for(; idx < len; ++idx)
+	{
+		if(label[idx] == ':')
+		{
+			after = idx + 1;
+			break;
+		}
+		if(label[idx] == '%' && idx + 2 < len && label[idx + 1] == '3' &&
+			(label[idx + 2] | 0x20) == 'a')
+		{
+			after = idx + 3;
+			break;
+		}
+	}
+
+	if(!after)
+	{
+		out->account = out->label;
+		prefix->data = label;
+		prefix->len = 0;
+		return;
+	}
+
+	prefix->data = label;
+	prefix->len = idx;
+	for(;;)
+	{
+		if(after < len && label[after] == ' ')
+		{
+			after += 1;
+		}
+		else if(after + 2 < len && label[after] == '%' && label[after + 1] == '2' &&
+			label[after + 2] == '0')
+		{
+			after += 3;
+		}
+		else
+		{
+			break;
+		}
+	}
+	out->account.data = &label[after];
+	out->account.len = len - after;
+}
+
+static uint32_t escaped_bit(struct otpauth_span span, uint32_t bit)
+{
+	return span.len && memchr(span.data, '%', span.len) ? bit : 0;
+}
+
+int otpauth_parse(const char* uri, size_t len, struct otpauth_uri* out)
+{
+	memset(out, 0, sizeof(struct otpauth_uri));
+	out->digits = 6;
+	out->period = 30;
+
+	//otpauth://TYPE/LABEL?PARAMETERS
+	static const char scheme[] = "otpauth://";
+	const size_t schemelen = sizeof(scheme) - 1;
+	if(!span_has_prefix_nocase(uri, len, scheme))
+	{
+		return -1;
+	}
+	const char* pos = &uri[schemelen];
+	const char* end = &uri[len];
+
+	const char* slash = (const char*) memchr(pos, '/', end - pos);
+	if(!slash)
+	{
+		return -1;
+	}
+	size_t typelen = slash - pos;
+	if(typelen == 4 && span_has_prefix_nocase(pos, typelen, "totp"))
+	{
+		out->type = OTPAUTH_TOTP;
+	}
+	else if(typelen == 4 && span_has_prefix_nocase(pos, typelen, "hotp"))
+	{
+		out->type = OTPAUTH_HOTP;
+	}
+	else
+	{
+		return -1;
+	}
+	pos = slash + 1;
+
+	const char* query = (const char*) memchr(pos, '?', end - pos);
+	out->label.data = pos;
+	out->label.len = (query ? query : end) - pos;
+
+	struct otpauth_span prefix;
+	split_label(out, &prefix);
+
+	struct otpauth_span digits = {0, 0}, period = {0, 0}, counter = {0, 0};
+	int hasissuer = 0;
+	pos = query ? query + 1 : end;
+	while(pos < end)
+	{
+		const char* amp = (const char*) memchr(pos, '&', end - pos);
+		const char* paramend = amp ? amp : end;
+		const char* eq = (const char*) memchr(pos, '=', paramend - pos);
+		if(eq)
+		{
+			size_t keylen = eq - pos;
+			struct otpauth_span value = {eq + 1, (size_t) (paramend - eq - 1)};
+			if(span_equals(pos, keylen, "secret"))
+			{
+				out->secret = value;
+			}
+			else if(span_equals(pos, keylen, "issuer"))
+			{
+				out->issuer = value;
+				hasissuer = 1;
+			}
+			else if(span_equals(pos, keylen, "algorithm"))
+			{
+				out->algorithm = value;
+			}
+			else if(span_equals(pos, keylen, "digits"))
+			{
+				digits = value;
+			}
+			else if(span_equals(pos, keylen, "period"))
+			{
+				period = value;
+			}
+			else if(span_equals(pos, keylen, "counter"))
+			{
+				counter = value;
+			}
+		}
+		pos = paramend + 1;
+	}
+
+	if(!hasissuer)
+	{
+		out->issuer = prefix;
+	}
+	if(!out->secret.len)
+	{
+		return -1;
+	}
+
+	uint64_t number;
+	if(digits.data)
+	{
+		//The lengths compute_totp and compute_hotp can produce
+		if(parse_number(digits, 8, &number) < 0 || !number)
+		{
+			return -1;
+		}
+		out->digits = number;
+	}
+	if(period.data)
+	{
+		if(parse_number(period, UINT32_MAX, &number) < 0 || !number)
+		{
+			return -1;
+		}
+		out->period = number;
+	}
+	if(counter.data && parse_number(counter, UINT64_MAX, &out->counter) < 0)
+	{
+		return -1;
+	}
+
+	out->escaped = escaped_bit(out->label, OTPAUTH_ESCAPED_LABEL) |
+		escaped_bit(out->account, OTPAUTH_ESCAPED_ACCOUNT) |
+		escaped_bit(out->issuer, OTPAUTH_ESCAPED_ISSUER) |
+		escaped_bit(out->secret, OTPAUTH_ESCAPED_SECRET) |
+		escaped_bit(out->algorithm, OTPAUTH_ESCAPED_ALGORITHM);
+	return 0;
+}
+
+static int hexvalue(char c)
+{
+	if(c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+int32_t otpauth_unescape(struct otpauth_span span, char* out, size_t outlen)
+{
+	if(outlen <= span.len || span.len > INT32_MAX)
+	{
+		return -1;
+	}
+
+	size_t idx = 0, out_idx = 0;
+	while(idx < span.len)
+	{
+		//Copy runs without escapes in one go
+		const char* pct = (const char*) memchr(&span.data[idx], '%', span.len - idx);
+		size_t run = (pct ? (size_t) (pct - span.data) : span.len) - idx;
+		memcpy(&out[out_idx], &span.data[idx], run);
+		idx += run;
+		out_idx += run;
+		if(!pct)
+		{
+			break;
+		}
+
+		if(idx + 2 >= span.len)
+		{
+			return -1;
+		}
+		int hi = hexvalue(span.data[idx + 1]);
+		int lo = hexvalue(span.data[idx + 2]);
+		if(hi < 0 || lo < 0)
+		{
+			return -1;
+		}
+		out[out_idx++] = (hi << 4) | lo;
+		idx += 3;
+	}
+	out[out_idx] = 0;
+	return out_idx;
+}
+
+int otpauth_parse_lines(const char* data, size_t len, otpauth_callback callback, void* arg)
+{
+	const char* line = data;
+	const char* end = data + len;
+	while(line < end)
+	{
+		const char* nl = (const char*) memchr(line, '\n', end - line);
+		const char* lineend = nl ? nl : end;
+		struct otpauth_span span = {line, (size_t) (lineend - line)};
+		if(span.len && line[span.len - 1] == '\r')
+		{
+			span.len -= 1;
+		}
+
+		if(span.len)
+		{
+			struct otpauth_uri uri;
+			int parsed = otpauth_parse(span.data, span.len, &uri) == 0;
+			int stop = callback(parsed ? &uri : 0, span, arg);
+			if(stop)
+			{
+				return stop;
+			}
+		}
+		line = lineend + 1;
+	}
+	return 0;
+}
+
+int otpauth_parse_file(const char* path, otpauth_callback callback, void* arg)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if(st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+
+	void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	int result = otpauth_parse_lines((const char*) map, st.st_size, callback, arg);
+	munmap(map, st.st_size);
+	return result;
+}
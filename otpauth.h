@@ -0,0 +1,106 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef OTPAUTH_H_
+#define OTPAUTH_H_
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+struct otpauth_span
+{
+	const char* data;
+	size_t len;
+};
+
+enum otpauth_type
+{
+	OTPAUTH_TOTP = 0,
+	OTPAUTH_HOTP
+};
+
+//Bits of otpauth_uri.escaped
+#define OTPAUTH_ESCAPED_LABEL (1 << 0)
+#define OTPAUTH_ESCAPED_ACCOUNT (1 << 1)
+#define OTPAUTH_ESCAPED_ISSUER (1 << 2)
+#define OTPAUTH_ESCAPED_SECRET (1 << 3)
+#define OTPAUTH_ESCAPED_ALGORITHM (1 << 4)
+
+struct otpauth_uri
+{
+/* An otpauth:// URI split into its fields. The spans point into the parsed
+ * text and are still percent-encoded; only those with their bit set in escaped
+ * contain a '%' and need otpauth_unescape, the others can be used as they are.
+ * Fields missing from the URI are empty spans.
+ */
+	enum otpauth_type type;
+	struct otpauth_span label;	//Whole label, "issuer:account" or "account"
+	struct otpauth_span account;	//Label after the issuer prefix
+	struct otpauth_span issuer;	//issuer parameter, else the label's prefix
+	struct otpauth_span secret;	//base32 secret
+	struct otpauth_span algorithm;	//Empty means SHA1
+	uint32_t digits;		//6 unless given
+	uint32_t period;		//30 unless given
+	uint64_t counter;		//HOTP only
+	uint32_t escaped;
+};
+
+int otpauth_parse(const char* uri, size_t len, struct otpauth_uri* out);
+/* otpauth_parse: splits the otpauth URI in uri[0, len) into out without
+ * copying or allocating. Returns 0 on success, -1 if it is not an otpauth
+ * totp or hotp URI, has no secret, digits is not a number from 1 to 8, or
+ * period or counter are not numbers. Unknown parameters are ignored.
+ */
+
+int32_t otpauth_unescape(struct otpauth_span span, char* out, size_t outlen);
+/* otpauth_unescape: percent-decodes span into out and null terminates it.
+ * Returns the decoded length, or -1 on a malformed escape or if out is
+ * shorter than span.len + 1 (always enough).
+ */
+
+typedef int (*otpauth_callback)(const struct otpauth_uri* uri,
+		struct otpauth_span line, void* arg);
+/* Called by the batch parsers for every non-empty line, with uri NULL if the
+ * line did not parse. The spans are only valid during the call. Returning
+ * nonzero stops the batch.
+ */
+
+int otpauth_parse_lines(const char* data, size_t len, otpauth_callback callback, void* arg);
+/* otpauth_parse_lines: parses one URI per line of data[0, len) (LF or CRLF
+ * line endings). Returns 0 once every line was handed to callback, or the
+ * nonzero value callback stopped with.
+ */
+
+int otpauth_parse_file(const char* path, otpauth_callback callback, void* arg);
+/* otpauth_parse_file: maps the export file at path read-only and runs
+ * otpauth_parse_lines on it in place, so exports of any size are parsed
+ * without being read into memory. Returns -1 if the file cannot be opened or
+ * mapped, otherwise as otpauth_parse_lines.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
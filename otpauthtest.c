@@ -0,0 +1,126 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "otpauth.h"
+
+static int span_is(struct otpauth_span span, const char* str)
+{
+	return span.len == strlen(str) && memcmp(span.data, str, span.len) == 0;
+}
+
+int check_parse()
+{
+	static const char uri[] = "otpauth://totp/ACME%20Co:john.doe%40email.com?"
+		"secret=HXDMVJECJJWSRB3HWIZR4IFUGFTMXBOZ&issuer=ACME%20Co&algorithm=SHA1"
+		"&digits=8&period=60&image=x";
+	struct otpauth_uri parsed;
+	if(otpauth_parse(uri, strlen(uri), &parsed) < 0 ||
+		parsed.type != OTPAUTH_TOTP ||
+		!span_is(parsed.label, "ACME%20Co:john.doe%40email.com") ||
+		!span_is(parsed.account, "john.doe%40email.com") ||
+		!span_is(parsed.issuer, "ACME%20Co") ||
+		!span_is(parsed.secret, "HXDMVJECJJWSRB3HWIZR4IFUGFTMXBOZ") ||
+		!span_is(parsed.algorithm, "SHA1") ||
+		parsed.digits != 8 || parsed.period != 60 ||
+		parsed.escaped != (OTPAUTH_ESCAPED_LABEL | OTPAUTH_ESCAPED_ACCOUNT | OTPAUTH_ESCAPED_ISSUER))
+	{
+		return -1;
+	}
+
+	char buf[64];
+	if(otpauth_unescape(parsed.account, buf, sizeof(buf)) != 18 ||
+		strcmp(buf, "john.doe@email.com") != 0)
+	{
+		return -1;
+	}
+
+	//Issuer from the label prefix, defaults, HOTP counter
+	static const char hotp[] = "OTPAUTH://HOTP/Example%3A%20alice?counter=42&secret=JBSWY3DPEHPK3PXP";
+	if(otpauth_parse(hotp, strlen(hotp), &parsed) < 0 ||
+		parsed.type != OTPAUTH_HOTP || parsed.counter != 42 ||
+		!span_is(parsed.issuer, "Example") || !span_is(parsed.account, "alice") ||
+		parsed.digits != 6 || parsed.period != 30 || parsed.algorithm.len)
+	{
+		return -1;
+	}
+
+	static const char* invalid[] = {
+		"http://totp/a?secret=JBSWY3DP", "otpauth://xotp/a?secret=JBSWY3DP",
+		"otpauth://totp/a?issuer=b", "otpauth://totp/a?secret=JBSWY3DP&digits=6x",
+		"otpauth://totp/a?secret=JBSWY3DP&period=0", "otpauth://totp",
+		"otpauth://totp/a?secret=JBSWY3DP&digits=9", "otpauth://totp/a?secret=JBSWY3DP&digits=0",
+		"otpauth\x1a//totp/a?secret=JBSWY3DP", "otpauth:\x0f/totp/a?secret=JBSWY3DP"
+	};
+	size_t idx = 0;
+	for(; idx < sizeof(invalid)/sizeof(invalid[0]); ++idx)
+	{
+		if(otpauth_parse(invalid[idx], strlen(invalid[idx]), &parsed) == 0)
+		{
+			return -1;
+		}
+	}
+	if(otpauth_unescape((struct otpauth_span) {"a%4", 3}, buf, sizeof(buf)) >= 0 ||
+		otpauth_unescape((struct otpauth_span) {"a%zz", 4}, buf, sizeof(buf)) >= 0)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+static int count_line(const struct otpauth_uri* uri, struct otpauth_span line, void* arg)
+{
+	//Only the garbage line should fail, and it is passed without its newline
+	size_t* counts = (size_t*) arg;
+	counts[uri ? 0 : span_is(line, "garbage") ? 1 : 2] += 1;
+	return 0;
+}
+
+int check_file()
+{
+	char path[] = "/tmp/otpauthtestXXXXXX";
+	int fd = mkstemp(path);
+	if(fd < 0)
+	{
+		return -1;
+	}
+	static const char data[] = "otpauth://totp/a?secret=JBSWY3DP\r\n\n"
+		"garbage\notpauth://totp/b?secret=MZXW6YTB";
+	int written = write(fd, data, sizeof(data) - 1) == (ssize_t) (sizeof(data) - 1);
+	close(fd);
+
+	size_t counts[3] = {0, 0, 0};
+	int result = written ? otpauth_parse_file(path, count_line, counts) : -1;
+	unlink(path);
+	return result == 0 && counts[0] == 2 && counts[1] == 1 && !counts[2] ? 0 : -1;
+}
+
+int main(void)
+{
+	int parsefailed = check_parse() < 0;
+	printf("Parser test %s.\n", parsefailed ? "failed" : "passed");
+	int filefailed = check_file() < 0;
+	printf("Batch test %s.\n", filefailed ? "failed" : "passed");
+
+	return parsefailed || filefailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
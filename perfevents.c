@@ -0,0 +1,147 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#include "perfevents.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const struct
+{
+	uint32_t type;
+	uint64_t config;
+	const char* name;
+} perf_counter_events[PERF_COUNTER_COUNT] =
+{
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch_misses"},
+	{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16), "l1d_misses"}
+};
+
+//What a counter reads as with PERF_FORMAT_TOTAL_TIME_ENABLED | _RUNNING
+struct perf_read
+{
+	uint64_t value;
+	uint64_t enabled;
+	uint64_t running;
+};
+
+int perf_counters_open(struct perf_counters* pc)
+{
+	int opened = 0;
+	size_t idx = 0;
+	pc->err = 0;
+	for(; idx < PERF_COUNTER_COUNT; ++idx)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_counter_events[idx].type;
+		attr.config = perf_counter_events[idx].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		//Each counter is its own group, so one the PMU lacks doesn't take
+		//the others down with it
+		pc->fds[idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if(pc->fds[idx] < 0)
+		{
+			pc->fds[idx] = -1;
+			if(!pc->err)
+			{
+				pc->err = errno;
+			}
+			continue;
+		}
+		++opened;
+	}
+	return opened;
+}
+
+void perf_counters_start(struct perf_counters* pc)
+{
+	size_t idx = 0;
+	for(; idx < PERF_COUNTER_COUNT; ++idx)
+	{
+		if(pc->fds[idx] >= 0)
+		{
+			ioctl(pc->fds[idx], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc->fds[idx], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+void perf_counters_stop(struct perf_counters* pc, uint64_t values[PERF_COUNTER_COUNT])
+{
+	size_t idx = 0;
+	for(; idx < PERF_COUNTER_COUNT; ++idx)
+	{
+		if(pc->fds[idx] >= 0)
+		{
+			ioctl(pc->fds[idx], PERF_EVENT_IOC_DISABLE, 0);
+		}
+	}
+
+	for(idx = 0; idx < PERF_COUNTER_COUNT; ++idx)
+	{
+		struct perf_read r;
+		if(pc->fds[idx] < 0 || read(pc->fds[idx], &r, sizeof(r)) != sizeof(r) || !r.running)
+		{
+			continue;
+		}
+		if(r.running < r.enabled)
+		{
+			r.value = (uint64_t) ((double) r.value * r.enabled / r.running);
+		}
+		values[idx] += r.value;
+	}
+}
+
+int perf_counters_has(const struct perf_counters* pc, enum perf_counter counter)
+{
+	return pc->fds[counter] >= 0;
+}
+
+void perf_counters_close(struct perf_counters* pc)
+{
+	size_t idx = 0;
+	for(; idx < PERF_COUNTER_COUNT; ++idx)
+	{
+		if(pc->fds[idx] >= 0)
+		{
+			close(pc->fds[idx]);
+			pc->fds[idx] = -1;
+		}
+	}
+}
+
+const char* perf_counter_name(enum perf_counter counter)
+{
+	return perf_counter_events[counter].name;
+}
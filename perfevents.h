@@ -0,0 +1,69 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef PERFEVENTS_H_
+#define PERFEVENTS_H_
+#include <stdint.h>
+#include <stddef.h>
+
+//Hardware counters around a region of code, read through perf_event_open.
+//Only user space of the calling thread is counted, which is what an
+//unprivileged process may count at the default perf_event_paranoid of 2.
+
+enum perf_counter
+{
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,	//L1 data cache read misses
+	PERF_COUNTER_COUNT
+};
+
+struct perf_counters
+{
+	int fds[PERF_COUNTER_COUNT];	//-1 for counters that could not be opened
+	int err;			//errno of the first counter that failed to open
+};
+
+int perf_counters_open(struct perf_counters* pc);
+/* perf_counters_open: opens every counter it can for the calling thread,
+ * disabled. Returns how many opened; 0 means none are usable (no PMU, perf
+ * events not permitted, or running under a hypervisor that hides them), with
+ * the reason in pc->err.
+ */
+
+void perf_counters_start(struct perf_counters* pc);
+/* perf_counters_start: zeroes and enables the open counters */
+
+void perf_counters_stop(struct perf_counters* pc, uint64_t values[PERF_COUNTER_COUNT]);
+/* perf_counters_stop: disables the open counters and adds what they counted
+ * since perf_counters_start to values. When the kernel had to multiplex them
+ * onto fewer hardware counters, the counts are scaled up to the whole region.
+ */
+
+int perf_counters_has(const struct perf_counters* pc, enum perf_counter counter);
+/* perf_counters_has: nonzero if counter opened */
+
+void perf_counters_close(struct perf_counters* pc);
+
+const char* perf_counter_name(enum perf_counter counter);
+/* perf_counter_name: "cycles", "instructions", "branch_misses" or "l1d_misses" */
+
+#endif
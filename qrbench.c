@@ -0,0 +1,506 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+//qrbench: how the QR encoder scales with the symbol version.
+//
+//Sweeps versions 1-40 and all four ECC levels. Every symbol carries the
+//longest of a set of otpauth URI lengths that fits it. For each one it reports
+//the time spent in every encoder stage plus the ANSI rendering, the rendered
+//size, and the stack and heap the public encoder uses for it.
+//
+//qrcode.c is compiled into this program with its stage profiler enabled, so
+//the stages are timed inside the real qrcode_initBytesWorkspace; the heap is
+//counted by wrapping malloc and friends at link time. With -p, hardware
+//counters (cycles, instructions, branch and L1D misses) are read around each
+//symbol's timed encodes and reported per symbol along with IPC.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifndef QRCODE_PROFILE
+#define QRCODE_PROFILE
+#endif
+#include "qrcode/qrcode.c"
+#include "totp.h"
+#include "perfevents.h"
+
+#define QRBENCH_MAX_VERSION 40
+#define QRBENCH_STACK_SIZE (1 << 20)
+#define QRBENCH_STACK_PAINT 0xA5
+
+//Columns reported, in pipeline order; the penalty column sums the eight
+//getPenaltyScore stages, which CSV output also lists one by one
+#define STAGE_PENALTY_ALL -1
+
+static const struct
+{
+	const char* name;
+	int stage;
+} columns[] =
+{
+	{"encode", QRCODE_STAGE_ENCODE},
+	{"patterns", QRCODE_STAGE_PATTERNS},
+	{"ecc", QRCODE_STAGE_ECC},
+	{"place", QRCODE_STAGE_PLACE},
+	{"mask", QRCODE_STAGE_MASK},
+	{"penalty", STAGE_PENALTY_ALL},
+	{"render", QRCODE_STAGE_RENDER}
+};
+#define NCOLUMNS (sizeof(columns) / sizeof(columns[0]))
+
+//Realistic otpauth URI lengths: bulk payloads for the big versions, URIs
+//with every optional parameter, the longest and shortest URIs this library
+//makes, and truncated ones for the versions too small to hold a URI
+static const uint16_t payload_lengths[] =
+{
+	2048, 1024, 512, 256, 160, 106, 77, 48, 32, 17, 7
+};
+
+#pragma mark - Heap accounting
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+//Every block carries its size in a header that keeps the payload aligned
+#define HEAP_HEADER 16
+
+static size_t heap_current = 0, heap_peak = 0;
+
+static void heap_account(ssize_t delta)
+{
+	size_t current = __atomic_add_fetch(&heap_current, delta, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+	while(current > peak &&
+		!__atomic_compare_exchange_n(&heap_peak, &peak, current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+}
+
+void* __wrap_malloc(size_t size)
+{
+	uint8_t* block = (uint8_t*) __real_malloc(size + HEAP_HEADER);
+	if(!block)
+	{
+		return 0;
+	}
+	*(size_t*) block = size;
+	heap_account(size);
+	return block + HEAP_HEADER;
+}
+
+void* __wrap_calloc(size_t count, size_t size)
+{
+	if(size && count > (SIZE_MAX - HEAP_HEADER) / size)
+	{
+		return 0;
+	}
+	void* ptr = __wrap_malloc(count * size);
+	if(ptr)
+	{
+		memset(ptr, 0, count * size);
+	}
+	return ptr;
+}
+
+void __wrap_free(void* ptr)
+{
+	if(ptr)
+	{
+		uint8_t* block = (uint8_t*) ptr - HEAP_HEADER;
+		heap_account(-(ssize_t) *(size_t*) block);
+		__real_free(block);
+	}
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+	if(!ptr)
+	{
+		return __wrap_malloc(size);
+	}
+	uint8_t* block = (uint8_t*) ptr - HEAP_HEADER;
+	size_t oldsize = *(size_t*) block;
+	uint8_t* grown = (uint8_t*) __real_realloc(block, size + HEAP_HEADER);
+	if(!grown)
+	{
+		return 0;
+	}
+	*(size_t*) grown = size;
+	heap_account((ssize_t) size - (ssize_t) oldsize);
+	return grown + HEAP_HEADER;
+}
+
+#pragma mark - Stack accounting
+
+struct stack_probe
+{
+	uint8_t version;
+	uint8_t ecc;
+	const char* payload;
+	int8_t result;
+};
+
+static void* stack_probe_run(void* arg)
+{
+	//What an application calling the public encoder without a workspace uses,
+	//its per-thread workspace included: glibc puts thread-local storage at
+	//the top of the thread's stack
+	struct stack_probe* probe = (struct stack_probe*) arg;
+	static uint8_t modules[QRCODE_WORKSPACE_SIZE(QRBENCH_MAX_VERSION) / 3];
+	QRCode qrcode;
+	probe->result = qrcode_initText(&qrcode, modules, probe->version, probe->ecc, probe->payload);
+	return 0;
+}
+
+static size_t measure_stack(struct stack_probe* probe)
+{
+	//Runs the probe on a painted stack of our own and finds the deepest byte
+	//it overwrote (the stack grows down from the top of the block)
+	uint8_t* stack = (uint8_t*) __real_malloc(QRBENCH_STACK_SIZE);
+	if(!stack)
+	{
+		return 0;
+	}
+	memset(stack, QRBENCH_STACK_PAINT, QRBENCH_STACK_SIZE);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, QRBENCH_STACK_SIZE);
+	pthread_t thread;
+	size_t used = 0;
+	if(pthread_create(&thread, &attr, stack_probe_run, probe) == 0)
+	{
+		pthread_join(thread, 0);
+		size_t idx = 0;
+		while(idx < QRBENCH_STACK_SIZE && stack[idx] == QRBENCH_STACK_PAINT)
+		{
+			++idx;
+		}
+		used = QRBENCH_STACK_SIZE - idx;
+	}
+	pthread_attr_destroy(&attr);
+	__real_free(stack);
+	return used;
+}
+
+#pragma mark - Stage timing
+
+static inline double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int32_t encode_profiled(QRCode* qrcode, uint8_t* modules, uint8_t version, uint8_t ecc,
+		const char* payload, qrcode_workspace* workspace, char* ansi, size_t ansilen)
+{
+	//totp.o is built without the profiler, so the render is timed here
+	if(qrcode_initTextWorkspace(qrcode, modules, version, ecc, payload, workspace) < 0)
+	{
+		return -1;
+	}
+	uint64_t start = qrcode_profileNow();
+	int32_t ansibytes = totp_render_qrcode_ansi(qrcode, ansi, ansilen);
+	qrcode_profileAdd(QRCODE_STAGE_RENDER, qrcode_profileNow() - start);
+	return ansibytes;
+}
+
+static void make_payload(char* out, size_t len)
+{
+	//otpauth://totp/Issuer:label...?secret=...&issuer=Issuer, the label
+	//stretched to make the URI len bytes long
+	static const char head[] = "otpauth://totp/MUTOTP:";
+	static const char tail[] = "?secret=JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP&issuer=MUTOTP";
+	size_t fixed = sizeof(head) - 1 + sizeof(tail) - 1;
+	size_t labellen = len > fixed ? len - fixed : 1;
+	size_t idx = 0;
+
+	memcpy(out, head, sizeof(head) - 1);
+	char* label = &out[sizeof(head) - 1];
+	for(; idx < labellen; ++idx)
+	{
+		label[idx] = "player.of.the.mud"[idx % 17];
+	}
+	memcpy(&label[labellen], tail, sizeof(tail));
+
+	//Versions too small for any URI get its first len bytes
+	out[len] = 0;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [-m ms] [-v min-max] [-c] [-p]\n"
+		"  -m ms       time spent per symbol (default: 20)\n"
+		"  -v min-max  versions to sweep (default: 1-40)\n"
+		"  -c          CSV output\n"
+		"  -p          count cycles, instructions, branch and L1D misses per symbol\n",
+		argv0);
+}
+
+static void print_counter(const struct perf_counters* pc, const uint64_t* counts,
+		enum perf_counter counter, size_t iters, int csv)
+{
+	if(perf_counters_has(pc, counter))
+	{
+		printf(csv ? ",%.0f" : " %9.0f", (double) counts[counter] / iters);
+	}
+	else
+	{
+		printf(csv ? "," : " %9s", "-");
+	}
+}
+
+static void print_counters(const struct perf_counters* pc, const uint64_t* counts,
+		size_t iters, int csv)
+{
+	print_counter(pc, counts, PERF_CYCLES, iters, csv);
+	print_counter(pc, counts, PERF_INSTRUCTIONS, iters, csv);
+	if(perf_counters_has(pc, PERF_CYCLES) && perf_counters_has(pc, PERF_INSTRUCTIONS) &&
+		counts[PERF_CYCLES])
+	{
+		printf(csv ? ",%.2f" : " %5.2f",
+			(double) counts[PERF_INSTRUCTIONS] / counts[PERF_CYCLES]);
+	}
+	else
+	{
+		printf(csv ? "," : " %5s", "-");
+	}
+	print_counter(pc, counts, PERF_BRANCH_MISSES, iters, csv);
+	print_counter(pc, counts, PERF_L1D_MISSES, iters, csv);
+}
+
+int main(int argc, char** argv)
+{
+	double budgetms = 20;
+	unsigned minversion = 1, maxversion = QRBENCH_MAX_VERSION;
+	int csv = 0, useperf = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "m:v:cph")) != -1)
+	{
+		switch(opt)
+		{
+		case 'm': budgetms = strtod(optarg, 0); break;
+		case 'v':
+			if(sscanf(optarg, "%u-%u", &minversion, &maxversion) == 1)
+			{
+				maxversion = minversion;
+			}
+			break;
+		case 'c': csv = 1; break;
+		case 'p': useperf = 1; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if(minversion < 1 || maxversion > QRBENCH_MAX_VERSION || minversion > maxversion)
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	//Without counters (no PMU, or perf_event_paranoid forbids them) the
+	//timings are still worth having
+	struct perf_counters counters;
+	struct perf_counters* pc = 0;
+	if(useperf)
+	{
+		if(perf_counters_open(&counters) > 0)
+		{
+			pc = &counters;
+		}
+		else
+		{
+			fprintf(stderr, "Hardware counters unavailable (%s), timing only; see "
+				"/proc/sys/kernel/perf_event_paranoid\n", strerror(counters.err));
+			perf_counters_close(&counters);
+		}
+	}
+
+	static uint8_t workspacebytes[QRCODE_WORKSPACE_SIZE(QRBENCH_MAX_VERSION)];
+	static uint8_t modules[QRCODE_WORKSPACE_SIZE(QRBENCH_MAX_VERSION) / 3];
+	static char ansi[7 * (4 * QRBENCH_MAX_VERSION + 17) * (4 * QRBENCH_MAX_VERSION + 17) + 1];
+	static char payloads[sizeof(payload_lengths) / sizeof(payload_lengths[0])][2048 + 1];
+	const size_t npayloads = sizeof(payload_lengths) / sizeof(payload_lengths[0]);
+	qrcode_workspace workspace;
+	qrcode_initWorkspace(&workspace, workspacebytes, QRBENCH_MAX_VERSION);
+
+	size_t idx = 0;
+	for(; idx < npayloads; ++idx)
+	{
+		make_payload(payloads[idx], payload_lengths[idx]);
+	}
+
+	static const char eccnames[] = "LMQH";
+	const double tickns = 1e9 / qrcode_profileTicksPerSecond();
+	if(csv)
+	{
+		printf("version,ecc,payload,iterations");
+		for(idx = 0; idx < NCOLUMNS; ++idx)
+		{
+			printf(",%s_ns", columns[idx].name);
+		}
+		for(idx = 0; idx < 8; ++idx)
+		{
+			printf(",penalty%zu_ns", idx);
+		}
+		printf(",total_ns,ansi_bytes,stack_bytes,heap_bytes");
+		if(pc)
+		{
+			printf(",cycles,instructions,ipc,branch_misses,l1d_misses");
+		}
+		printf("\n");
+	}
+	else
+	{
+		printf("%3s %3s %7s", "ver", "ecc", "payload");
+		for(idx = 0; idx < NCOLUMNS; ++idx)
+		{
+			printf(" %9s", columns[idx].name);
+		}
+		printf(" %9s %9s %7s %7s", "total", "ansi", "stack", "heap");
+		if(pc)
+		{
+			printf(" %9s %9s %5s %9s %9s", "cycles", "instr", "IPC", "brmiss", "l1dmiss");
+		}
+		printf("   (us and counts per symbol)\n");
+	}
+
+	unsigned version = minversion;
+	for(; version <= maxversion; ++version)
+	{
+		uint8_t ecc = ECC_LOW;
+		for(; ecc <= ECC_HIGH; ++ecc)
+		{
+			//Cold run of the public encoder first: its stack, and any heap
+			//it takes
+			struct stack_probe probe = {version, ecc, 0, -1};
+			size_t heapbefore = __atomic_load_n(&heap_current, __ATOMIC_RELAXED);
+			size_t stackbytes = 0;
+			for(idx = 0; idx < npayloads && probe.result < 0; ++idx)
+			{
+				probe.payload = payloads[idx];
+				__atomic_store_n(&heap_peak, heapbefore, __ATOMIC_RELAXED);
+				stackbytes = measure_stack(&probe);
+			}
+			if(probe.result < 0)
+			{
+				continue;
+			}
+			size_t heapbytes = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED) - heapbefore;
+
+			QRCode qrcode;
+			int32_t ansibytes = 0;
+			size_t iters = 0;
+			uint64_t counts[PERF_COUNTER_COUNT] = {0};
+			qrcode_resetProfile();
+			if(pc)
+			{
+				perf_counters_start(pc);
+			}
+			double start = now_ns();
+			do
+			{
+				ansibytes = encode_profiled(&qrcode, modules, version, ecc, probe.payload,
+							&workspace, ansi, sizeof(ansi));
+				++iters;
+			}
+			while(ansibytes >= 0 && (now_ns() - start < budgetms * 1e6 || iters < 3));
+			if(pc)
+			{
+				perf_counters_stop(pc, counts);
+			}
+			if(ansibytes < 0)
+			{
+				fprintf(stderr, "v%u-%c: profiled encode failed\n", version, eccnames[ecc]);
+				if(pc)
+				{
+					perf_counters_close(pc);
+				}
+				return EXIT_FAILURE;
+			}
+
+			qrcode_profile profile;
+			qrcode_getProfile(&profile);
+			double stagens[QRCODE_STAGE_COUNT];
+			double total = 0;
+			for(idx = 0; idx < QRCODE_STAGE_COUNT; ++idx)
+			{
+				stagens[idx] = profile.ticks[idx] * tickns / iters;
+				total += stagens[idx];
+			}
+			double colns[NCOLUMNS];
+			for(idx = 0; idx < NCOLUMNS; ++idx)
+			{
+				if(columns[idx].stage != STAGE_PENALTY_ALL)
+				{
+					colns[idx] = stagens[columns[idx].stage];
+					continue;
+				}
+				size_t mask = 0;
+				for(colns[idx] = 0; mask < 8; ++mask)
+				{
+					colns[idx] += stagens[QRCODE_STAGE_PENALTY(mask)];
+				}
+			}
+
+			if(csv)
+			{
+				printf("%u,%c,%zu,%zu", version, eccnames[ecc], strlen(probe.payload), iters);
+				for(idx = 0; idx < NCOLUMNS; ++idx)
+				{
+					printf(",%.0f", colns[idx]);
+				}
+				for(idx = 0; idx < 8; ++idx)
+				{
+					printf(",%.0f", stagens[QRCODE_STAGE_PENALTY(idx)]);
+				}
+				printf(",%.0f,%d,%zu,%zu", total, ansibytes, stackbytes, heapbytes);
+			}
+			else
+			{
+				printf("%3u %3c %7zu", version, eccnames[ecc], strlen(probe.payload));
+				for(idx = 0; idx < NCOLUMNS; ++idx)
+				{
+					printf(" %9.2f", colns[idx] / 1e3);
+				}
+				printf(" %9.2f %9d %7zu %7zu", total / 1e3, ansibytes, stackbytes, heapbytes);
+			}
+			if(pc)
+			{
+				print_counters(pc, counts, iters, csv);
+			}
+			printf("\n");
+		}
+	}
+	if(pc)
+	{
+		perf_counters_close(pc);
+	}
+	return EXIT_SUCCESS;
+}
@@ -34,9 +34,11 @@
  */
 
 #include "qrcode.h"
+#include "../usdt.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #pragma mark - Error Correction Lookup tables
 
@@ -68,7 +70,6 @@ static const uint16_t NUM_RAW_DATA_MODULES[40] = {
        19723, 20891, 22091, 23008, 24272, 25568, 26896, 28256, 29648
 };
 
-// @TODO: Put other LOCK_VERSIONS here
 #elif LOCK_VERSION == 3
 
 static const int16_t NUM_ERROR_CORRECTION_CODEWORDS[4] = {
@@ -81,6 +82,30 @@ static const int8_t NUM_ERROR_CORRECTION_BLOCKS[4] = {
 
 static const uint16_t NUM_RAW_DATA_MODULES = 567;
 
+#elif LOCK_VERSION == 4
+
+static const int16_t NUM_ERROR_CORRECTION_CODEWORDS[4] = {
+    36, 20, 64, 52
+};
+
+static const int8_t NUM_ERROR_CORRECTION_BLOCKS[4] = {
+    2, 1, 4, 2
+};
+
+static const uint16_t NUM_RAW_DATA_MODULES = 807;
+
+#elif LOCK_VERSION == 5
+
+static const int16_t NUM_ERROR_CORRECTION_CODEWORDS[4] = {
+    48, 26, 88, 72
+};
+
+static const int8_t NUM_ERROR_CORRECTION_BLOCKS[4] = {
+    2, 1, 4, 4
+};
+
+static const uint16_t NUM_RAW_DATA_MODULES = 1079;
+
 #else
 
 #error Unsupported LOCK_VERSION (add it...)
@@ -88,6 +113,17 @@ static const uint16_t NUM_RAW_DATA_MODULES = 567;
 #endif
 
 
+// With a locked version the grid width is a compile-time constant, so every module offset,
+// loop bound and alignment position below folds to a constant and loops can be unrolled
+#if LOCK_VERSION == 0
+#define BB_WIDTH(bitGrid)   ((bitGrid)->bitOffsetOrWidth)
+#define QR_VERSION(version) (version)
+#else
+#define BB_WIDTH(bitGrid)   (LOCK_VERSION * 4 + 17)
+#define QR_VERSION(version) LOCK_VERSION
+#endif
+
+
 static int max(int a, int b) {
     if (a > b) { return a; }
     return b;
@@ -173,6 +209,8 @@ typedef struct BitBucket {
     uint32_t bitOffsetOrWidth;
     uint16_t capacityBytes;
     uint8_t *data;
+    uint64_t accum;       // Appended bits not yet stored to data (MSB first)
+    uint8_t accumBits;
 } BitBucket;
 
 /*
@@ -194,12 +232,13 @@ static uint16_t bb_getBufferSizeBytes(uint32_t bits) {
     return ((bits + 7) / 8);
 }
 
+// No clearing needed: bb_appendBits and bb_flushBits store whole bytes, never OR into them
 static void bb_initBuffer(BitBucket *bitBuffer, uint8_t *data, int32_t capacityBytes) {
     bitBuffer->bitOffsetOrWidth = 0;
     bitBuffer->capacityBytes = capacityBytes;
     bitBuffer->data = data;
-    
-    memset(data, 0, bitBuffer->capacityBytes);
+    bitBuffer->accum = 0;
+    bitBuffer->accumBits = 0;
 }
 
 static void bb_initGrid(BitBucket *bitGrid, uint8_t *data, uint8_t size) {
@@ -210,12 +249,46 @@ static void bb_initGrid(BitBucket *bitGrid, uint8_t *data, uint8_t size) {
     memset(data, 0, bitGrid->capacityBytes);
 }
 
+// Stores the top `bytes` bytes of word (big endian) at the given byte offset. Anything past
+// the end of the buffer is dropped; qrcode_initBytes rejects data that overflows.
+static void bb_storeWord(BitBucket *bitBuffer, uint32_t byteOffset, uint32_t word, uint8_t bytes) {
+    uint8_t *out = bitBuffer->data + byteOffset;
+    if (byteOffset + 4 <= bitBuffer->capacityBytes && bytes == 4) {
+        out[0] = word >> 24;
+        out[1] = word >> 16;
+        out[2] = word >> 8;
+        out[3] = word;
+        return;
+    }
+    for (uint8_t i = 0; i < bytes && byteOffset + i < bitBuffer->capacityBytes; i++) {
+        out[i] = word >> (24 - 8 * i);
+    }
+}
+
+// Appends up to 32 bits. Bits collect in a 64-bit accumulator and are stored a whole 32-bit
+// word at a time, so bb_flushBits must be called before the buffer contents are read.
 static void bb_appendBits(BitBucket *bitBuffer, uint32_t val, uint8_t length) {
-    uint32_t offset = bitBuffer->bitOffsetOrWidth;
-    for (int8_t i = length - 1; i >= 0; i--, offset++) {
-        bitBuffer->data[offset >> 3] |= ((val >> i) & 1) << (7 - (offset & 7));
+    if (length == 0) { return; }
+    
+    bitBuffer->accum = (bitBuffer->accum << length) | (val & (0xFFFFFFFF >> (32 - length)));
+    bitBuffer->accumBits += length;
+    bitBuffer->bitOffsetOrWidth += length;
+    
+    if (bitBuffer->accumBits >= 32) {
+        bitBuffer->accumBits -= 32;
+        uint32_t stored = bitBuffer->bitOffsetOrWidth - bitBuffer->accumBits - 32;
+        bb_storeWord(bitBuffer, stored >> 3, (uint32_t)(bitBuffer->accum >> bitBuffer->accumBits), 4);
     }
-    bitBuffer->bitOffsetOrWidth = offset;
+}
+
+// Stores whatever is left in the accumulator, zero-padded to a whole byte.
+static void bb_flushBits(BitBucket *bitBuffer) {
+    uint8_t pending = bitBuffer->accumBits;
+    if (pending == 0) { return; }
+    
+    uint32_t stored = bitBuffer->bitOffsetOrWidth - pending;
+    bb_storeWord(bitBuffer, stored >> 3, (uint32_t)(bitBuffer->accum << (32 - pending)), (pending + 7) / 8);
+    bitBuffer->accumBits = 0;
 }
 /*
 void bb_setBits(BitBucket *bitBuffer, uint32_t val, int offset, uint8_t length) {
@@ -225,7 +298,7 @@ void bb_setBits(BitBucket *bitBuffer, uint32_t val, int offset, uint8_t length)
 }
 */
 static void bb_setBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool on) {
-    uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
+    uint32_t offset = y * BB_WIDTH(bitGrid) + x;
     uint8_t mask = 1 << (7 - (offset & 0x07));
     if (on) {
         bitGrid->data[offset >> 3] |= mask;
@@ -235,7 +308,7 @@ static void bb_setBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool on) {
 }
 
 static void bb_invertBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool invert) {
-    uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
+    uint32_t offset = y * BB_WIDTH(bitGrid) + x;
     uint8_t mask = 1 << (7 - (offset & 0x07));
     bool on = ((bitGrid->data[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0);
     if (on ^ invert) {
@@ -246,7 +319,7 @@ static void bb_invertBit(BitBucket *bitGrid, uint8_t x, uint8_t y, bool invert)
 }
 
 static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y) {
-    uint32_t offset = y * bitGrid->bitOffsetOrWidth + x;
+    uint32_t offset = y * BB_WIDTH(bitGrid) + x;
     return (bitGrid->data[offset >> 3] & (1 << (7 - (offset & 0x07)))) != 0;
 }
 
@@ -258,7 +331,7 @@ static bool bb_getBit(BitBucket *bitGrid, uint8_t x, uint8_t y) {
 // This means it is possible to apply a mask, undo it, and try another mask. Note that a final
 // well-formed QR Code symbol needs exactly one mask applied (not zero, not two, etc.).
 static void applyMask(BitBucket *modules, BitBucket *isFunction, uint8_t mask) {
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = BB_WIDTH(modules);
     
     for (uint8_t y = 0; y < size; y++) {
         for (uint8_t x = 0; x < size; x++) {
@@ -287,7 +360,7 @@ static void setFunctionModule(BitBucket *modules, BitBucket *isFunction, uint8_t
 
 // Draws a 9*9 finder pattern including the border separator, with the center module at (x, y).
 static void drawFinderPattern(BitBucket *modules, BitBucket *isFunction, uint8_t x, uint8_t y) {
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = BB_WIDTH(modules);
 
     for (int8_t i = -4; i <= 4; i++) {
         for (int8_t j = -4; j <= 4; j++) {
@@ -313,7 +386,7 @@ static void drawAlignmentPattern(BitBucket *modules, BitBucket *isFunction, uint
 // based on the given mask and this object's error correction level field.
 static void drawFormatBits(BitBucket *modules, BitBucket *isFunction, uint8_t ecc, uint8_t mask) {
     
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = BB_WIDTH(modules);
 
     // Calculate error correction code and pack bits
     uint32_t data = ecc << 3 | mask;  // errCorrLvl is uint2, mask is uint3
@@ -355,12 +428,12 @@ static void drawFormatBits(BitBucket *modules, BitBucket *isFunction, uint8_t ec
 // based on this object's version field (which only has an effect for 7 <= version <= 40).
 static void drawVersion(BitBucket *modules, BitBucket *isFunction, uint8_t version) {
     
-    int8_t size = modules->bitOffsetOrWidth;
-
 #if LOCK_VERSION != 0 && LOCK_VERSION < 7
     return;
     
 #else
+    int8_t size = BB_WIDTH(modules);
+
     if (version < 7) { return; }
     
     // Calculate error correction code and pack bits
@@ -384,7 +457,8 @@ static void drawVersion(BitBucket *modules, BitBucket *isFunction, uint8_t versi
 
 static void drawFunctionPatterns(BitBucket *modules, BitBucket *isFunction, uint8_t version, uint8_t ecc) {
     
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = BB_WIDTH(modules);
+    version = QR_VERSION(version);
 
     // Draw the horizontal and vertical timing patterns
     for (uint8_t i = 0; i < size; i++) {
@@ -412,7 +486,7 @@ static void drawFunctionPatterns(BitBucket *modules, BitBucket *isFunction, uint
         }
         
         uint8_t alignPositionIndex = alignCount - 1;
-        uint8_t alignPosition[alignCount];
+        uint8_t alignPosition[40 / 7 + 2];
         
         alignPosition[0] = 6;
         
@@ -440,17 +514,42 @@ static void drawFunctionPatterns(BitBucket *modules, BitBucket *isFunction, uint
 }
 
 
-// Draws the given sequence of 8-bit codewords (data and error correction) onto the entire
-// data area of this QR Code symbol. Function modules need to be marked off before this is called.
-static void drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *codewords) {
-    
-    uint32_t bitLength = codewords->bitOffsetOrWidth;
-    uint8_t *data = codewords->data;
-    
-    uint8_t size = modules->bitOffsetOrWidth;
+#pragma mark - Codeword Placement
+
+// The codeword bits always land on the same modules for a given version: the zigzag scan
+// skipping function modules. We walk it once per version and keep a table mapping each
+// codeword bit index to its module offset (y * size + x) in the grid. The tables live in
+// one static pool (zero pages until a version is first used), so there is nothing to
+// allocate, fail or free.
+#if LOCK_VERSION == 0
+
+static const uint32_t PLACEMENT_OFFSETS[40] = {
+    // Running total of NUM_RAW_DATA_MODULES before each version
+         0,    208,    567,   1134,   1941,   3020,   4403,   5971,   7907,  10243,
+     13011,  16243,  19971,  24227,  28878,  34121,  39988,  46511,  53722,  61653,
+     70336,  79588,  89656, 100572, 112368, 125076, 138728, 153356, 168727, 185138,
+    202621, 221208, 240931, 261822, 283913, 306921, 331193, 356761, 383657, 411913
+};
+
+static uint16_t placementPool[441561];
+static uint8_t placementState[40];
+
+#else
+
+static uint16_t placementPool[(LOCK_VERSION * 4 + 17) * (LOCK_VERSION * 4 + 17)];
+static uint8_t placementState[1];
+
+#endif
+
+#define PLACEMENT_EMPTY     0
+#define PLACEMENT_BUILDING  1
+#define PLACEMENT_READY     2
+
+static void buildPlacementTable(uint16_t *table, BitBucket *isFunction) {
+    uint8_t size = BB_WIDTH(isFunction);
     
     // Bit index into the data
-    uint32_t i = 0;
+    uint16_t i = 0;
     
     // Do the funny zigzag scan
     for (int16_t right = size - 1; right >= 1; right -= 2) {  // Index of right column in each column pair
@@ -461,17 +560,57 @@ static void drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *
                 uint8_t x = right - j;  // Actual x coordinate
                 bool upwards = ((right & 2) == 0) ^ (x < 6);
                 uint8_t y = upwards ? size - 1 - vert : vert;  // Actual y coordinate
-                if (!bb_getBit(isFunction, x, y) && i < bitLength) {
-                    bb_setBit(modules, x, y, ((data[i >> 3] >> (7 - (i & 7))) & 1) != 0);
-                    i++;
+                if (!bb_getBit(isFunction, x, y)) {
+                    table[i++] = y * size + x;
                 }
-                // If there are any remainder bits (0 to 7), they are already
-                // set to 0/false/white when the grid of modules was initialized
             }
         }
     }
 }
 
+// Returns the placement table for this version, building it from the (already drawn) function
+// module grid on first use. The first thread to claim a version builds it; any other thread
+// encoding that version meanwhile waits the few microseconds until it is ready.
+static const uint16_t *getPlacementTable(uint8_t version, BitBucket *isFunction) {
+#if LOCK_VERSION == 0
+    uint16_t *table = placementPool + PLACEMENT_OFFSETS[version - 1];
+    uint8_t *state = &placementState[version - 1];
+#else
+    (void)version;
+    uint16_t *table = placementPool;
+    uint8_t *state = &placementState[0];
+#endif
+    
+    uint8_t current = __atomic_load_n(state, __ATOMIC_ACQUIRE);
+    if (current == PLACEMENT_READY) { return table; }
+    
+    if (current == PLACEMENT_EMPTY &&
+            __atomic_compare_exchange_n(state, &current, PLACEMENT_BUILDING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        buildPlacementTable(table, isFunction);
+        __atomic_store_n(state, PLACEMENT_READY, __ATOMIC_RELEASE);
+        return table;
+    }
+    
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != PLACEMENT_READY) { }
+    return table;
+}
+
+// Draws the given sequence of 8-bit codewords (data and error correction) onto the entire
+// data area of this QR Code symbol by scattering each bit through the placement table.
+// Data modules must still be 0 (they are, after bb_initGrid and drawFunctionPatterns).
+static void drawCodewords(BitBucket *modules, const uint16_t *placement, BitBucket *codewords) {
+    
+    uint32_t bitLength = codewords->bitOffsetOrWidth;
+    uint8_t *data = codewords->data;
+    uint8_t *grid = modules->data;
+    
+    // If there are any remainder bits (0 to 7), they are 0 in the codeword buffer
+    for (uint32_t i = 0; i < bitLength; i++) {
+        uint16_t offset = placement[i];
+        grid[offset >> 3] |= ((data[i >> 3] >> (7 - (i & 7))) & 1) << (7 - (offset & 7));
+    }
+}
+
 
 
 #pragma mark - Penalty Calculation
@@ -487,7 +626,7 @@ static void drawCodewords(BitBucket *modules, BitBucket *isFunction, BitBucket *
 static uint32_t getPenaltyScore(BitBucket *modules) {
     uint32_t result = 0;
     
-    uint8_t size = modules->bitOffsetOrWidth;
+    uint8_t size = BB_WIDTH(modules);
     
     // Adjacent modules in row having same color
     for (uint8_t y = 0; y < size; y++) {
@@ -680,8 +819,14 @@ static int8_t encodeDataCodewords(BitBucket *dataCodewords, const uint8_t *text,
     } else {
         bb_appendBits(dataCodewords, 1 << MODE_BYTE, 4);
         bb_appendBits(dataCodewords, length, getModeBits(version, MODE_BYTE));
-        for (uint16_t i = 0; i < length; i++) {
-            bb_appendBits(dataCodewords, (char)(text[i]), 8);
+        uint16_t i = 0;
+        for (; i + 4 <= length; i += 4) {
+            uint32_t word = ((uint32_t)text[i] << 24) | ((uint32_t)text[i + 1] << 16) |
+                            ((uint32_t)text[i + 2] << 8) | text[i + 3];
+            bb_appendBits(dataCodewords, word, 32);
+        }
+        for (; i < length; i++) {
+            bb_appendBits(dataCodewords, text[i], 8);
         }
     }
     
@@ -690,7 +835,7 @@ static int8_t encodeDataCodewords(BitBucket *dataCodewords, const uint8_t *text,
     return mode;
 }
 
-static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data) {
+static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data, qrcode_workspace *workspace) {
     
     // See: http://www.thonky.com/qr-code-tutorial/structure-final-message
     
@@ -705,16 +850,24 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
 #endif
     
     uint8_t blockEccLen = totalEcc / numBlocks;
+#if LOCK_VERSION == 0 || LOCK_VERSION >= 5
     uint8_t numShortBlocks = numBlocks - moduleCount / 8 % numBlocks;
+#endif
     uint8_t shortBlockLen = moduleCount / 8 / numBlocks;
     
     uint8_t shortDataBlockLen = shortBlockLen - blockEccLen;
     
-    uint8_t result[data->capacityBytes];
-    memset(result, 0, sizeof(result));
+    // Data bytes are all overwritten below; only the ecc bytes (accumulated into by
+    // rs_getRemainder) and the remainder byte need clearing
+    uint8_t *result = workspace->interleaved;
+    uint16_t dataLen = moduleCount / 8 - totalEcc;
+    memset(&result[dataLen], 0, data->capacityBytes - dataLen);
     
-    uint8_t coeff[blockEccLen];
-    rs_init(blockEccLen, coeff);
+    uint8_t *coeff = workspace->coeff;
+    if (workspace->coeffDegree != blockEccLen) {
+        rs_init(blockEccLen, coeff);
+        workspace->coeffDegree = blockEccLen;
+    }
     
     uint16_t offset = 0;
     uint8_t *dataBytes = data->data;
@@ -760,7 +913,10 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
         dataBytes += blockSize;
     }
     
-    memcpy(data->data, result, data->capacityBytes);
+    // Swap the buffers instead of copying the interleaved result back
+    workspace->interleaved = data->data;
+    workspace->codewords = result;
+    data->data = result;
     data->bitOffsetOrWidth = moduleCount;
 }
 
@@ -769,14 +925,123 @@ static void performErrorCorrection(uint8_t version, uint8_t ecc, BitBucket *data
 static const uint8_t ECC_FORMAT_BITS = (0x02 << 6) | (0x03 << 4) | (0x00 << 2) | (0x01 << 0);
 
 
+#pragma mark - Stage profiler
+
+// One set of totals per thread, shared by the generic and the version locked encoders
+#if LOCK_VERSION == 0
+__thread qrcode_profile qrcode_threadProfile;
+#else
+extern __thread qrcode_profile qrcode_threadProfile;
+#endif
+
+#if LOCK_VERSION == 0
+
+uint64_t qrcode_profileNow(void) {
+#if defined(QRCODE_PROFILE_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+uint64_t qrcode_profileTicksPerSecond(void) {
+#if defined(QRCODE_PROFILE_RDTSC) && (defined(__x86_64__) || defined(__i386__))
+    // Measured once against the monotonic clock over 20ms
+    static uint64_t tscRate = 0;
+    uint64_t rate = __atomic_load_n(&tscRate, __ATOMIC_RELAXED);
+    if (rate) { return rate; }
+    
+    struct timespec start, now, pause = {0, 20000000};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t tscStart = __builtin_ia32_rdtsc();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t tscEnd = __builtin_ia32_rdtsc();
+    
+    uint64_t ns = (now.tv_sec - start.tv_sec) * 1000000000ull + now.tv_nsec - start.tv_nsec;
+    rate = ns ? (tscEnd - tscStart) * 1000000000ull / ns : 1;
+    __atomic_store_n(&tscRate, rate, __ATOMIC_RELAXED);
+    return rate;
+#else
+    return 1000000000ull;
+#endif
+}
+
+void qrcode_profileAdd(uint8_t stage, uint64_t ticks) {
+#ifdef QRCODE_PROFILE
+    if (stage >= QRCODE_STAGE_COUNT) { return; }
+    qrcode_threadProfile.ticks[stage] += ticks;
+    qrcode_threadProfile.calls[stage]++;
+#else
+    (void)stage;
+    (void)ticks;
+#endif
+}
+
+void qrcode_getProfile(qrcode_profile *profile) {
+    *profile = qrcode_threadProfile;
+}
+
+void qrcode_resetProfile(void) {
+    memset(&qrcode_threadProfile, 0, sizeof(qrcode_profile));
+}
+
+#endif
+
+// PROFILE_LAP charges the time since the last lap to a stage
+#ifdef QRCODE_PROFILE
+#define PROFILE_START(lap)          uint64_t lap = qrcode_profileNow()
+#define PROFILE_LAP(stage, lap)     do { \
+        uint64_t now = qrcode_profileNow(); \
+        qrcode_threadProfile.ticks[stage] += now - (lap); \
+        qrcode_threadProfile.calls[stage]++; \
+        (lap) = now; \
+    } while (0)
+#else
+#define PROFILE_START(lap)          do { } while (0)
+#define PROFILE_LAP(stage, lap)     do { } while (0)
+#endif
+
+
 #pragma mark - Public QRCode functions
 
 uint16_t qrcode_getBufferSize(uint8_t version) {
     return bb_getGridSizeBytes(4 * version + 17);
 }
 
-// @TODO: Return error if data is too big.
-int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length) {
+static uint16_t getCodewordBufferSize(uint8_t version) {
+#if LOCK_VERSION == 0
+    return bb_getBufferSizeBytes(NUM_RAW_DATA_MODULES[version - 1]);
+#else
+    return bb_getBufferSizeBytes(NUM_RAW_DATA_MODULES);
+#endif
+}
+
+uint16_t qrcode_getWorkspaceSize(uint8_t maxVersion) {
+    return 2 * getCodewordBufferSize(maxVersion) + qrcode_getBufferSize(maxVersion);
+}
+
+void qrcode_initWorkspace(qrcode_workspace *workspace, uint8_t *buffer, uint8_t maxVersion) {
+    uint16_t codewordBytes = getCodewordBufferSize(maxVersion);
+    
+    workspace->maxVersion = maxVersion;
+    workspace->functionVersion = 0;
+    workspace->coeffDegree = 0;
+    workspace->codewords = buffer;
+    workspace->interleaved = buffer + codewordBytes;
+    workspace->isFunction = buffer + 2 * codewordBytes;
+}
+
+int8_t qrcode_initBytesWorkspace(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace) {
+#if LOCK_VERSION != 0
+    version = LOCK_VERSION;
+#endif
+    if (version < 1 || version > workspace->maxVersion) { return -1; }
+    MUTOTP_PROBE3(qrcode_encode_entry, version, ecc, length);
+    PROFILE_START(lap);
+    
     uint8_t size = version * 4 + 17;
     qrcode->version = version;
     qrcode->size = size;
@@ -789,21 +1054,29 @@ int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8
     uint16_t moduleCount = NUM_RAW_DATA_MODULES[version - 1];
     uint16_t dataCapacity = moduleCount / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits][version - 1];
 #else
-    version = LOCK_VERSION;
     uint16_t moduleCount = NUM_RAW_DATA_MODULES;
     uint16_t dataCapacity = moduleCount / 8 - NUM_ERROR_CORRECTION_CODEWORDS[eccFormatBits];
 #endif
     
     struct BitBucket codewords;
-    uint8_t codewordBytes[bb_getBufferSizeBytes(moduleCount)];
-    bb_initBuffer(&codewords, codewordBytes, (int32_t)sizeof(codewordBytes));
+    bb_initBuffer(&codewords, workspace->codewords, bb_getBufferSizeBytes(moduleCount));
     
     // Place the data code words into the buffer
     int8_t mode = encodeDataCodewords(&codewords, data, length, version);
+    MUTOTP_PROBE3(qrcode_data_encoded, version, mode, codewords.bitOffsetOrWidth);
     
-    if (mode < 0) { return -1; }
+    if (mode < 0) {
+        MUTOTP_PROBE3(qrcode_encode_return, -1, version, 0);
+        return -1;
+    }
     qrcode->mode = mode;
     
+    // The data does not fit in this version and error correction level
+    if (codewords.bitOffsetOrWidth > dataCapacity * 8) {
+        MUTOTP_PROBE3(qrcode_encode_return, -1, version, 0);
+        return -1;
+    }
+    
     // Add terminator and pad up to a byte if applicable
     uint32_t padding = (dataCapacity * 8) - codewords.bitOffsetOrWidth;
     if (padding > 4) { padding = 4; }
@@ -814,18 +1087,37 @@ int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8
     for (uint8_t padByte = 0xEC; codewords.bitOffsetOrWidth < (dataCapacity * 8); padByte ^= 0xEC ^ 0x11) {
         bb_appendBits(&codewords, padByte, 8);
     }
+    bb_flushBits(&codewords);
+    PROFILE_LAP(QRCODE_STAGE_ENCODE, lap);
 
     BitBucket modulesGrid;
     bb_initGrid(&modulesGrid, modules, size);
     
+    // Function modules only depend on the version, so redrawing them over the grid left
+    // by the previous encode sets the same bits and the grid need not be cleared
     BitBucket isFunctionGrid;
-    uint8_t isFunctionGridBytes[bb_getGridSizeBytes(size)];
-    bb_initGrid(&isFunctionGrid, isFunctionGridBytes, size);
+    if (workspace->functionVersion == version) {
+        isFunctionGrid.bitOffsetOrWidth = size;
+        isFunctionGrid.capacityBytes = bb_getGridSizeBytes(size);
+        isFunctionGrid.data = workspace->isFunction;
+    } else {
+        bb_initGrid(&isFunctionGrid, workspace->isFunction, size);
+        workspace->functionVersion = version;
+    }
     
     // Draw function patterns, draw all codewords, do masking
     drawFunctionPatterns(&modulesGrid, &isFunctionGrid, version, eccFormatBits);
-    performErrorCorrection(version, eccFormatBits, &codewords);
-    drawCodewords(&modulesGrid, &isFunctionGrid, &codewords);
+    
+    const uint16_t *placement = getPlacementTable(version, &isFunctionGrid);
+    MUTOTP_PROBE1(qrcode_patterns_drawn, version);
+    PROFILE_LAP(QRCODE_STAGE_PATTERNS, lap);
+    
+    performErrorCorrection(version, eccFormatBits, &codewords, workspace);
+    MUTOTP_PROBE2(qrcode_ecc_done, version, codewords.bitOffsetOrWidth);
+    PROFILE_LAP(QRCODE_STAGE_ECC, lap);
+    drawCodewords(&modulesGrid, placement, &codewords);
+    MUTOTP_PROBE1(qrcode_codewords_placed, version);
+    PROFILE_LAP(QRCODE_STAGE_PLACE, lap);
     
     // Find the best (lowest penalty) mask
     uint8_t mask = 0;
@@ -833,7 +1125,9 @@ int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8
     for (uint8_t i = 0; i < 8; i++) {
         drawFormatBits(&modulesGrid, &isFunctionGrid, eccFormatBits, i);
         applyMask(&modulesGrid, &isFunctionGrid, i);
+        PROFILE_LAP(QRCODE_STAGE_MASK, lap);
         int penalty = getPenaltyScore(&modulesGrid);
+        PROFILE_LAP(QRCODE_STAGE_PENALTY(i), lap);
         if (penalty < minPenalty) {
             mask = i;
             minPenalty = penalty;
@@ -848,10 +1142,41 @@ int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8
     
     // Apply the final choice of mask
     applyMask(&modulesGrid, &isFunctionGrid, mask);
+    PROFILE_LAP(QRCODE_STAGE_MASK, lap);
 
+    MUTOTP_PROBE3(qrcode_encode_return, 0, version, mask);
     return 0;
 }
 
+int8_t qrcode_initTextWorkspace(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data, qrcode_workspace *workspace) {
+    return qrcode_initBytesWorkspace(qrcode, modules, version, ecc, (uint8_t*)data, strlen(data), workspace);
+}
+
+// Without a workspace, each thread uses its own, sized for the largest version, instead of
+// putting up to 11 KB on the stack. It is set up on the thread's first encode and keeps its
+// caches between encodes like any other workspace.
+#if LOCK_VERSION == 0
+#define THREAD_WORKSPACE_VERSION    40
+#else
+#define THREAD_WORKSPACE_VERSION    LOCK_VERSION
+#endif
+
+static __thread uint8_t threadWorkspaceBytes[QRCODE_WORKSPACE_SIZE(THREAD_WORKSPACE_VERSION)];
+static __thread qrcode_workspace threadWorkspace;
+
+int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length) {
+#if LOCK_VERSION != 0
+    version = LOCK_VERSION;
+#endif
+    if (version < 1 || version > 40) { return -1; }
+    
+    if (!threadWorkspace.maxVersion) {
+        qrcode_initWorkspace(&threadWorkspace, threadWorkspaceBytes, THREAD_WORKSPACE_VERSION);
+    }
+    
+    return qrcode_initBytesWorkspace(qrcode, modules, version, ecc, data, length, &threadWorkspace);
+}
+
 int8_t qrcode_initText(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data) {
     return qrcode_initBytes(qrcode, modules, version, ecc, (uint8_t*)data, strlen(data));
 }
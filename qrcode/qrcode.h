@@ -65,6 +65,22 @@ static const bool true = 1;
 #define LOCK_VERSION       0
 #endif
 
+// A locked build suffixes its public functions with the version (qrcode_initBytes_v4, ...)
+// so it can be linked next to the generic build; see qrcode_dispatch.h
+#if LOCK_VERSION != 0
+#define QRCODE_LOCKED_NAME_(name, version)  name##_v##version
+#define QRCODE_LOCKED_NAME(name, version)   QRCODE_LOCKED_NAME_(name, version)
+
+#define qrcode_getBufferSize        QRCODE_LOCKED_NAME(qrcode_getBufferSize, LOCK_VERSION)
+#define qrcode_initText             QRCODE_LOCKED_NAME(qrcode_initText, LOCK_VERSION)
+#define qrcode_initBytes            QRCODE_LOCKED_NAME(qrcode_initBytes, LOCK_VERSION)
+#define qrcode_getModule            QRCODE_LOCKED_NAME(qrcode_getModule, LOCK_VERSION)
+#define qrcode_getWorkspaceSize     QRCODE_LOCKED_NAME(qrcode_getWorkspaceSize, LOCK_VERSION)
+#define qrcode_initWorkspace        QRCODE_LOCKED_NAME(qrcode_initWorkspace, LOCK_VERSION)
+#define qrcode_initTextWorkspace    QRCODE_LOCKED_NAME(qrcode_initTextWorkspace, LOCK_VERSION)
+#define qrcode_initBytesWorkspace   QRCODE_LOCKED_NAME(qrcode_initBytesWorkspace, LOCK_VERSION)
+#endif
+
 
 typedef struct QRCode {
     uint8_t version;
@@ -75,6 +91,39 @@ typedef struct QRCode {
     uint8_t *modules;
 } QRCode;
 
+// Scratch memory for the encoder, sized once for a maximum version and reused across
+// encodes (one per thread). Keeps the encoder off the stack and lets it skip redrawing
+// and clearing state that is unchanged from the previous encode.
+typedef struct qrcode_workspace {
+    uint8_t maxVersion;
+    uint8_t functionVersion;    // Version whose function module grid is in isFunction (0 if none)
+    uint8_t coeffDegree;        // Degree of the Reed-Solomon divisor in coeff (0 if none)
+    uint8_t coeff[30];
+    uint8_t *codewords;
+    uint8_t *interleaved;
+    uint8_t *isFunction;
+} qrcode_workspace;
+
+// Upper bound of qrcode_getWorkspaceSize(version), usable for static buffers
+#define QRCODE_WORKSPACE_SIZE(version)  (3 * ((((4 * (version) + 17) * (4 * (version) + 17)) + 7) / 8))
+
+
+// Stages timed by the profiler (build with -DQRCODE_PROFILE, and also
+// -DQRCODE_PROFILE_RDTSC to count TSC cycles instead of nanoseconds)
+#define QRCODE_STAGE_ENCODE         0   // encodeDataCodewords, terminator and padding
+#define QRCODE_STAGE_PATTERNS       1   // drawFunctionPatterns and the placement table
+#define QRCODE_STAGE_ECC            2   // performErrorCorrection
+#define QRCODE_STAGE_PLACE          3   // drawCodewords
+#define QRCODE_STAGE_PENALTY(mask)  (4 + (mask))    // getPenaltyScore for each of the 8 masks
+#define QRCODE_STAGE_MASK           12  // Drawing format bits and applying masks
+#define QRCODE_STAGE_RENDER         13  // Rendering, recorded by the caller
+#define QRCODE_STAGE_COUNT          14
+
+typedef struct qrcode_profile {
+    uint64_t ticks[QRCODE_STAGE_COUNT];
+    uint64_t calls[QRCODE_STAGE_COUNT];
+} qrcode_profile;
+
 
 #ifdef __cplusplus
 extern "C"{
@@ -84,11 +133,31 @@ extern "C"{
 
 uint16_t qrcode_getBufferSize(uint8_t version);
 
+// Encode with a workspace kept per thread (about 11 KB of thread-local storage per thread
+// that encodes); the Workspace variants below take the caller's instead
 int8_t qrcode_initText(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data);
 int8_t qrcode_initBytes(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length);
 
 bool qrcode_getModule(QRCode *qrcode, uint8_t x, uint8_t y);
 
+uint16_t qrcode_getWorkspaceSize(uint8_t maxVersion);
+void qrcode_initWorkspace(qrcode_workspace *workspace, uint8_t *buffer, uint8_t maxVersion);
+
+int8_t qrcode_initTextWorkspace(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data, qrcode_workspace *workspace);
+int8_t qrcode_initBytesWorkspace(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace);
+
+// Per-thread stage totals since the thread started or last reset; all zero
+// unless built with QRCODE_PROFILE
+void qrcode_getProfile(qrcode_profile *profile);
+void qrcode_resetProfile(void);
+
+// Profiler clock, and how many of its ticks make a second
+uint64_t qrcode_profileNow(void);
+uint64_t qrcode_profileTicksPerSecond(void);
+
+// Adds a stage timed outside the encoder (QRCODE_STAGE_RENDER) to the totals
+void qrcode_profileAdd(uint8_t stage, uint64_t ticks);
+
 
 
 #ifdef __cplusplus
@@ -0,0 +1,22 @@
+/**
+ * Dispatch between the generic QR code encoder and the LOCK_VERSION builds of it.
+ * See qrcode_dispatch.h.
+ */
+
+#include "qrcode_dispatch.h"
+
+#include <string.h>
+
+int8_t qrcode_initBytesDispatch(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace) {
+    if (version > workspace->maxVersion) { return -1; }
+    
+    switch (version) {
+        case 4:  return qrcode_initBytesWorkspace_v4(qrcode, modules, version, ecc, data, length, workspace);
+        case 5:  return qrcode_initBytesWorkspace_v5(qrcode, modules, version, ecc, data, length, workspace);
+        default: return qrcode_initBytesWorkspace(qrcode, modules, version, ecc, data, length, workspace);
+    }
+}
+
+int8_t qrcode_initTextDispatch(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data, qrcode_workspace *workspace) {
+    return qrcode_initBytesDispatch(qrcode, modules, version, ecc, (uint8_t*)data, strlen(data), workspace);
+}
@@ -0,0 +1,39 @@
+/**
+ * Dispatch between the generic QR code encoder and the LOCK_VERSION builds of it.
+ *
+ * The Makefile compiles qrcode.c once more for each locked version (4 and 5) with
+ * -DLOCK_VERSION=<n>. In those objects the version is a compile-time constant, so block
+ * counts, sizes, alignment positions and loop bounds fold and the codeword tables shrink to
+ * a single entry. qrcode_initBytesDispatch sends an encode to the locked build when the
+ * version matches and to the generic one otherwise.
+ *
+ * Workspaces are interchangeable: a workspace made with qrcode_initWorkspace can be passed
+ * to any build, as long as it was sized for at least the version being encoded.
+ */
+
+#ifndef __QRCODE_DISPATCH_H_
+#define __QRCODE_DISPATCH_H_
+
+#include "qrcode.h"
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif  /* __cplusplus */
+
+
+
+int8_t qrcode_initBytesWorkspace_v4(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace);
+int8_t qrcode_initBytesWorkspace_v5(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace);
+
+int8_t qrcode_initTextDispatch(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, const char *data, qrcode_workspace *workspace);
+int8_t qrcode_initBytesDispatch(QRCode *qrcode, uint8_t *modules, uint8_t version, uint8_t ecc, uint8_t *data, uint16_t length, qrcode_workspace *workspace);
+
+
+
+#ifdef __cplusplus
+}
+#endif  /* __cplusplus */
+
+
+#endif  /* __QRCODE_DISPATCH_H_ */
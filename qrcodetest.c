@@ -0,0 +1,241 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "qrcode/qrcode.h"
+#include "qrcode/qrcode_dispatch.h"
+
+#define MAX_GRID_BYTES QRCODE_WORKSPACE_SIZE(40)
+
+//One payload per encoding mode, and one in byte mode that only the larger
+//versions can hold
+static const char* payloads[] = {
+	"31415926535897932384",
+	"HELLO WORLD $%*+-./:",
+	"otpauth://totp/Example:alice@example.com?secret=JBSWY3DPEHPK3PXP&issuer=Example",
+	"otpauth://totp/Example:alice@example.com?secret=JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP"
+		"&issuer=Example&algorithm=SHA1&digits=6&period=30&image=https://example.com/"
+		"a-rather-long-avatar-url-for-alice.png",
+};
+#define PAYLOAD_COUNT (sizeof(payloads) / sizeof(payloads[0]))
+
+static int same_code(const QRCode* expected, const uint8_t* expectedmodules,
+		const QRCode* qrcode, const uint8_t* modules)
+{
+	return expected->version == qrcode->version && expected->size == qrcode->size &&
+		expected->mode == qrcode->mode && expected->mask == qrcode->mask &&
+		!memcmp(expectedmodules, modules, qrcode_getBufferSize(expected->version));
+}
+
+int check_paths()
+{
+	//Every way into the encoder agrees with qrcode_initBytes, both on which
+	//payloads fit and on the modules of the ones that do
+	static uint8_t expectedmodules[MAX_GRID_BYTES], modules[MAX_GRID_BYTES];
+	static uint8_t shared[MAX_GRID_BYTES], exact[MAX_GRID_BYTES];
+	qrcode_workspace sharedworkspace, exactworkspace;
+	qrcode_initWorkspace(&sharedworkspace, shared, 40);
+	int result = 0, encoded = 0;
+	uint8_t version = 1, ecc;
+	size_t idx;
+	for(; version <= 40; ++version)
+	{
+		for(ecc = ECC_LOW; ecc <= ECC_HIGH; ++ecc)
+		{
+			for(idx = 0; idx < PAYLOAD_COUNT; ++idx)
+			{
+				uint8_t* data = (uint8_t*) payloads[idx];
+				uint16_t length = strlen(payloads[idx]);
+				QRCode expected, qrcode;
+				int8_t fits = qrcode_initBytes(&expected, expectedmodules, version, ecc, data, length);
+				encoded += fits == 0;
+
+				//A fresh workspace sized for just this version
+				qrcode_initWorkspace(&exactworkspace, exact, version);
+				memset(modules, 0xa5, sizeof(modules));
+				result |= qrcode_initBytesWorkspace(&qrcode, modules, version, ecc, data, length,
+									&exactworkspace) != fits;
+				result |= !fits && !same_code(&expected, expectedmodules, &qrcode, modules);
+
+				memset(modules, 0xa5, sizeof(modules));
+				result |= qrcode_initBytesDispatch(&qrcode, modules, version, ecc, data, length,
+									&sharedworkspace) != fits;
+				result |= !fits && !same_code(&expected, expectedmodules, &qrcode, modules);
+
+				if(version == 4 || version == 5)
+				{
+					memset(modules, 0xa5, sizeof(modules));
+					int8_t locked = version == 4 ?
+						qrcode_initBytesWorkspace_v4(&qrcode, modules, version, ecc, data, length,
+										&sharedworkspace) :
+						qrcode_initBytesWorkspace_v5(&qrcode, modules, version, ecc, data, length,
+										&sharedworkspace);
+					result |= locked != fits;
+					result |= !fits && !same_code(&expected, expectedmodules, &qrcode, modules);
+				}
+			}
+		}
+	}
+
+	//Every payload fits somewhere, and none fits everywhere
+	return result || encoded <= 40 * 4 || encoded >= 40 * 4 * (int) PAYLOAD_COUNT ? -1 : 0;
+}
+
+int check_too_long()
+{
+	//More than version 40 holds at the lowest error correction
+	static uint8_t data[3000], modules[MAX_GRID_BYTES], buffer[MAX_GRID_BYTES];
+	memset(data, 'a', sizeof(data));
+	qrcode_workspace workspace;
+	qrcode_initWorkspace(&workspace, buffer, 40);
+	int result = 0;
+	uint8_t version = 1, ecc;
+	for(; version <= 40; ++version)
+	{
+		for(ecc = ECC_LOW; ecc <= ECC_HIGH; ++ecc)
+		{
+			QRCode qrcode;
+			result |= qrcode_initBytes(&qrcode, modules, version, ecc, data, sizeof(data)) != -1;
+			result |= qrcode_initBytesWorkspace(&qrcode, modules, version, ecc, data, sizeof(data),
+								&workspace) != -1;
+			result |= qrcode_initBytesDispatch(&qrcode, modules, version, ecc, data, sizeof(data),
+								&workspace) != -1;
+		}
+	}
+	for(ecc = ECC_LOW; ecc <= ECC_HIGH; ++ecc)
+	{
+		QRCode qrcode;
+		result |= qrcode_initBytesWorkspace_v4(&qrcode, modules, 4, ecc, data, sizeof(data),
+							&workspace) != -1;
+		result |= qrcode_initBytesWorkspace_v5(&qrcode, modules, 5, ecc, data, sizeof(data),
+							&workspace) != -1;
+	}
+
+	//As is a version the workspace was not sized for
+	qrcode_initWorkspace(&workspace, buffer, 3);
+	QRCode qrcode;
+	result |= qrcode_initBytesWorkspace(&qrcode, modules, 4, ECC_LOW, data, 1, &workspace) != -1;
+	result |= qrcode_initBytesDispatch(&qrcode, modules, 4, ECC_LOW, data, 1, &workspace) != -1;
+	return result ? -1 : 0;
+}
+
+int check_reuse()
+{
+	//A workspace moved between versions and error correction levels keeps no
+	//stale function grid or divisor from the previous encode
+	static const uint8_t versions[] = {40, 1, 5, 4, 4, 17, 5, 2, 40, 4, 7, 7, 1};
+	static uint8_t expectedmodules[MAX_GRID_BYTES], modules[MAX_GRID_BYTES], buffer[MAX_GRID_BYTES];
+	qrcode_workspace workspace;
+	qrcode_initWorkspace(&workspace, buffer, 40);
+	uint8_t* data = (uint8_t*) payloads[1];
+	uint16_t length = strlen(payloads[1]);
+	int result = 0;
+	size_t idx = 0;
+	for(; idx < sizeof(versions); ++idx)
+	{
+		uint8_t ecc = idx % 4;
+		QRCode expected, qrcode;
+		result |= qrcode_initBytes(&expected, expectedmodules, versions[idx], ecc, data, length) != 0;
+		result |= qrcode_initBytesDispatch(&qrcode, modules, versions[idx], ecc, data, length,
+							&workspace) != 0;
+		result |= !same_code(&expected, expectedmodules, &qrcode, modules);
+		result |= qrcode_initBytesWorkspace(&qrcode, modules, versions[idx], ecc, data, length,
+							&workspace) != 0;
+		result |= !same_code(&expected, expectedmodules, &qrcode, modules);
+	}
+	return result ? -1 : 0;
+}
+
+#define THREAD_COUNT 4
+
+static void* encode_thread(void* p)
+{
+	//Every version, through the per-thread workspace
+	uint8_t* modules = (uint8_t*) p;
+	uint8_t* data = (uint8_t*) payloads[1];
+	uint16_t length = strlen(payloads[1]);
+	uint8_t version = 1;
+	for(; version <= 40; ++version)
+	{
+		QRCode qrcode;
+		if(qrcode_initBytes(&qrcode, modules, version, ECC_MEDIUM, data, length) != 0)
+		{
+			modules[0] ^= 0xff;
+		}
+		modules += qrcode_getBufferSize(version);
+	}
+	return 0;
+}
+
+int check_threads()
+{
+	//Threads building the placement tables at once all get the same codes.
+	//Runs first, while no table is built yet.
+	size_t bytes = 0;
+	uint8_t version = 1;
+	for(; version <= 40; ++version)
+	{
+		bytes += qrcode_getBufferSize(version);
+	}
+	uint8_t* modules = (uint8_t*) calloc(THREAD_COUNT, bytes);
+	if(!modules)
+	{
+		return -1;
+	}
+
+	pthread_t threads[THREAD_COUNT];
+	int idx = 0, started = 0;
+	for(; idx < THREAD_COUNT; ++idx)
+	{
+		started += pthread_create(&threads[idx], 0, encode_thread, modules + idx * bytes) == 0;
+	}
+	for(idx = 0; idx < started; ++idx)
+	{
+		pthread_join(threads[idx], 0);
+	}
+
+	int result = started != THREAD_COUNT;
+	for(idx = 1; idx < started; ++idx)
+	{
+		result |= memcmp(modules, modules + idx * bytes, bytes) != 0;
+	}
+	free(modules);
+	return result ? -1 : 0;
+}
+
+int main(void)
+{
+	int threadsfailed = check_threads() < 0;
+	printf("Thread test %s.\n", threadsfailed ? "failed" : "passed");
+	int pathsfailed = check_paths() < 0;
+	printf("Encoder paths test %s.\n", pathsfailed ? "failed" : "passed");
+	int toolongfailed = check_too_long() < 0;
+	printf("Too long test %s.\n", toolongfailed ? "failed" : "passed");
+	int reusefailed = check_reuse() < 0;
+	printf("Workspace reuse test %s.\n", reusefailed ? "failed" : "passed");
+
+	return threadsfailed || pathsfailed || toolongfailed || reusefailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,322 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#include "ratelimit.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "totp.h"
+#include "csprng.h"
+#include "metrics.h"
+#include "usdt.h"
+
+//A bucket's state is one word, updated by compare-and-swap:
+//	bits 0-31	tick of the last update, or the end of a lockout when it
+//			lies in the future; 0 marks a full bucket
+//	bits 32-55	tokens, in 1/65536 token units
+//	bits 56-63	lockouts since the bucket was last full
+#define STATE_TIME(s) ((uint32_t) (s))
+#define STATE_TOKENS(s) ((uint32_t) ((s) >> 32) & 0xffffff)
+#define STATE_LEVEL(s) ((uint32_t) ((s) >> 56))
+#define STATE_PACK(time, tokens, level) \
+	((uint64_t) (time) | ((uint64_t) (tokens) << 32) | ((uint64_t) (level) << 56))
+
+#define TOKEN_ONE (1u << 16)
+#define LEVEL_MAX 31
+
+//Key 0 marks an empty slot, so a caller's key 0 is stored as this instead
+#define KEY_ZERO 0x9e3779b97f4a7c15ull
+
+struct ratelimit_slot
+{
+	uint64_t key;
+	uint64_t state;
+};
+
+struct ratelimit
+{
+	struct ratelimit_slot* slots;
+	size_t mask;
+	uint64_t seed;
+	uint64_t epoch_ms;
+	uint32_t burst;		//In token units
+	uint32_t refill;	//Token units per tick
+	uint32_t lockout;	//Ticks
+	uint32_t max_lockout;
+};
+
+static uint32_t ms_to_ticks(uint64_t ms)
+{
+	uint64_t ticks = (ms + (1 << RATELIMIT_TICK_SHIFT) - 1) >> RATELIMIT_TICK_SHIFT;
+	return ticks > UINT32_MAX ? UINT32_MAX : (uint32_t) ticks;
+}
+
+struct ratelimit* ratelimit_create(const struct ratelimit_options* options)
+{
+	if(!options->burst || options->burst > 255 || !(options->refill_per_second > 0) ||
+		options->capacity > ((size_t) 1 << 40))
+	{
+		return 0;
+	}
+
+	struct ratelimit* rl = (struct ratelimit*) malloc(sizeof(struct ratelimit));
+	if(!rl)
+	{
+		return 0;
+	}
+
+	size_t capacity = 64;
+	while(capacity < options->capacity)
+	{
+		capacity <<= 1;
+	}
+
+	void* mem = 0;
+	if(posix_memalign(&mem, 64, capacity * sizeof(struct ratelimit_slot)) != 0)
+	{
+		free(rl);
+		return 0;
+	}
+	memset(mem, 0, capacity * sizeof(struct ratelimit_slot));
+	rl->slots = (struct ratelimit_slot*) mem;
+	rl->mask = capacity - 1;
+
+	//A per table seed keeps an attacker from aiming keys at one probe run
+	if(csprng_fill((uint8_t*) &rl->seed, sizeof(rl->seed)) < 0)
+	{
+		rl->seed = (uintptr_t) rl ^ metrics_now();
+	}
+	rl->epoch_ms = ratelimit_now();
+
+	double refill = options->refill_per_second * TOKEN_ONE * (1 << RATELIMIT_TICK_SHIFT) / 1000;
+	rl->burst = options->burst * TOKEN_ONE;
+	rl->refill = refill < 1 ? 1 : refill > rl->burst ? rl->burst : (uint32_t) refill;
+	rl->lockout = options->lockout_ms ? ms_to_ticks(options->lockout_ms) : 0;
+	rl->max_lockout = ms_to_ticks(options->max_lockout_ms > options->lockout_ms ?
+				options->max_lockout_ms : options->lockout_ms);
+	return rl;
+}
+
+void ratelimit_destroy(struct ratelimit* rl)
+{
+	if(rl)
+	{
+		free(rl->slots);
+		free(rl);
+	}
+}
+
+uint64_t ratelimit_now(void)
+{
+	//The coarse clock is read from the vDSO without a syscall, and ms
+	//resolution is plenty for buckets refilling over seconds
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t ratelimit_hash(const void* data, size_t len)
+{
+	const uint8_t* bytes = (const uint8_t*) data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t idx = 0;
+	for(; idx < len; ++idx)
+	{
+		hash = (hash ^ bytes[idx]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static size_t ratelimit_home(const struct ratelimit* rl, uint64_t key)
+{
+	//splitmix64 finalizer, so that sequential ids spread over the table
+	uint64_t x = key ^ rl->seed;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return (x ^ (x >> 31)) & rl->mask;
+}
+
+static uint32_t ratelimit_tick(const struct ratelimit* rl, uint64_t now_ms)
+{
+	//Ticks start at 1, as time 0 marks a full bucket
+	uint64_t ticks = now_ms > rl->epoch_ms ? (now_ms - rl->epoch_ms) >> RATELIMIT_TICK_SHIFT : 0;
+	return ticks >= UINT32_MAX ? UINT32_MAX : (uint32_t) ticks + 1;
+}
+
+static uint32_t ratelimit_tokens(const struct ratelimit* rl, uint64_t state, uint32_t tick)
+{
+	//Tokens in the bucket at tick, which must not be before STATE_TIME
+	if(!STATE_TIME(state))
+	{
+		return rl->burst;
+	}
+	uint64_t tokens = STATE_TOKENS(state) + (uint64_t) (tick - STATE_TIME(state)) * rl->refill;
+	return tokens > rl->burst ? rl->burst : (uint32_t) tokens;
+}
+
+static int ratelimit_idle(const struct ratelimit* rl, uint64_t state, uint32_t tick)
+{
+	return tick >= STATE_TIME(state) && ratelimit_tokens(rl, state, tick) == rl->burst;
+}
+
+static struct ratelimit_slot* ratelimit_find(struct ratelimit* rl, uint64_t key)
+{
+	//Keys are replaced but never removed, so an empty slot ends the run
+	size_t home = ratelimit_home(rl, key), probe = 0;
+	for(; probe < RATELIMIT_PROBES; ++probe)
+	{
+		struct ratelimit_slot* slot = &rl->slots[(home + probe) & rl->mask];
+		uint64_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if(k == key)
+		{
+			return slot;
+		}
+		if(!k)
+		{
+			break;
+		}
+	}
+	return 0;
+}
+
+static struct ratelimit_slot* ratelimit_insert(struct ratelimit* rl, uint64_t key, uint32_t tick)
+{
+	//Claims an empty slot, or one whose key has gone idle, in key's probe
+	//run. Two threads inserting the same key at once may briefly give it two
+	//buckets; lookups settle on the first one.
+	size_t home = ratelimit_home(rl, key), probe = 0;
+	for(; probe < RATELIMIT_PROBES; ++probe)
+	{
+		struct ratelimit_slot* slot = &rl->slots[(home + probe) & rl->mask];
+		uint64_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if(!k && __atomic_compare_exchange_n(&slot->key, &k, key, 0,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			//Never written since the table was zeroed: a full bucket
+			return slot;
+		}
+		if(k == key)
+		{
+			return slot;
+		}
+		if(ratelimit_idle(rl, __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE), tick) &&
+			__atomic_compare_exchange_n(&slot->key, &k, key, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			//A thread still working on the old key can take a token from
+			//the new one, which errs on the side of throttling
+			__atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+			return slot;
+		}
+	}
+	return 0;
+}
+
+static int ratelimit_reject(int result)
+{
+	METRICS_COUNT(METRICS_THROTTLED, 1);
+	MUTOTP_PROBE1(ratelimit_reject, result);
+	return result;
+}
+
+int ratelimit_acquire(struct ratelimit* rl, uint64_t key, uint64_t now_ms)
+{
+	uint32_t tick = ratelimit_tick(rl, now_ms);
+	key = key ? key : KEY_ZERO;
+
+	struct ratelimit_slot* slot = ratelimit_find(rl, key);
+	if(!slot && !(slot = ratelimit_insert(rl, key, tick)))
+	{
+		return ratelimit_reject(RATELIMIT_FULL);
+	}
+
+	uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+	for(;;)
+	{
+		if(tick < STATE_TIME(state))
+		{
+			return ratelimit_reject(RATELIMIT_LOCKED);
+		}
+
+		uint32_t tokens = ratelimit_tokens(rl, state, tick);
+		uint32_t level = tokens == rl->burst ? 0 : STATE_LEVEL(state);
+		uint64_t next;
+		int result = RATELIMIT_OK;
+		if(tokens >= TOKEN_ONE)
+		{
+			next = STATE_PACK(tick, tokens - TOKEN_ONE, level);
+		}
+		else if(!rl->lockout)
+		{
+			return ratelimit_reject(RATELIMIT_LIMITED);
+		}
+		else
+		{
+			//The bucket refills from the end of the lockout, which doubles
+			//each time it runs dry again before refilling
+			uint64_t lockout = (uint64_t) rl->lockout << level;
+			uint64_t until = tick + (lockout < rl->max_lockout ? lockout : rl->max_lockout);
+			next = STATE_PACK(until > UINT32_MAX ? UINT32_MAX : until, tokens,
+					level < LEVEL_MAX ? level + 1 : level);
+			result = RATELIMIT_LIMITED;
+		}
+
+		if(__atomic_compare_exchange_n(&slot->state, &state, next, 1,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return result == RATELIMIT_OK ? result : ratelimit_reject(result);
+		}
+	}
+}
+
+void ratelimit_success(struct ratelimit* rl, uint64_t key)
+{
+	struct ratelimit_slot* slot = ratelimit_find(rl, key ? key : KEY_ZERO);
+	if(slot)
+	{
+		__atomic_store_n(&slot->state, 0, __ATOMIC_RELEASE);
+	}
+}
+
+int totp_verify_limited(struct ratelimit* users, uint64_t user,
+		struct ratelimit* sources, uint64_t source,
+		const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter)
+{
+	//Sources first: a stuffing run spread over many users trips its
+	//address's bucket without using up the users' own
+	uint64_t now = ratelimit_now();
+	if((sources && ratelimit_acquire(sources, source, now) != RATELIMIT_OK) ||
+		(users && ratelimit_acquire(users, user, now) != RATELIMIT_OK))
+	{
+		return TOTP_VERIFY_THROTTLED;
+	}
+
+	int result = totp_verify(secret, secretlen, code, timestamp, timestep,
+				digits, window, lastcounter);
+	if(result == TOTP_VERIFY_OK && users)
+	{
+		ratelimit_success(users, user);
+	}
+	return result;
+}
@@ -0,0 +1,122 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#ifndef RATELIMIT_H_
+#define RATELIMIT_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Brute force throttling in front of OTP verification. A table holds a token
+//bucket per key (a user, or a client address): every attempt takes a token,
+//tokens trickle back at a fixed rate, and an attempt finding the bucket empty
+//locks the key out for a period that doubles with each lockout. Checks are
+//lock-free and cost a hash probe and a compare-and-swap, so a flood of guesses
+//is turned away before any HMAC is computed.
+
+#define RATELIMIT_OK 0
+#define RATELIMIT_LIMITED -1	//The bucket ran dry; the key is now locked out
+#define RATELIMIT_LOCKED -2	//The key is serving a lockout
+#define RATELIMIT_FULL -3	//No room to track the key; treat as limited
+
+//Returned by totp_verify_limited, alongside the TOTP_VERIFY_* results
+#define TOTP_VERIFY_THROTTLED -3
+
+//Slots looked at for a key before the table counts as full
+#define RATELIMIT_PROBES 16
+
+//Time is kept in ticks of 2^RATELIMIT_TICK_SHIFT ms (64 ms), which lets a
+//bucket's whole state fit in one 64 bit word
+#define RATELIMIT_TICK_SHIFT 6
+
+struct ratelimit_options
+{
+	size_t capacity;
+	uint32_t burst;
+	double refill_per_second;
+	uint32_t lockout_ms;
+	uint32_t max_lockout_ms;
+};
+/* Options for ratelimit_create
+ *
+ * capacity - keys tracked at once, rounded up to a power of two. Keys whose
+ *	      buckets have refilled are reclaimed, so this only needs to cover
+ *	      the keys currently being throttled.
+ * burst - attempts a key can make back to back (at most 255)
+ * refill_per_second - rate at which spent attempts come back
+ * lockout_ms - length of a key's first lockout; each further lockout before
+ *		its bucket refills doubles it
+ * max_lockout_ms - cap on the lockout length
+ */
+
+struct ratelimit;
+
+struct ratelimit* ratelimit_create(const struct ratelimit_options* options);
+/* ratelimit_create: allocates an empty table. Returns NULL if the options are
+ * out of range or memory runs out. Free it with ratelimit_destroy.
+ */
+
+void ratelimit_destroy(struct ratelimit* rl);
+
+int ratelimit_acquire(struct ratelimit* rl, uint64_t key, uint64_t now_ms);
+/* ratelimit_acquire: takes a token from key's bucket for one attempt.
+ * Returns RATELIMIT_OK if the attempt may go ahead, or one of
+ * RATELIMIT_LIMITED, RATELIMIT_LOCKED or RATELIMIT_FULL if it must be
+ * rejected. A key serving a lockout is rejected with a single load.
+ *
+ * key - any 64 bit value naming the user or source, e.g. from ratelimit_hash
+ * now_ms - a monotonic time in ms, normally ratelimit_now()
+ */
+
+void ratelimit_success(struct ratelimit* rl, uint64_t key);
+/* ratelimit_success: refills key's bucket and forgets its lockouts, after it
+ * proved it holds the secret. Apply it to the user's key, not the source's.
+ */
+
+uint64_t ratelimit_now(void);
+/* ratelimit_now: coarse monotonic clock in ms, for ratelimit_acquire */
+
+uint64_t ratelimit_hash(const void* data, size_t len);
+/* ratelimit_hash: 64 bit FNV-1a of data, to make keys from user names or
+ * addresses. Not collision resistant; prefer numeric ids where there are any.
+ */
+
+int totp_verify_limited(struct ratelimit* users, uint64_t user,
+		struct ratelimit* sources, uint64_t source,
+		const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter);
+/* totp_verify_limited: totp_verify behind per-source and per-user buckets.
+ * Returns TOTP_VERIFY_THROTTLED, without hashing anything, if either bucket
+ * rejects the attempt; otherwise the result of totp_verify. A successful
+ * verification clears the user's lockouts. Either table may be NULL.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
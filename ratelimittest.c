@@ -0,0 +1,181 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "ratelimit.h"
+#include "totp.h"
+#include "metrics.h"
+
+int check_lockout()
+{
+	struct ratelimit_options options = {256, 3, 1.0, 1000, 8000};
+	struct ratelimit* rl = ratelimit_create(&options);
+	if(!rl)
+	{
+		return -1;
+	}
+
+	uint64_t now = ratelimit_now();
+	int result = 0;
+	int idx = 0;
+	for(; idx < 3; ++idx)
+	{
+		result |= ratelimit_acquire(rl, 7, now) != RATELIMIT_OK;
+	}
+
+	//The burst is spent: locked out for a second, then for two seconds when
+	//the bucket runs dry again straight after
+	result |= ratelimit_acquire(rl, 7, now) != RATELIMIT_LIMITED;
+	result |= ratelimit_acquire(rl, 7, now + 500) != RATELIMIT_LOCKED;
+	result |= ratelimit_acquire(rl, 8, now + 500) != RATELIMIT_OK;
+	result |= ratelimit_acquire(rl, 7, now + 1100) != RATELIMIT_LIMITED;
+	result |= ratelimit_acquire(rl, 7, now + 2900) != RATELIMIT_LOCKED;
+
+	//A token comes back a second after the lockout ends
+	result |= ratelimit_acquire(rl, 7, now + 3600) != RATELIMIT_LIMITED;
+	result |= ratelimit_acquire(rl, 7, now + 7000) != RATELIMIT_LOCKED;
+	result |= ratelimit_acquire(rl, 7, now + 8900) != RATELIMIT_OK;
+
+	//Proving the secret clears the lockouts
+	ratelimit_success(rl, 7);
+	for(idx = 0; idx < 3; ++idx)
+	{
+		result |= ratelimit_acquire(rl, 7, now + 8900) != RATELIMIT_OK;
+	}
+
+	//So does waiting for the bucket to refill, after which the first lockout
+	//is short again
+	result |= ratelimit_acquire(rl, 7, now + 8900) != RATELIMIT_LIMITED;
+	for(idx = 0; idx < 3; ++idx)
+	{
+		result |= ratelimit_acquire(rl, 7, now + 14000) != RATELIMIT_OK;
+	}
+	result |= ratelimit_acquire(rl, 7, now + 14000) != RATELIMIT_LIMITED;
+	result |= ratelimit_acquire(rl, 7, now + 15100) != RATELIMIT_LIMITED;
+
+	ratelimit_destroy(rl);
+	return result ? -1 : 0;
+}
+
+int check_verify_limited()
+{
+	static const char secret[] = "12345678901234567890";
+	struct ratelimit_options options = {256, 2, 0.01, 60000, 60000};
+	struct ratelimit* users = ratelimit_create(&options);
+	struct ratelimit* sources = ratelimit_create(&options);
+	if(!users || !sources)
+	{
+		return -1;
+	}
+
+	time_t now = 1600000000;
+	uint64_t lastcounter = 0;
+	int32_t code = compute_totp(secret, 20, now, 30, 6);
+	int result = totp_verify_limited(users, 1, sources, 10, secret, 20, code, now, 30, 6, 1,
+					&lastcounter) != TOTP_VERIFY_OK;
+
+	//The user's bucket was refilled by the success, the source's was not
+	result |= totp_verify_limited(users, 1, sources, 10, secret, 20, (code + 1) % 1000000,
+					now, 30, 6, 1, &lastcounter) != TOTP_VERIFY_INVALID;
+	result |= totp_verify_limited(users, 2, sources, 10, secret, 20, (code + 1) % 1000000,
+					now, 30, 6, 1, &lastcounter) != TOTP_VERIFY_THROTTLED;
+
+	//Throttled guesses cost no HMACs, even with the right code
+	struct metrics_snapshot before, after;
+	metrics_snapshot(&before);
+	int idx = 0;
+	for(; idx < 1000; ++idx)
+	{
+		result |= totp_verify_limited(users, 1, sources, 10, secret, 20, code,
+						now + 30, 30, 6, 1, &lastcounter) != TOTP_VERIFY_THROTTLED;
+	}
+	metrics_snapshot(&after);
+	result |= after.counters[METRICS_HMACS] != before.counters[METRICS_HMACS];
+
+	ratelimit_destroy(sources);
+	ratelimit_destroy(users);
+	return result ? -1 : 0;
+}
+
+struct race_arg
+{
+	struct ratelimit* rl;
+	uint64_t now;
+	int granted;
+};
+
+static void* race_thread(void* p)
+{
+	struct race_arg* arg = (struct race_arg*) p;
+	int idx = 0;
+	for(; idx < 1000; ++idx)
+	{
+		arg->granted += ratelimit_acquire(arg->rl, 42, arg->now) == RATELIMIT_OK;
+	}
+	return 0;
+}
+
+int check_race()
+{
+	//Threads racing on one bucket are granted exactly its tokens
+	struct ratelimit_options options = {64, 200, 0.001, 0, 0};
+	struct ratelimit* rl = ratelimit_create(&options);
+	if(!rl)
+	{
+		return -1;
+	}
+
+	pthread_t threads[4];
+	struct race_arg args[4];
+	uint64_t now = ratelimit_now();
+	int idx = 0, started = 0, granted = 0;
+	for(; idx < 4; ++idx)
+	{
+		args[idx].rl = rl;
+		args[idx].now = now;
+		args[idx].granted = 0;
+		started += pthread_create(&threads[idx], 0, race_thread, &args[idx]) == 0;
+	}
+	for(idx = 0; idx < started; ++idx)
+	{
+		pthread_join(threads[idx], 0);
+		granted += args[idx].granted;
+	}
+
+	ratelimit_destroy(rl);
+	return started == 4 && granted == 200 ? 0 : -1;
+}
+
+int main(void)
+{
+	int lockoutfailed = check_lockout() < 0;
+	printf("Lockout test %s.\n", lockoutfailed ? "failed" : "passed");
+	int verifyfailed = check_verify_limited() < 0;
+	printf("Limited verify test %s.\n", verifyfailed ? "failed" : "passed");
+	int racefailed = check_race() < 0;
+	printf("Race test %s.\n", racefailed ? "failed" : "passed");
+
+	return lockoutfailed || verifyfailed || racefailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
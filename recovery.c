@@ -0,0 +1,453 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#include "recovery.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "base32codec.h"
+#include "csprng.h"
+
+enum
+{
+	ENTRY_EMPTY = 0,
+	ENTRY_WRITING,	//Claimed by an insert; skipped by lookups
+	ENTRY_LIVE,
+	ENTRY_USED	//Redeemed or revoked. Entries are never emptied again,
+			//so an empty entry always ends a probe run.
+};
+
+struct recovery_entry
+{
+	uint8_t digest[20];
+	uint32_t state;
+	uint64_t user;
+};
+
+struct recovery_store
+{
+	struct recovery_entry* entries;
+	size_t mask;
+	size_t limit;	//Entries that may be filled, 7/8 of the table
+	size_t count;	//Entries filled or reserved for filling
+	uint8_t salt[RECOVERY_SALT_SIZE];
+	SHA1_CTX salted;	//SHA1 midstate after the salt block
+};
+
+#define RECOVERY_MAGIC "MUTOTPRC"
+#define RECOVERY_FORMAT 1
+
+//Random bytes drawn at once by recovery_generate_bulk
+#define RECOVERY_BULK_BYTES 4096
+
+static void recovery_wipe(void* p, size_t len)
+{
+	volatile uint8_t* bytes = (volatile uint8_t*) p;
+	size_t idx = 0;
+	for(; idx < len; ++idx)
+	{
+		bytes[idx] = 0;
+	}
+}
+
+static struct recovery_store* recovery_alloc(size_t tablesize)
+{
+	struct recovery_store* store = (struct recovery_store*) calloc(1, sizeof(struct recovery_store));
+	void* mem = 0;
+	if(!store || posix_memalign(&mem, 64, tablesize * sizeof(struct recovery_entry)) != 0)
+	{
+		free(store);
+		return 0;
+	}
+	memset(mem, 0, tablesize * sizeof(struct recovery_entry));
+	store->entries = (struct recovery_entry*) mem;
+	store->mask = tablesize - 1;
+	store->limit = tablesize / 8 * 7;
+	return store;
+}
+
+static void recovery_init_salt(struct recovery_store* store)
+{
+	SHA1Init(&store->salted);
+	SHA1Update(&store->salted, store->salt, RECOVERY_SALT_SIZE);
+}
+
+struct recovery_store* recovery_store_create(size_t capacity,
+		int32_t (*rgen)(uint8_t*, size_t))
+{
+	size_t tablesize = 64;
+	while(tablesize / 8 * 7 < capacity)
+	{
+		if(tablesize > ((size_t) 1 << 40))
+		{
+			return 0;
+		}
+		tablesize <<= 1;
+	}
+
+	struct recovery_store* store = recovery_alloc(tablesize);
+	if(!store)
+	{
+		return 0;
+	}
+	if((rgen ? rgen : csprng_fill)(store->salt, RECOVERY_SALT_SIZE) < 0)
+	{
+		recovery_store_destroy(store);
+		return 0;
+	}
+	recovery_init_salt(store);
+	return store;
+}
+
+void recovery_store_destroy(struct recovery_store* store)
+{
+	if(store)
+	{
+		recovery_wipe(store->entries, (store->mask + 1) * sizeof(struct recovery_entry));
+		free(store->entries);
+		recovery_wipe(store, sizeof(struct recovery_store));
+		free(store);
+	}
+}
+
+static void recovery_digest(const struct recovery_store* store, uint64_t user,
+		const uint8_t* code, uint8_t digest[20])
+{
+	//SHA1(salt || user || code): the salt fills the first block, so each
+	//digest costs a single compression from the stored midstate
+	uint8_t message[8 + RECOVERY_CODE_BYTES];
+	size_t idx = 0;
+	for(; idx < 8; ++idx)
+	{
+		message[idx] = (uint8_t) (user >> (8 * idx));
+	}
+	memcpy(&message[8], code, RECOVERY_CODE_BYTES);
+
+	SHA1_CTX ctx = store->salted;
+	SHA1Update(&ctx, message, sizeof(message));
+	SHA1Final(digest, &ctx);
+	recovery_wipe(message, sizeof(message));
+}
+
+static size_t recovery_home(const struct recovery_store* store, const uint8_t digest[20])
+{
+	uint64_t h = 0;
+	memcpy(&h, digest, sizeof(h));
+	return h & store->mask;
+}
+
+static int digest_equal(const uint8_t* a, const uint8_t* b)
+{
+	//Constant time: every byte is looked at whatever the first mismatch
+	uint8_t diff = 0;
+	size_t idx = 0;
+	for(; idx < 20; ++idx)
+	{
+		diff |= a[idx] ^ b[idx];
+	}
+	return diff == 0;
+}
+
+static void recovery_insert(struct recovery_store* store, uint64_t user, const uint8_t digest[20])
+{
+	//The caller reserved the entry, so the table has an empty one
+	size_t idx = recovery_home(store, digest);
+	for(;; idx = (idx + 1) & store->mask)
+	{
+		struct recovery_entry* e = &store->entries[idx];
+		uint32_t state = ENTRY_EMPTY;
+		if(__atomic_load_n(&e->state, __ATOMIC_RELAXED) == ENTRY_EMPTY &&
+			__atomic_compare_exchange_n(&e->state, &state, ENTRY_WRITING, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			memcpy(e->digest, digest, 20);
+			e->user = user;
+			__atomic_store_n(&e->state, ENTRY_LIVE, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+static void format_code(const uint8_t* code, char out[RECOVERY_CODE_SIZE])
+{
+	char encoded[BASE32_ENCODE_BOUND(RECOVERY_CODE_BYTES) + 1];
+	base32encode((const char*) code, RECOVERY_CODE_BYTES, encoded, sizeof(encoded));
+	size_t idx = 0, pos = 0;
+	for(; idx < 16; ++idx)
+	{
+		if(idx && !(idx & 3))
+		{
+			out[pos++] = '-';
+		}
+		out[pos++] = encoded[idx];
+	}
+	out[pos] = 0;
+	recovery_wipe(encoded, sizeof(encoded));
+}
+
+static int recovery_add(struct recovery_store* store, uint64_t user, const uint8_t* random,
+		size_t count, char (*codes)[RECOVERY_CODE_SIZE])
+{
+	//Reserve every entry first, so a set is added whole or not at all
+	if(__atomic_add_fetch(&store->count, count, __ATOMIC_RELAXED) > store->limit)
+	{
+		__atomic_sub_fetch(&store->count, count, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	size_t idx = 0;
+	for(; idx < count; ++idx)
+	{
+		const uint8_t* code = &random[idx * RECOVERY_CODE_BYTES];
+		uint8_t digest[20];
+		recovery_digest(store, user, code, digest);
+		recovery_insert(store, user, digest);
+		format_code(code, codes[idx]);
+	}
+	return (int) count;
+}
+
+int recovery_generate(struct recovery_store* store, uint64_t user,
+		char (*codes)[RECOVERY_CODE_SIZE], size_t count,
+		int32_t (*rgen)(uint8_t*, size_t))
+{
+	if(count > RECOVERY_MAX_CODES)
+	{
+		return -1;
+	}
+
+	uint8_t random[RECOVERY_MAX_CODES * RECOVERY_CODE_BYTES];
+	int result = -1;
+	if((rgen ? rgen : csprng_fill)(random, count * RECOVERY_CODE_BYTES) >= 0)
+	{
+		result = recovery_add(store, user, random, count, codes);
+	}
+	recovery_wipe(random, sizeof(random));
+	return result;
+}
+
+int recovery_generate_bulk(struct recovery_store* store, const uint64_t* users,
+		size_t nusers, size_t count, int32_t (*rgen)(uint8_t*, size_t), FILE* out)
+{
+	if(!count || count > RECOVERY_MAX_CODES)
+	{
+		return -1;
+	}
+
+	uint8_t random[RECOVERY_BULK_BYTES];
+	char codes[RECOVERY_MAX_CODES][RECOVERY_CODE_SIZE];
+	size_t perbatch = RECOVERY_BULK_BYTES / (count * RECOVERY_CODE_BYTES);
+	int result = 0;
+	size_t first = 0;
+	for(; first < nusers && !result; first += perbatch)
+	{
+		size_t batch = nusers - first < perbatch ? nusers - first : perbatch;
+		if((rgen ? rgen : csprng_fill)(random, batch * count * RECOVERY_CODE_BYTES) < 0)
+		{
+			result = -1;
+			break;
+		}
+
+		size_t idx = 0;
+		for(; idx < batch; ++idx)
+		{
+			uint64_t user = users[first + idx];
+			if(recovery_add(store, user, &random[idx * count * RECOVERY_CODE_BYTES],
+					count, codes) < 0 ||
+				fprintf(out, "%llu\t", (unsigned long long) user) < 0)
+			{
+				result = -1;
+				break;
+			}
+
+			size_t code = 0;
+			for(; code < count; ++code)
+			{
+				if(fputs(codes[code], out) == EOF ||
+					fputc(code + 1 < count ? ' ' : '\n', out) == EOF)
+				{
+					result = -1;
+					break;
+				}
+			}
+			if(result)
+			{
+				break;
+			}
+		}
+	}
+
+	recovery_wipe(random, sizeof(random));
+	recovery_wipe(codes, sizeof(codes));
+	return result;
+}
+
+static int parse_code(const char* text, uint8_t code[RECOVERY_CODE_BYTES])
+{
+	char chars[16];
+	size_t n = 0;
+	for(; *text; ++text)
+	{
+		char c = *text;
+		if(c == '-' || c == ' ')
+		{
+			continue;
+		}
+		if(n == sizeof(chars))
+		{
+			return -1;
+		}
+		chars[n++] = c == '0' ? 'O' : c == '1' ? 'I' : c == '8' ? 'B' : c;
+	}
+
+	int result = n == sizeof(chars) &&
+		base32decode(chars, n, (char*) code, RECOVERY_CODE_BYTES) == RECOVERY_CODE_BYTES ? 0 : -1;
+	recovery_wipe(chars, sizeof(chars));
+	return result;
+}
+
+int recovery_redeem(struct recovery_store* store, uint64_t user, const char* code)
+{
+	uint8_t bytes[RECOVERY_CODE_BYTES];
+	if(parse_code(code, bytes) < 0)
+	{
+		return RECOVERY_INVALID;
+	}
+	uint8_t digest[20];
+	recovery_digest(store, user, bytes, digest);
+	recovery_wipe(bytes, sizeof(bytes));
+
+	size_t idx = recovery_home(store, digest), probe = 0;
+	for(; probe <= store->mask; ++probe, idx = (idx + 1) & store->mask)
+	{
+		struct recovery_entry* e = &store->entries[idx];
+		uint32_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+		if(state == ENTRY_EMPTY)
+		{
+			break;
+		}
+		if(state == ENTRY_WRITING || !(digest_equal(e->digest, digest) & (e->user == user)))
+		{
+			continue;
+		}
+
+		//Of concurrent redemptions of one code, only one swaps it to used
+		if(state == ENTRY_LIVE && __atomic_compare_exchange_n(&e->state, &state, ENTRY_USED,
+								0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			return RECOVERY_OK;
+		}
+		return RECOVERY_USED;
+	}
+	return RECOVERY_INVALID;
+}
+
+size_t recovery_revoke(struct recovery_store* store, uint64_t user)
+{
+	size_t revoked = 0, idx = 0;
+	for(; idx <= store->mask; ++idx)
+	{
+		struct recovery_entry* e = &store->entries[idx];
+		uint32_t state = ENTRY_LIVE;
+		if(__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == ENTRY_LIVE && e->user == user &&
+			__atomic_compare_exchange_n(&e->state, &state, ENTRY_USED, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			++revoked;
+		}
+	}
+	return revoked;
+}
+
+struct recovery_header
+{
+	char magic[8];
+	uint32_t format;
+	uint32_t entrysize;
+	uint64_t tablesize;
+	uint8_t salt[RECOVERY_SALT_SIZE];
+};
+
+int recovery_store_save(const struct recovery_store* store, FILE* out)
+{
+	struct recovery_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECOVERY_MAGIC, sizeof(header.magic));
+	header.format = RECOVERY_FORMAT;
+	header.entrysize = sizeof(struct recovery_entry);
+	header.tablesize = store->mask + 1;
+	memcpy(header.salt, store->salt, RECOVERY_SALT_SIZE);
+
+	int result = fwrite(&header, sizeof(header), 1, out) == 1 &&
+		fwrite(store->entries, sizeof(struct recovery_entry), store->mask + 1, out) ==
+			store->mask + 1 ? 0 : -1;
+	recovery_wipe(&header, sizeof(header));
+	return result;
+}
+
+struct recovery_store* recovery_store_load(FILE* in)
+{
+	struct recovery_header header;
+	if(fread(&header, sizeof(header), 1, in) != 1 ||
+		memcmp(header.magic, RECOVERY_MAGIC, sizeof(header.magic)) ||
+		header.format != RECOVERY_FORMAT ||
+		header.entrysize != sizeof(struct recovery_entry) ||
+		header.tablesize < 64 || header.tablesize > ((uint64_t) 1 << 41) ||
+		(header.tablesize & (header.tablesize - 1)))
+	{
+		recovery_wipe(&header, sizeof(header));
+		return 0;
+	}
+
+	struct recovery_store* store = recovery_alloc(header.tablesize);
+	if(!store || fread(store->entries, sizeof(struct recovery_entry), header.tablesize, in) !=
+		header.tablesize)
+	{
+		recovery_wipe(&header, sizeof(header));
+		recovery_store_destroy(store);
+		return 0;
+	}
+
+	//The fill is counted again rather than trusted, and an insert caught
+	//mid-write by the save leaves a dead entry behind
+	size_t idx = 0;
+	for(; idx < header.tablesize; ++idx)
+	{
+		uint32_t state = store->entries[idx].state;
+		if(state > ENTRY_USED || (state != ENTRY_EMPTY && ++store->count > store->limit))
+		{
+			recovery_wipe(&header, sizeof(header));
+			recovery_store_destroy(store);
+			return 0;
+		}
+		if(state == ENTRY_WRITING)
+		{
+			store->entries[idx].state = ENTRY_USED;
+		}
+	}
+
+	memcpy(store->salt, header.salt, RECOVERY_SALT_SIZE);
+	recovery_wipe(&header, sizeof(header));
+	recovery_init_salt(store);
+	return store;
+}
@@ -0,0 +1,106 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//One-time recovery codes for users who lost their authenticator. A code is
+//RECOVERY_CODE_BYTES random bytes shown as base32 in groups of four, e.g.
+//"MZXW-6YTB-OI3D-EMRT". The store keeps only a salted SHA1 of the user id and
+//code, in a fixed open-addressing table of 32 byte entries, two to a cache
+//line. Lookups compare digests in constant time, and a code is marked used
+//with a compare-and-swap, so concurrent redemptions of one code succeed once.
+
+#define RECOVERY_CODE_BYTES 10
+#define RECOVERY_CODE_SIZE 20	//"XXXX-XXXX-XXXX-XXXX" and its terminator
+#define RECOVERY_SALT_SIZE 64
+#define RECOVERY_MAX_CODES 32	//Per call to recovery_generate
+
+#define RECOVERY_OK 0
+#define RECOVERY_INVALID -1
+#define RECOVERY_USED -2
+
+struct recovery_store;
+
+struct recovery_store* recovery_store_create(size_t capacity,
+		int32_t (*rgen)(uint8_t*, size_t));
+/* recovery_store_create: allocates an empty store with a fresh random salt.
+ * Returns NULL if memory or the random source ran out.
+ *
+ * capacity - codes the store can hold, used ones included; rounded up so the
+ *	      table is never more than 7/8 full
+ * rgen - random source, as for generate_random_secret (NULL for csprng_fill)
+ */
+
+void recovery_store_destroy(struct recovery_store* store);
+/* recovery_store_destroy: wipes and frees store */
+
+int recovery_generate(struct recovery_store* store, uint64_t user,
+		char (*codes)[RECOVERY_CODE_SIZE], size_t count,
+		int32_t (*rgen)(uint8_t*, size_t));
+/* recovery_generate: makes count (at most RECOVERY_MAX_CODES) new codes for
+ * user, adds their digests to store and writes the codes, null terminated, to
+ * codes for showing to the user once. Returns count, or -1 if the random
+ * source failed or the store is full, in which case nothing was added.
+ */
+
+int recovery_generate_bulk(struct recovery_store* store, const uint64_t* users,
+		size_t nusers, size_t count, int32_t (*rgen)(uint8_t*, size_t), FILE* out);
+/* recovery_generate_bulk: recovery_generate for every user in users, e.g.
+ * when migrating accounts. Writes a line "user<TAB>code code ...\n" per user
+ * to out. The salt's SHA1 midstate is shared by every digest, and random
+ * bytes are drawn for many users at a time. Returns 0 on success and -1 on
+ * failure; users before the failing one keep their codes.
+ */
+
+int recovery_redeem(struct recovery_store* store, uint64_t user, const char* code);
+/* recovery_redeem: checks a code entered by user and uses it up. Returns
+ * RECOVERY_OK the first time a valid code is redeemed, RECOVERY_USED after
+ * that and RECOVERY_INVALID for anything else. Case, dashes and spaces are
+ * ignored, and 0, 1 and 8 are read as O, I and B.
+ */
+
+size_t recovery_revoke(struct recovery_store* store, uint64_t user);
+/* recovery_revoke: marks all of user's unused codes used, e.g. before issuing
+ * a new set. Scans the whole table; returns the number of codes revoked.
+ */
+
+int recovery_store_save(const struct recovery_store* store, FILE* out);
+struct recovery_store* recovery_store_load(FILE* in);
+/* recovery_store_save, recovery_store_load: write the salt and table to a
+ * file and read them back, in host byte order. Save while no codes are being
+ * generated. save returns 0 on success and -1 on a write error; load returns
+ * NULL if the file is not a store or could not be read.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "recovery.h"
+
+int check_redeem()
+{
+	struct recovery_store* store = recovery_store_create(100, 0);
+	char codes[10][RECOVERY_CODE_SIZE];
+	if(!store || recovery_generate(store, 1, codes, 10, 0) != 10)
+	{
+		return -1;
+	}
+
+	int result = strlen(codes[0]) != RECOVERY_CODE_SIZE - 1 || codes[0][4] != '-';
+	result |= recovery_redeem(store, 2, codes[0]) != RECOVERY_INVALID;
+	result |= recovery_redeem(store, 1, codes[0]) != RECOVERY_OK;
+	result |= recovery_redeem(store, 1, codes[0]) != RECOVERY_USED;
+
+	//Typed in lower case without the dashes
+	char typed[RECOVERY_CODE_SIZE];
+	size_t idx = 0, pos = 0;
+	for(; codes[1][idx]; ++idx)
+	{
+		if(codes[1][idx] != '-')
+		{
+			typed[pos++] = tolower((unsigned char) codes[1][idx]);
+		}
+	}
+	typed[pos] = 0;
+	result |= recovery_redeem(store, 1, typed) != RECOVERY_OK;
+	result |= recovery_redeem(store, 1, "AAAA-AAAA-AAAA-AAAA") != RECOVERY_INVALID;
+	result |= recovery_redeem(store, 1, "AAAA") != RECOVERY_INVALID;
+
+	//A saved store redeems the same codes
+	FILE* fp = tmpfile();
+	struct recovery_store* loaded = 0;
+	if(fp && recovery_store_save(store, fp) == 0)
+	{
+		rewind(fp);
+		loaded = recovery_store_load(fp);
+	}
+	result |= !loaded;
+	if(loaded)
+	{
+		result |= recovery_redeem(loaded, 1, codes[0]) != RECOVERY_USED;
+		result |= recovery_redeem(loaded, 1, codes[2]) != RECOVERY_OK;
+		recovery_store_destroy(loaded);
+	}
+	if(fp)
+	{
+		fclose(fp);
+	}
+
+	//Revoking leaves none of the unused codes
+	result |= recovery_revoke(store, 1) != 8;
+	result |= recovery_redeem(store, 1, codes[3]) != RECOVERY_USED;
+
+	//A set that does not fit is not added at all
+	char more[RECOVERY_MAX_CODES][RECOVERY_CODE_SIZE];
+	for(idx = 0; idx < 1000 && recovery_generate(store, 3, more, RECOVERY_MAX_CODES, 0) > 0; ++idx)
+	{
+	}
+	result |= recovery_generate(store, 4, more, 1, 0) == 1 &&
+		recovery_generate(store, 4, more, RECOVERY_MAX_CODES, 0) != -1;
+
+	recovery_store_destroy(store);
+	return result ? -1 : 0;
+}
+
+int check_bulk()
+{
+	uint64_t users[500];
+	size_t idx = 0;
+	for(; idx < 500; ++idx)
+	{
+		users[idx] = 1000 + idx;
+	}
+
+	struct recovery_store* store = recovery_store_create(500 * 8, 0);
+	FILE* fp = tmpfile();
+	if(!store || !fp || recovery_generate_bulk(store, users, 500, 8, 0, fp) < 0)
+	{
+		return -1;
+	}
+
+	//Every line's codes belong to its user only
+	rewind(fp);
+	int result = 0;
+	size_t lines = 0;
+	char line[512];
+	while(fgets(line, sizeof(line), fp))
+	{
+		char* save = 0;
+		uint64_t user = strtoull(strtok_r(line, "\t", &save), 0, 10);
+		size_t codes = 0;
+		char* code;
+		while((code = strtok_r(0, " \n", &save)))
+		{
+			result |= recovery_redeem(store, user + 1, code) != RECOVERY_INVALID;
+			result |= recovery_redeem(store, user, code) != RECOVERY_OK;
+			++codes;
+		}
+		result |= user != users[lines++] || codes != 8;
+	}
+	result |= lines != 500;
+
+	fclose(fp);
+	recovery_store_destroy(store);
+	return result ? -1 : 0;
+}
+
+struct race_arg
+{
+	struct recovery_store* store;
+	const char* code;
+	int redeemed;
+};
+
+static void* race_thread(void* p)
+{
+	struct race_arg* arg = (struct race_arg*) p;
+	arg->redeemed = recovery_redeem(arg->store, 5, arg->code) == RECOVERY_OK;
+	return 0;
+}
+
+int check_race()
+{
+	//Threads redeeming one code at once: exactly one of them succeeds
+	struct recovery_store* store = recovery_store_create(16, 0);
+	char codes[1][RECOVERY_CODE_SIZE];
+	if(!store || recovery_generate(store, 5, codes, 1, 0) != 1)
+	{
+		return -1;
+	}
+
+	pthread_t threads[8];
+	struct race_arg args[8];
+	int idx = 0, started = 0, redeemed = 0;
+	for(; idx < 8; ++idx)
+	{
+		args[idx].store = store;
+		args[idx].code = codes[0];
+		args[idx].redeemed = 0;
+		started += pthread_create(&threads[idx], 0, race_thread, &args[idx]) == 0;
+	}
+	for(idx = 0; idx < started; ++idx)
+	{
+		pthread_join(threads[idx], 0);
+		redeemed += args[idx].redeemed;
+	}
+
+	recovery_store_destroy(store);
+	return started == 8 && redeemed == 1 ? 0 : -1;
+}
+
+int main(void)
+{
+	int redeemfailed = check_redeem() < 0;
+	printf("Redeem test %s.\n", redeemfailed ? "failed" : "passed");
+	int bulkfailed = check_bulk() < 0;
+	printf("Bulk test %s.\n", bulkfailed ? "failed" : "passed");
+	int racefailed = check_race() < 0;
+	printf("Race test %s.\n", racefailed ? "failed" : "passed");
+
+	return redeemfailed || bulkfailed || racefailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
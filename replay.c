@@ -0,0 +1,375 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include "replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "totp.h"
+#include "csprng.h"
+#include "metrics.h"
+
+#define REPLAY_MAGIC 0x796c7052	//"Rply"
+#define REPLAY_VERSION 1
+
+//An entry is one word, so a user and their counter change together:
+//	bits 0-31	last accepted counter
+//	bits 32-63	tag from the user's hash; 0 marks an empty entry
+#define ENTRY_COUNTER(e) ((uint32_t) (e))
+#define ENTRY_TAG(e) ((uint32_t) ((e) >> 32))
+#define ENTRY_PACK(tag, counter) (((uint64_t) (tag) << 32) | (uint64_t) (counter))
+
+struct replay_header
+{
+	//Magic is stored last, once the rest is filled in
+	uint32_t magic;
+	uint32_t version;
+	uint64_t buckets;
+	uint64_t seed;
+} __attribute__((aligned(64)));
+
+struct replay_bucket
+{
+	uint64_t entries[REPLAY_TABLE_WAYS];
+} __attribute__((aligned(64)));
+
+struct replay_segment
+{
+	struct replay_header header;
+	struct replay_bucket buckets[];
+};
+
+struct replay_table
+{
+	//Copied out of the header once it has been checked
+	struct replay_segment* shm;
+	size_t size;
+	size_t mask;
+	size_t probes;
+	uint64_t seed;
+};
+
+static size_t replay_buckets(size_t capacity)
+{
+	size_t wanted = (capacity + REPLAY_TABLE_WAYS - 1) / REPLAY_TABLE_WAYS;
+	size_t buckets = 1;
+	while(buckets < wanted)
+	{
+		buckets <<= 1;
+	}
+	return buckets;
+}
+
+static int replay_init(struct replay_segment* shm, size_t buckets)
+{
+	//Caller holds the segment's flock; the buckets are still zero, as nobody
+	//uses a segment before its magic is set
+	uint64_t seed;
+	if(csprng_fill((uint8_t*) &seed, sizeof(seed)) < 0)
+	{
+		return -1;
+	}
+	shm->header.version = REPLAY_VERSION;
+	shm->header.buckets = buckets;
+	shm->header.seed = seed;
+	__atomic_store_n(&shm->header.magic, REPLAY_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct replay_table* replay_table_open(const char* name, size_t capacity)
+{
+	if(capacity > ((size_t) 1 << 36))
+	{
+		return 0;
+	}
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0)
+	{
+		return 0;
+	}
+	while(flock(fd, LOCK_EX) < 0)
+	{
+		if(errno != EINTR)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+
+	//A new segment is empty; one whose creator died may be sized but still
+	//have no header, and is set up again below. A segment someone else owns,
+	//or that others may open, could have been planted to forge the counters
+	//and is refused.
+	struct stat st;
+	size_t size = 0;
+	if(fstat(fd, &st) == 0 && st.st_uid == geteuid() &&
+		!(st.st_mode & (S_IRWXG | S_IRWXO)))
+	{
+		size = st.st_size;
+		if(!size)
+		{
+			size = sizeof(struct replay_header) +
+				replay_buckets(capacity) * sizeof(struct replay_bucket);
+			if(ftruncate(fd, size) < 0)
+			{
+				size = 0;
+			}
+		}
+	}
+
+	size_t buckets = size > sizeof(struct replay_header) ?
+		(size - sizeof(struct replay_header)) / sizeof(struct replay_bucket) : 0;
+	struct replay_segment* shm = MAP_FAILED;
+	if(buckets && !(buckets & (buckets - 1)) &&
+		size == sizeof(struct replay_header) + buckets * sizeof(struct replay_bucket))
+	{
+		shm = (struct replay_segment*) mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+
+	int ok = shm != MAP_FAILED;
+	if(ok && !__atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE))
+	{
+		ok = replay_init(shm, buckets) == 0;
+	}
+	ok = ok && shm->header.magic == REPLAY_MAGIC &&
+		shm->header.version == REPLAY_VERSION && shm->header.buckets == buckets;
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	struct replay_table* table = ok ? (struct replay_table*) malloc(sizeof(struct replay_table)) : 0;
+	if(!table)
+	{
+		if(shm != MAP_FAILED)
+		{
+			munmap(shm, size);
+		}
+		return 0;
+	}
+	table->shm = shm;
+	table->size = size;
+	table->mask = buckets - 1;
+	table->probes = buckets < REPLAY_TABLE_PROBES ? buckets : REPLAY_TABLE_PROBES;
+	table->seed = shm->header.seed;
+	return table;
+}
+
+void replay_table_close(struct replay_table* table)
+{
+	if(table)
+	{
+		munmap(table->shm, table->size);
+		free(table);
+	}
+}
+
+int replay_table_unlink(const char* name)
+{
+	return shm_unlink(name);
+}
+
+static uint64_t replay_hash(const struct replay_table* table, uint64_t user)
+{
+	//splitmix64 finalizer over the table's seed, so that neither sequential
+	//ids nor chosen ones pile up in a bucket
+	uint64_t x = user ^ table->seed;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+static uint32_t replay_tag(uint64_t hash)
+{
+	//The bucket comes from the low bits, the tag from the high ones
+	uint32_t tag = (uint32_t) (hash >> 32);
+	return tag ? tag : 1;
+}
+
+static uint64_t* replay_entries(const struct replay_table* table, uint64_t hash, size_t probe)
+{
+	return table->shm->buckets[(hash + probe) & table->mask].entries;
+}
+
+uint64_t replay_table_last(struct replay_table* table, uint64_t user)
+{
+	uint64_t hash = replay_hash(table, user);
+	uint32_t tag = replay_tag(hash), latest = 0;
+	size_t probe = 0;
+	for(; probe < table->probes; ++probe)
+	{
+		uint64_t* entries = replay_entries(table, hash, probe);
+		size_t way = 0;
+		for(; way < REPLAY_TABLE_WAYS; ++way)
+		{
+			uint64_t entry = __atomic_load_n(&entries[way], __ATOMIC_ACQUIRE);
+			if(ENTRY_TAG(entry) == tag && ENTRY_COUNTER(entry) > latest)
+			{
+				latest = ENTRY_COUNTER(entry);
+			}
+		}
+	}
+	return latest;
+}
+
+static uint32_t replay_latest_other(struct replay_table* table, uint64_t hash,
+		uint32_t tag, const uint64_t* except)
+{
+	//Latest counter in the user's entries other than except
+	uint32_t latest = 0;
+	size_t probe = 0;
+	for(; probe < table->probes; ++probe)
+	{
+		uint64_t* entries = replay_entries(table, hash, probe);
+		size_t way = 0;
+		for(; way < REPLAY_TABLE_WAYS; ++way)
+		{
+			uint64_t entry = __atomic_load_n(&entries[way], __ATOMIC_SEQ_CST);
+			if(&entries[way] != except && ENTRY_TAG(entry) == tag &&
+				ENTRY_COUNTER(entry) > latest)
+			{
+				latest = ENTRY_COUNTER(entry);
+			}
+		}
+	}
+	return latest;
+}
+
+int replay_table_commit(struct replay_table* table, uint64_t user,
+		uint64_t counter, uint64_t oldest)
+{
+	if(counter > UINT32_MAX)
+	{
+		return REPLAY_TABLE_FULL;
+	}
+
+	//Loads and swaps are sequentially consistent: the check after claiming a
+	//new entry below relies on it
+	uint64_t hash = replay_hash(table, user);
+	uint32_t tag = replay_tag(hash);
+	uint64_t wanted = ENTRY_PACK(tag, counter);
+	for(;;)
+	{
+		uint64_t* mine = 0;
+		uint64_t* spare = 0;
+		uint64_t minevalue = 0, sparevalue = 0;
+		uint32_t latest = 0;
+		size_t probe = 0;
+		for(; probe < table->probes; ++probe)
+		{
+			uint64_t* entries = replay_entries(table, hash, probe);
+			size_t way = 0;
+			for(; way < REPLAY_TABLE_WAYS; ++way)
+			{
+				uint64_t entry = __atomic_load_n(&entries[way], __ATOMIC_SEQ_CST);
+				if(ENTRY_TAG(entry) == tag)
+				{
+					if(!mine)
+					{
+						mine = &entries[way];
+						minevalue = entry;
+					}
+					latest = ENTRY_COUNTER(entry) > latest ? ENTRY_COUNTER(entry) : latest;
+				}
+				else if(!spare && (!entry || ENTRY_COUNTER(entry) < oldest))
+				{
+					spare = &entries[way];
+					sparevalue = entry;
+				}
+			}
+		}
+
+		if(mine)
+		{
+			//Raise the user's entry; a failed swap means another process
+			//got there first, and is looked at again
+			if(counter <= latest)
+			{
+				return TOTP_VERIFY_REPLAYED;
+			}
+			if(__atomic_compare_exchange_n(mine, &minevalue, wanted, 0,
+							__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			{
+				return TOTP_VERIFY_OK;
+			}
+			continue;
+		}
+		if(!spare)
+		{
+			return REPLAY_TABLE_FULL;
+		}
+		if(!__atomic_compare_exchange_n(spare, &sparevalue, wanted, 0,
+						__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			continue;
+		}
+
+		//Two processes adding the same user at once can claim an entry
+		//each. Whichever claimed second sees the other's entry here, takes
+		//its counter if it is later and reports a replay, so the code is
+		//accepted at most once.
+		latest = replay_latest_other(table, hash, tag, spare);
+		if(latest < counter)
+		{
+			return TOTP_VERIFY_OK;
+		}
+		uint64_t entry = wanted;
+		while(ENTRY_TAG(entry) == tag && ENTRY_COUNTER(entry) < latest)
+		{
+			if(__atomic_compare_exchange_n(spare, &entry, ENTRY_PACK(tag, latest), 0,
+							__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			{
+				break;
+			}
+		}
+		return TOTP_VERIFY_REPLAYED;
+	}
+}
+
+int totp_verify_shared(struct replay_table* table, uint64_t user,
+		const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits, uint32_t window)
+{
+	//Starting from the recorded counter turns most replays away in
+	//totp_verify; the commit settles races between processes
+	uint64_t last = replay_table_last(table, user);
+	int result = totp_verify(secret, secretlen, code, timestamp, timestep,
+				digits, window, &last);
+	if(result != TOTP_VERIFY_OK)
+	{
+		return result;
+	}
+
+	//One step of slack for processes whose clocks straddle a step boundary
+	uint64_t counter = timestamp / timestep;
+	uint64_t oldest = counter > (uint64_t) window + 1 ? counter - window - 1 : 0;
+	result = replay_table_commit(table, user, last, oldest);
+	if(result == TOTP_VERIFY_REPLAYED)
+	{
+		METRICS_COUNT(METRICS_VERIFY_REPLAYS, 1);
+	}
+	return result;
+}
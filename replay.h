@@ -0,0 +1,113 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+//Replay tracking shared between processes. Several processes verifying codes
+//for the same accounts each keep their own lastcounter, so a code can be
+//replayed once per process. A replay table keeps every user's last accepted
+//counter in a named POSIX shared memory segment that all of them map: a code
+//is accepted by raising the counter with one compare-and-swap, so at most one
+//process wins and none of them make an IPC round trip to decide.
+//
+//Entries are packed 64 bit words in 64 byte (one cache line) buckets, and
+//every update is a single atomic CAS. No lock is ever held on the table, so
+//a process that crashes at any point leaves it consistent for the others.
+
+#define REPLAY_TABLE_FULL -4	//No room to track the user; the code is refused
+
+//Entries per bucket, and buckets looked at for a user before the table
+//counts as full
+#define REPLAY_TABLE_WAYS 8
+#define REPLAY_TABLE_PROBES 4
+
+struct replay_table;
+
+struct replay_table* replay_table_open(const char* name, size_t capacity);
+/* replay_table_open: maps the replay table in the shared memory segment name
+ * (a shm_open name such as "/mygame-replay"), creating it with room for
+ * capacity users if it does not exist yet. A table that exists is used at its
+ * own size, and capacity is ignored. Returns NULL if the segment cannot be
+ * opened or mapped, is owned by another user or open to group or others, or
+ * holds something other than a replay table.
+ *
+ * The segment is created readable and writable by its owner only. Creation is
+ * serialized with flock(), which the kernel drops if the creator dies, and a
+ * table whose creator died before finishing is set up by the next opener.
+ * Users whose last code is too old to be accepted again are reclaimed, so
+ * capacity only needs to cover the users logging in within a window; make it
+ * about twice that, as a user's entry must lie within REPLAY_TABLE_PROBES
+ * buckets of its hash.
+ */
+
+void replay_table_close(struct replay_table* table);
+/* replay_table_close: unmaps the table. The segment and its contents stay. */
+
+int replay_table_unlink(const char* name);
+/* replay_table_unlink: removes the segment name, as shm_unlink. Processes that
+ * have it open keep using it; the next replay_table_open starts a new one.
+ */
+
+uint64_t replay_table_last(struct replay_table* table, uint64_t user);
+/* replay_table_last: the last counter accepted for user, or 0 if none is
+ * recorded.
+ */
+
+int replay_table_commit(struct replay_table* table, uint64_t user,
+		uint64_t counter, uint64_t oldest);
+/* replay_table_commit: records that a code for counter was accepted for user.
+ * Returns TOTP_VERIFY_OK if counter is later than every counter recorded for
+ * the user, TOTP_VERIFY_REPLAYED if it is not, and REPLAY_TABLE_FULL if the
+ * user has no entry and none can be claimed, or counter is 2^32 or more.
+ * When processes race to commit the same counter at most one gets
+ * TOTP_VERIFY_OK. If the user has no entry yet and two processes add it at
+ * the same moment, both may get TOTP_VERIFY_REPLAYED, and the user has to
+ * enter the next code.
+ *
+ * user - any 64 bit value naming the user, e.g. an account id or ratelimit_hash
+ * oldest - the earliest counter a code could still be accepted for; entries
+ *	    last used before it may be given to other users. Pass 0 to never
+ *	    reclaim entries (e.g. for HOTP counters).
+ */
+
+int totp_verify_shared(struct replay_table* table, uint64_t user,
+		const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits, uint32_t window);
+/* totp_verify_shared: totp_verify with the user's lastcounter kept in table
+ * rather than by the caller. Returns the result of totp_verify, or
+ * TOTP_VERIFY_REPLAYED if another process accepted the code (or a later one)
+ * first, or REPLAY_TABLE_FULL. Every process sharing a table must use the
+ * same timestep.
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "replay.h"
+#include "totp.h"
+
+static char tablename[64];
+
+int check_commit()
+{
+	replay_table_unlink(tablename);
+	struct replay_table* table = replay_table_open(tablename, 64);
+	struct replay_table* other = replay_table_open(tablename, 64);
+	if(!table || !other)
+	{
+		replay_table_close(table);
+		replay_table_close(other);
+		return -1;
+	}
+
+	int result = 0;
+	result |= replay_table_last(table, 5) != 0;
+	result |= replay_table_commit(table, 5, 100, 0) != TOTP_VERIFY_OK;
+	result |= replay_table_commit(table, 5, 100, 0) != TOTP_VERIFY_REPLAYED;
+	result |= replay_table_commit(table, 5, 99, 0) != TOTP_VERIFY_REPLAYED;
+	result |= replay_table_commit(table, 6, 100, 0) != TOTP_VERIFY_OK;
+
+	//A second mapping sees the same entries
+	result |= replay_table_last(other, 5) != 100;
+	result |= replay_table_commit(other, 5, 100, 0) != TOTP_VERIFY_REPLAYED;
+	result |= replay_table_commit(other, 5, 101, 0) != TOTP_VERIFY_OK;
+	result |= replay_table_last(table, 5) != 101;
+	result |= replay_table_commit(table, 5, (uint64_t) 1 << 32, 0) != REPLAY_TABLE_FULL;
+
+	replay_table_close(other);
+	replay_table_close(table);
+	replay_table_unlink(tablename);
+	return result ? -1 : 0;
+}
+
+int check_reclaim()
+{
+	//Eight entries: a ninth user only gets in once another's code is too
+	//old to be accepted again
+	replay_table_unlink(tablename);
+	struct replay_table* table = replay_table_open(tablename, REPLAY_TABLE_WAYS);
+	if(!table)
+	{
+		return -1;
+	}
+
+	int result = 0;
+	uint64_t user = 0;
+	for(; user < REPLAY_TABLE_WAYS; ++user)
+	{
+		result |= replay_table_commit(table, user, 10 + user, 0) != TOTP_VERIFY_OK;
+	}
+	result |= replay_table_commit(table, 100, 20, 10) != REPLAY_TABLE_FULL;
+	result |= replay_table_commit(table, 100, 20, 11) != TOTP_VERIFY_OK;
+	result |= replay_table_last(table, 0) != 0;
+	result |= replay_table_last(table, 1) != 11;
+	result |= replay_table_commit(table, 100, 20, 11) != TOTP_VERIFY_REPLAYED;
+
+	replay_table_close(table);
+	replay_table_unlink(tablename);
+	return result ? -1 : 0;
+}
+
+int check_verify_shared()
+{
+	replay_table_unlink(tablename);
+	struct replay_table* table = replay_table_open(tablename, 1024);
+	struct replay_table* other = replay_table_open(tablename, 1024);
+	if(!table || !other)
+	{
+		replay_table_close(table);
+		replay_table_close(other);
+		return -1;
+	}
+
+	const char* secret = "12345678901234567890";
+	time_t now = 1111111109;
+	int32_t code = compute_totp(secret, 20, now, 30, 6);
+	int32_t next = compute_totp(secret, 20, now + 30, 30, 6);
+
+	int result = 0;
+	result |= totp_verify_shared(table, 1, secret, 20, code, now, 30, 6, 1) != TOTP_VERIFY_OK;
+	result |= totp_verify_shared(other, 1, secret, 20, code, now, 30, 6, 1) != TOTP_VERIFY_REPLAYED;
+	result |= totp_verify_shared(other, 2, secret, 20, code, now, 30, 6, 1) != TOTP_VERIFY_OK;
+	result |= totp_verify_shared(other, 1, secret, 20, next, now, 30, 6, 1) != TOTP_VERIFY_OK;
+	result |= totp_verify_shared(table, 1, secret, 20, code, now, 30, 6, 1) != TOTP_VERIFY_REPLAYED;
+	result |= totp_verify_shared(table, 1, secret, 20, 0, now, 30, 6, 1) != TOTP_VERIFY_INVALID;
+
+	replay_table_close(other);
+	replay_table_close(table);
+	replay_table_unlink(tablename);
+	return result ? -1 : 0;
+}
+
+#define RACE_PROCESSES 4
+#define RACE_USERS 64
+#define RACE_COUNTERS 500
+
+int check_processes()
+{
+	//Processes commit the same codes at once; a shared bitmap catches any
+	//code accepted twice
+	replay_table_unlink(tablename);
+	size_t bits = RACE_USERS * (RACE_COUNTERS + 1);
+	uint8_t* accepted = (uint8_t*) mmap(0, bits, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(accepted == MAP_FAILED)
+	{
+		return -1;
+	}
+	memset(accepted, 0, bits);
+
+	pid_t children[RACE_PROCESSES];
+	int idx = 0, started = 0;
+	for(; idx < RACE_PROCESSES; ++idx)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+		{
+			struct replay_table* table = replay_table_open(tablename, 4 * RACE_USERS);
+			int failed = !table;
+			uint64_t counter = 1;
+			for(; table && counter <= RACE_COUNTERS; ++counter)
+			{
+				uint64_t user = 0;
+				for(; user < RACE_USERS; ++user)
+				{
+					int result = replay_table_commit(table, user, counter, 0);
+					if(result == TOTP_VERIFY_OK &&
+						__atomic_fetch_add(&accepted[user * (RACE_COUNTERS + 1) + counter], 1,
+								__ATOMIC_RELAXED))
+					{
+						failed = 1;
+					}
+					failed |= result != TOTP_VERIFY_OK && result != TOTP_VERIFY_REPLAYED;
+				}
+			}
+			replay_table_close(table);
+			_exit(failed);
+		}
+		if(pid > 0)
+		{
+			children[started++] = pid;
+		}
+	}
+
+	int result = started == RACE_PROCESSES ? 0 : -1;
+	for(idx = 0; idx < started; ++idx)
+	{
+		int status = 0;
+		if(waitpid(children[idx], &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != 0)
+		{
+			result = -1;
+		}
+	}
+
+	//Every user's last counter was accepted by someone
+	struct replay_table* table = replay_table_open(tablename, 4 * RACE_USERS);
+	uint64_t user = 0;
+	for(; table && user < RACE_USERS; ++user)
+	{
+		if(replay_table_last(table, user) != RACE_COUNTERS ||
+			!accepted[user * (RACE_COUNTERS + 1) + RACE_COUNTERS])
+		{
+			result = -1;
+		}
+	}
+	result |= table ? 0 : -1;
+
+	replay_table_close(table);
+	replay_table_unlink(tablename);
+	munmap(accepted, bits);
+	return result;
+}
+
+int check_crash()
+{
+	//A process killed while using the table leaves it usable
+	replay_table_unlink(tablename);
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		struct replay_table* table = replay_table_open(tablename, 256);
+		uint64_t counter = 1;
+		for(; table; ++counter)
+		{
+			replay_table_commit(table, counter % 16, counter, 0);
+			if(counter == 1000)
+			{
+				raise(SIGKILL);
+			}
+		}
+		_exit(1);
+	}
+	int status = 0;
+	if(pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFSIGNALED(status))
+	{
+		return -1;
+	}
+
+	struct replay_table* table = replay_table_open(tablename, 256);
+	if(!table)
+	{
+		return -1;
+	}
+	int result = 0;
+	result |= replay_table_last(table, 0) != 992;
+	result |= replay_table_commit(table, 0, 992, 0) != TOTP_VERIFY_REPLAYED;
+	result |= replay_table_commit(table, 0, 1001, 0) != TOTP_VERIFY_OK;
+	replay_table_close(table);
+	replay_table_unlink(tablename);
+
+	//A segment sized by a creator that died before writing the header is
+	//set up by the next opener; one holding something else is refused
+	int fd = shm_open(tablename, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0 || ftruncate(fd, 64 + 64 * 16) < 0)
+	{
+		result = -1;
+	}
+	table = replay_table_open(tablename, 0);
+	result |= !table || replay_table_commit(table, 3, 7, 0) != TOTP_VERIFY_OK;
+	replay_table_close(table);
+
+	//A table others may open is refused until it is private again
+	if(fd >= 0 && fchmod(fd, 0660) < 0)
+	{
+		result = -1;
+	}
+	table = replay_table_open(tablename, 0);
+	result |= table ? -1 : 0;
+	replay_table_close(table);
+	if(fd >= 0 && fchmod(fd, 0600) < 0)
+	{
+		result = -1;
+	}
+	table = replay_table_open(tablename, 0);
+	result |= !table || replay_table_last(table, 3) != 7;
+	replay_table_close(table);
+
+	if(fd >= 0 && pwrite(fd, "garbage!", 8, 0) != 8)
+	{
+		result = -1;
+	}
+	table = replay_table_open(tablename, 0);
+	result |= table ? -1 : 0;
+	replay_table_close(table);
+	if(fd >= 0)
+	{
+		close(fd);
+	}
+	replay_table_unlink(tablename);
+	return result ? -1 : 0;
+}
+
+int main(void)
+{
+	snprintf(tablename, sizeof(tablename), "/replaytest-%d", (int) getpid());
+
+	int commitfailed = check_commit() < 0;
+	printf("Commit test %s.\n", commitfailed ? "failed" : "passed");
+	int reclaimfailed = check_reclaim() < 0;
+	printf("Reclaim test %s.\n", reclaimfailed ? "failed" : "passed");
+	int verifyfailed = check_verify_shared() < 0;
+	printf("Shared verify test %s.\n", verifyfailed ? "failed" : "passed");
+	int processesfailed = check_processes() < 0;
+	printf("Process race test %s.\n", processesfailed ? "failed" : "passed");
+	int crashfailed = check_crash() < 0;
+	printf("Crash test %s.\n", crashfailed ? "failed" : "passed");
+
+	return commitfailed || reclaimfailed || verifyfailed || processesfailed || crashfailed ?
+		EXIT_FAILURE : EXIT_SUCCESS;
+}
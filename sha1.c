@@ -24,6 +24,7 @@ A million repetitions of "a"
 #include <stdint.h>
 
 #include "sha1.h"
+#include "usdt.h"
 
 
 #define rol(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
@@ -213,11 +214,13 @@ void SHA1Update(
     if ((j + len) > 63)
     {
         memcpy(&context->buffer[j], data, (i = 64 - j));
+        MUTOTP_PROBE1(sha1_blocks_entry, 1 + (len - i) / 64);
         SHA1Transform(context->state, context->buffer);
         for (; i + 63 < len; i += 64)
         {
             SHA1Transform(context->state, &data[i]);
         }
+        MUTOTP_PROBE1(sha1_blocks_return, 1 + (len - (64 - j)) / 64);
         j = 0;
     }
     else
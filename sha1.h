@@ -9,6 +9,11 @@
 
 #include "stdint.h"
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 typedef struct
 {
     uint32_t state[5];
@@ -41,4 +46,8 @@ void SHA1(
     const char *str,
     int len);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* SHA1_H */
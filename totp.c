@@ -25,7 +25,17 @@
 
 #include "sha1.h"
 #include "base32codec.h"
-#include "qrcode/qrcode.h"
+#include "csprng.h"
+#include "metrics.h"
+#include "usdt.h"
+#include "qrcode/qrcode_dispatch.h"
+
+//Size of a v5 module grid, the largest create_totp_qrcode makes
+#define QRCODE_BUFFER_SIZE_V5 (((37 * 37) + 7) / 8)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOTP_X86
+#endif
 
 void totpuri_init(struct totpuri* uri, const char* label, const char* issuer,
 		const char* secret)
@@ -35,70 +45,133 @@ void totpuri_init(struct totpuri* uri, const char* label, const char* issuer,
 	//The uri format string text alone takes up 33 characters
 	//The maximum length of the URI is 106 characters in a version 5 QR code
 
-	snprintf(uri->label, sizeof(uri->label), label);
-	snprintf(uri->secret, sizeof(uri->secret), secret);
-	snprintf(uri->issuer, sizeof(uri->issuer), issuer);
+	snprintf(uri->label, sizeof(uri->label), "%s", label);
+	snprintf(uri->secret, sizeof(uri->secret), "%s", secret);
+	snprintf(uri->issuer, sizeof(uri->issuer), "%s", issuer);
 	snprintf(uri->uristr, sizeof(uri->uristr), "otpauth://totp/%s?secret=%s&issuer=%s",
 		uri->label, uri->secret, uri->issuer);
 }
 
-char* create_totp_qrcode(const char* label, const char* issuer, const char* secret)
+static int32_t encode_totp_qrcode(QRCode* qrcode, uint8_t* modules,
+		const struct totpuri* uri, qrcode_workspace* workspace)
 {
-	QRCode qrcode;
+	//Most URIs fit in a v4 code; long labels and issuers need v5
 	uint8_t qrcodever = 4;
-	size_t qrcodelen = qrcode_getBufferSize(qrcodever);
-	uint8_t* qrcodedata = (char*) malloc(qrcodelen);
-
-	struct totpuri uri;
-	totpuri_init(&uri, label, issuer, secret);
-	qrcode_initText(&qrcode, qrcodedata, qrcodever, ECC_LOW, uri.uristr);
+	for(; qrcodever <= 5; ++qrcodever)
+	{
+		if(qrcode_initTextDispatch(qrcode, modules, qrcodever,
+				ECC_LOW, uri->uristr, workspace) == 0)
+		{
+			return 0;
+		}
+	}
+	METRICS_COUNT(METRICS_QRCODE_FAILURES, 1);
+	return -1;
+}
 
-	uint8_t y = 0, x = 0;
-	uint32_t i = 0;
+static size_t ansi_qrcode_size(const QRCode* qrcode)
+{
+	//Two spaces plus at most one 5 byte escape per module
+	return (7 * qrcode->size * qrcode->size) + 1;
+}
 
-	static const char* rev = "\x1B[07m";
-	static const char* def = "\x1B[0m";
+static size_t render_ansi_qrcode(const QRCode* qrcode, char* out)
+{
+	static const char rev[] = "\x1B[07m";
+	static const char def[] = "\x1B[0m";
 
-	size_t qrcodeansilen = (7 * qrcode.size * qrcode.size) + 1;
-	uint8_t* qrcodeansi = (char*) malloc(qrcodeansilen);
-	memset(qrcodeansi, 0 , qrcodeansilen);
+	uint8_t y = 0, x = 0;
 	size_t idx = 0;
 	uint8_t lastansi = 0;
-	for(y = 0; y < qrcode.size; ++y)
+	MUTOTP_PROBE1(ansi_render_entry, qrcode->size);
+#ifdef QRCODE_PROFILE
+	uint64_t profilestart = qrcode_profileNow();
+#endif
+	for(y = 0; y < qrcode->size; ++y)
 	{
-		for(x = 0; x < qrcode.size; ++x)
+		for(x = 0; x < qrcode->size; ++x)
 		{
-			if(qrcode_getModule(&qrcode, x, y))
-			{
-				idx += snprintf(&qrcodeansi[idx], qrcodeansilen - idx, "%s  ",
-						1 == lastansi ? "" : rev);
-				lastansi = 1;
-			}
-			else
+			uint8_t dark = qrcode_getModule((QRCode*) qrcode, x, y) ? 1 : 0;
+			if(dark != lastansi)
 			{
-				idx += snprintf(&qrcodeansi[idx], qrcodeansilen - idx, "%s  ",
-						0 == lastansi ? "" : def);
-				lastansi = 0;
+				const char* esc = dark ? rev : def;
+				size_t esclen = dark ? sizeof(rev) - 1 : sizeof(def) - 1;
+				memcpy(&out[idx], esc, esclen);
+				idx += esclen;
+				lastansi = dark;
 			}
+			out[idx++] = ' ';
+			out[idx++] = ' ';
 		}
-		idx += snprintf(&qrcodeansi[idx], qrcodeansilen - idx, "\n");
+		out[idx++] = '\n';
 	}
-	idx += snprintf(&qrcodeansi[idx], qrcodeansilen - idx, "%s", def);
+	memcpy(&out[idx], def, sizeof(def));
+#ifdef QRCODE_PROFILE
+	qrcode_profileAdd(QRCODE_STAGE_RENDER, qrcode_profileNow() - profilestart);
+#endif
+	MUTOTP_PROBE1(ansi_render_return, idx + sizeof(def) - 1);
+	return idx + sizeof(def) - 1;
+}
 
-	free(qrcodedata);
-	return qrcodeansi;
+int32_t totp_render_qrcode_ansi(const QRCode* qrcode, char* out, size_t outlen)
+{
+	if(outlen < ansi_qrcode_size(qrcode))
+	{
+		return -1;
+	}
+	return render_ansi_qrcode(qrcode, out);
+}
+
+int32_t totpuri_render_ansi(const struct totpuri* uri, char* out, size_t outlen,
+		struct qrcode_workspace* workspace)
+{
+	METRICS_START(start);
+	QRCode qrcode;
+	uint8_t qrcodedata[QRCODE_BUFFER_SIZE_V5];
+
+	if(encode_totp_qrcode(&qrcode, qrcodedata, uri, workspace) < 0)
+	{
+		return -1;
+	}
+
+	int32_t result = totp_render_qrcode_ansi(&qrcode, out, outlen);
+	if(result >= 0)
+	{
+		METRICS_COUNT(METRICS_QRCODE_RENDERS, 1);
+		METRICS_TIME(METRICS_TIME_QRCODE, start);
+	}
+	return result;
 }
 
-static time_t flip_ts_endianness(time_t timestamp)
+char* create_totp_qrcode(const char* label, const char* issuer, const char* secret)
 {
-	size_t idx = 0, len = sizeof(time_t);
-	time_t output = 0;
-	char* pOutput = (char*) &output;
-	for(; idx < len; ++idx)
+	METRICS_START(start);
+	QRCode qrcode;
+	uint8_t qrcodedata[QRCODE_BUFFER_SIZE_V5];
+
+	uint8_t workspacebytes[QRCODE_WORKSPACE_SIZE(5)];
+	qrcode_workspace workspace;
+	qrcode_initWorkspace(&workspace, workspacebytes, 5);
+
+	struct totpuri uri;
+	totpuri_init(&uri, label, issuer, secret);
+	if(encode_totp_qrcode(&qrcode, qrcodedata, &uri, &workspace) < 0)
 	{
-		pOutput[idx] = (timestamp >> ((len - idx - 1) << 3)) & 0xff;
+		return 0;
 	}
-	return output;
+
+	size_t qrcodeansilen = ansi_qrcode_size(&qrcode);
+	char* qrcodeansi = (char*) malloc(qrcodeansilen);
+	if(!qrcodeansi)
+	{
+		return 0;
+	}
+	memset(qrcodeansi, 0, qrcodeansilen);
+	render_ansi_qrcode(&qrcode, qrcodeansi);
+
+	METRICS_COUNT(METRICS_QRCODE_RENDERS, 1);
+	METRICS_TIME(METRICS_TIME_QRCODE, start);
+	return qrcodeansi;
 }
 
 int generate_random_secret(char* out, size_t outlen, int32_t (*rgen)(uint8_t*, size_t))
@@ -112,36 +185,35 @@ int generate_random_secret(char* out, size_t outlen, int32_t (*rgen)(uint8_t*, s
 
 	uint8_t secret[20] = {0};
 
-	if(rgen(secret, 20) < 0)
+	if((rgen ? rgen : csprng_fill)(secret, 20) < 0)
 	{
 		return -1;
 	}
 
-	return base32encode(secret, 20, out, outlen);
+	int32_t result = base32encode((const char*) secret, 20, out, outlen);
+	memset(secret, 0, sizeof(secret));
+	return result;
 }
 
-int32_t compute_totp(const char* secret, size_t secretlen,
-		time_t timestamp, size_t timestep, size_t digits)
+static const int32_t ddivisor[] =
 {
-	static const int32_t ddivisor[] =
-	{
-		1, 10, 100, 1000, 10000, 100000, 1000000,
-		10000000, 100000000
-	};
+	1, 10, 100, 1000, 10000, 100000, 1000000,
+	10000000, 100000000
+};
 
-	if(digits >= sizeof(ddivisor)/sizeof(uint32_t))
+static int32_t totp_at_counter(const struct hmacsha1_key* key,
+		uint64_t counter, size_t digits)
+{
+	//RFC 4226 HOTP value of the big endian 64 bit counter
+	uint8_t result[HMACSHA1_DIGEST_SIZE];
+	uint8_t counterbe[8];
+	size_t idx = 0;
+	for(; idx < 8; ++idx)
 	{
-		return -1;
+		counterbe[idx] = counter >> (56 - 8 * idx);
 	}
 
-	uint8_t result[20] = {0};
-	uint8_t hexstr[41] = {0};
-	time_t counter = timestamp / timestep;
-	//TODO: This only needs to be done on little endian machines
-	time_t counterbe = flip_ts_endianness(counter);
-
-	hmacsha1(result, secret, secretlen,
-		(char*) &counterbe, sizeof(time_t));
+	hmacsha1_key_mac(key, (char*) result, (const char*) counterbe, sizeof(counterbe));
 
 	int32_t offset = result[19] & 0x0f;
 	int32_t truncated = ((result[offset] & 0x7f) << 24) |
@@ -152,49 +224,585 @@ int32_t compute_totp(const char* secret, size_t secretlen,
 	return truncated % ddivisor[digits];
 }
 
-#ifndef min
-#define min(a, b) (a < b ? a : b)
+//Window searches compute HOTP_LANES consecutive counters at a time, one per
+//lane of a vector: both HMAC blocks of a counter (8 byte message) fit in a
+//single SHA1 block each, so every lane runs the same two compressions
+#define HOTP_LANES 8
+
+typedef uint32_t hotp_lanes __attribute__((vector_size(4 * HOTP_LANES)));
+
+#define LANES_ROL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+static inline __attribute__((always_inline)) void sha1_lanes_block(hotp_lanes state[5],
+		hotp_lanes w[16])
+{
+	hotp_lanes a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+	int t = 0;
+#pragma GCC unroll 80
+	for(; t < 80; ++t)
+	{
+		if(t >= 16)
+		{
+			w[t & 15] = LANES_ROL(w[(t + 13) & 15] ^ w[(t + 8) & 15] ^
+					w[(t + 2) & 15] ^ w[t & 15], 1);
+		}
+		hotp_lanes f;
+		uint32_t k;
+		if(t < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		}
+		else if(t < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		}
+		else if(t < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		hotp_lanes temp = LANES_ROL(a, 5) + f + e + k + w[t & 15];
+		e = d;
+		d = c;
+		c = LANES_ROL(b, 30);
+		b = a;
+		a = temp;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+static inline __attribute__((always_inline)) void hotp_lanes_codes(const struct hmacsha1_key* key,
+		uint64_t first, size_t digits, int32_t* codes)
+{
+	hotp_lanes zero = {0};
+	hotp_lanes w[16], state[5];
+	size_t idx = 0, lane = 0;
+
+	//Inner block: the counter, then padding for a 64 + 8 byte message
+	for(idx = 2; idx < 16; ++idx)
+	{
+		w[idx] = zero;
+	}
+	for(lane = 0; lane < HOTP_LANES; ++lane)
+	{
+		w[0][lane] = (first + lane) >> 32;
+		w[1][lane] = (uint32_t) (first + lane);
+	}
+	w[2] = zero + 0x80000000;
+	w[15] = zero + (64 + 8) * 8;
+	for(idx = 0; idx < 5; ++idx)
+	{
+		state[idx] = zero + key->istate[idx];
+	}
+	sha1_lanes_block(state, w);
+
+	//Outer block: the inner digest, then padding for a 64 + 20 byte message
+	for(idx = 0; idx < 5; ++idx)
+	{
+		w[idx] = state[idx];
+		state[idx] = zero + key->ostate[idx];
+	}
+	for(idx = 5; idx < 16; ++idx)
+	{
+		w[idx] = zero;
+	}
+	w[5] = zero + 0x80000000;
+	w[15] = zero + (64 + HMACSHA1_DIGEST_SIZE) * 8;
+	sha1_lanes_block(state, w);
+
+	for(lane = 0; lane < HOTP_LANES; ++lane)
+	{
+		uint8_t mac[HMACSHA1_DIGEST_SIZE];
+		for(idx = 0; idx < HMACSHA1_DIGEST_SIZE; ++idx)
+		{
+			mac[idx] = state[idx / 4][lane] >> (24 - 8 * (idx % 4));
+		}
+		int32_t offset = mac[19] & 0x0f;
+		int32_t truncated = ((mac[offset] & 0x7f) << 24) | (mac[offset + 1] << 16) |
+			(mac[offset + 2] << 8) | mac[offset + 3];
+		codes[lane] = truncated % ddivisor[digits];
+	}
+}
+
+static void hotp_batch_generic(const struct hmacsha1_key* key, uint64_t first,
+		size_t digits, int32_t* codes)
+{
+	hotp_lanes_codes(key, first, digits, codes);
+}
+
+#ifdef TOTP_X86
+__attribute__((target("avx2")))
+static void hotp_batch_avx2(const struct hmacsha1_key* key, uint64_t first,
+		size_t digits, int32_t* codes)
+{
+	hotp_lanes_codes(key, first, digits, codes);
+}
 #endif
 
-void hmacsha1(char* output, const char* key, size_t key_len, const char* message, size_t message_len)
+typedef void (*hotp_batch_fn)(const struct hmacsha1_key*, uint64_t, size_t, int32_t*);
+
+static hotp_batch_fn active_hotp_batch = 0;
+
+static hotp_batch_fn hotp_batch(void)
+{
+	hotp_batch_fn batch = __atomic_load_n(&active_hotp_batch, __ATOMIC_ACQUIRE);
+	if(!batch)
+	{
+		batch = hotp_batch_generic;
+#ifdef TOTP_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2"))
+		{
+			batch = hotp_batch_avx2;
+		}
+#endif
+		__atomic_store_n(&active_hotp_batch, batch, __ATOMIC_RELEASE);
+	}
+	return batch;
+}
+
+static int hotp_find(const struct hmacsha1_key* key, uint64_t first, uint64_t count,
+		size_t digits, int32_t code, int32_t next, uint64_t* matched)
+{
+	//Finds the first counter in [first, first + count) whose code is code
+	//and, when next is not negative, whose successor's code is next. Every
+	//counter is computed whether or not one matched, so the time taken does
+	//not depend on where the match was.
+	hotp_batch_fn batch = hotp_batch();
+	uint64_t total = next < 0 ? count : count + 1;
+	int32_t codes[HOTP_LANES];
+	int32_t prev = -1;
+	int found = 0;
+	uint64_t base = 0;
+	for(; base < total; base += HOTP_LANES)
+	{
+		MUTOTP_PROBE1(sha1_blocks_entry, 2 * HOTP_LANES);
+		batch(key, first + base, digits, codes);
+		MUTOTP_PROBE1(sha1_blocks_return, 2 * HOTP_LANES);
+		size_t lane = 0;
+		for(; lane < HOTP_LANES && base + lane < total; ++lane)
+		{
+			uint64_t at = first + base + lane;
+			int match = next < 0 ? codes[lane] == code :
+				base + lane > 0 && prev == code && codes[lane] == next;
+			at = next < 0 ? at : at - 1;
+			*matched = match && !found ? at : *matched;
+			found |= match;
+			prev = codes[lane];
+		}
+	}
+	METRICS_COUNT(METRICS_HMACS, (total + HOTP_LANES - 1) / HOTP_LANES * HOTP_LANES);
+	return found;
+}
+
+int32_t compute_hotp(const char* secret, size_t secretlen, uint64_t counter, size_t digits)
+{
+	if(digits >= sizeof(ddivisor)/sizeof(ddivisor[0]))
+	{
+		return -1;
+	}
+
+	struct hmacsha1_key key;
+	hmacsha1_key_init(&key, secret, secretlen);
+	int32_t hotp = totp_at_counter(&key, counter, digits);
+	hmacsha1_key_wipe(&key);
+	return hotp;
+}
+
+static int hotp_check(const char* secret, size_t secretlen, int32_t code, int32_t next,
+		size_t digits, uint32_t lookahead, uint64_t* counter)
+{
+	if(digits >= sizeof(ddivisor)/sizeof(ddivisor[0]) || code < 0 || !counter ||
+		*counter > UINT64_MAX - lookahead - 2)
+	{
+		return TOTP_VERIFY_INVALID;
+	}
+
+	struct hmacsha1_key key;
+	hmacsha1_key_init(&key, secret, secretlen);
+	uint64_t matched = 0;
+	int found = hotp_find(&key, *counter, (uint64_t) lookahead + 1, digits, code, next, &matched);
+	hmacsha1_key_wipe(&key);
+
+	if(!found)
+	{
+		return TOTP_VERIFY_INVALID;
+	}
+	*counter = matched + (next < 0 ? 1 : 2);
+	return TOTP_VERIFY_OK;
+}
+
+int hotp_verify(const char* secret, size_t secretlen, int32_t code, size_t digits,
+		uint32_t lookahead, uint64_t* counter)
+{
+	return hotp_check(secret, secretlen, code, -1, digits, lookahead, counter);
+}
+
+int hotp_resync(const char* secret, size_t secretlen, int32_t code, int32_t nextcode,
+		size_t digits, uint32_t lookahead, uint64_t* counter)
+{
+	if(nextcode < 0)
+	{
+		return TOTP_VERIFY_INVALID;
+	}
+	return hotp_check(secret, secretlen, code, nextcode, digits, lookahead, counter);
+}
+
+int32_t compute_totp(const char* secret, size_t secretlen,
+		time_t timestamp, size_t timestep, size_t digits)
+{
+	if(digits >= sizeof(ddivisor)/sizeof(ddivisor[0]) || !timestep)
+	{
+		return -1;
+	}
+
+	METRICS_START(start);
+	MUTOTP_PROBE2(compute_totp_entry, timestep, digits);
+	struct hmacsha1_key key;
+	hmacsha1_key_init(&key, secret, secretlen);
+	int32_t totp = totp_at_counter(&key, timestamp / timestep, digits);
+	hmacsha1_key_wipe(&key);
+	MUTOTP_PROBE1(compute_totp_return, totp);
+	METRICS_COUNT(METRICS_TOTP_COMPUTED, 1);
+	METRICS_TIME(METRICS_TIME_COMPUTE_TOTP, start);
+	return totp;
+}
+
+static int verify_outcome(int found, uint64_t matched, uint64_t* lastcounter)
+{
+	if(!found)
+	{
+		METRICS_COUNT(METRICS_VERIFY_WINDOW_MISSES, 1);
+		return TOTP_VERIFY_INVALID;
+	}
+	if(lastcounter && matched <= *lastcounter)
+	{
+		METRICS_COUNT(METRICS_VERIFY_REPLAYS, 1);
+		return TOTP_VERIFY_REPLAYED;
+	}
+	if(lastcounter)
+	{
+		*lastcounter = matched;
+	}
+	METRICS_COUNT(METRICS_VERIFY_OK, 1);
+	return TOTP_VERIFY_OK;
+}
+
+int totp_verify(const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter)
+{
+	METRICS_START(start);
+	METRICS_COUNT(METRICS_VERIFICATIONS, 1);
+	MUTOTP_PROBE2(totp_verify_entry, window, digits);
+	if(digits >= sizeof(ddivisor)/sizeof(ddivisor[0]) || !timestep || code < 0 ||
+		timestamp < 0)
+	{
+		METRICS_COUNT(METRICS_VERIFY_WINDOW_MISSES, 1);
+		MUTOTP_PROBE2(totp_verify_return, TOTP_VERIFY_INVALID, 0);
+		return TOTP_VERIFY_INVALID;
+	}
+
+	//The key is padded and hashed once for the whole window, whose steps
+	//are computed in batches
+	struct hmacsha1_key key;
+	hmacsha1_key_init(&key, secret, secretlen);
+	uint64_t counter = timestamp / timestep;
+	uint64_t first = counter > window ? counter - window : 0;
+	uint64_t matched = 0;
+	int found = hotp_find(&key, first, counter + window - first + 1, digits, code, -1, &matched);
+	hmacsha1_key_wipe(&key);
+
+	int result = verify_outcome(found, matched, lastcounter);
+	MUTOTP_PROBE2(totp_verify_return, result, found ? (int64_t) (matched - counter) : 0);
+	METRICS_TIME(METRICS_TIME_VERIFY, start);
+	return result;
+}
+
+//Drift estimates are fixed point, in 1/TOTP_DRIFT_ONE steps
+#define TOTP_DRIFT_ONE 256
+
+int32_t totp_drift_steps(const struct totp_drift* drift)
+{
+	//Rounded to the nearest step, halves away from zero
+	int32_t offset = drift->offset;
+	return offset >= 0 ? (offset + TOTP_DRIFT_ONE / 2) / TOTP_DRIFT_ONE :
+		-((-offset + TOTP_DRIFT_ONE / 2) / TOTP_DRIFT_ONE);
+}
+
+static void totp_drift_update(struct totp_drift* drift, int64_t steps)
+{
+	//The first sample is taken as is, later ones are smoothed with an
+	//exponentially weighted moving average (weight 1/4 for the new sample)
+	//Offsets are clamped to what the fixed point field holds, which is still
+	//millions of steps; the arithmetic is 64 bit so neither can overflow
+	const int64_t maxsteps = INT32_MAX / TOTP_DRIFT_ONE;
+	steps = steps > maxsteps ? maxsteps : steps < -maxsteps ? -maxsteps : steps;
+	int64_t sample = steps * TOTP_DRIFT_ONE;
+	drift->offset = (int32_t) (drift->samples ?
+		drift->offset + (sample - drift->offset) / 4 : sample);
+	drift->samples += drift->samples < UINT32_MAX;
+}
+
+int totp_verify_drift(const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter, struct totp_drift* drift)
+{
+	METRICS_START(start);
+	METRICS_COUNT(METRICS_VERIFICATIONS, 1);
+	MUTOTP_PROBE2(totp_verify_entry, window, digits);
+	if(digits >= sizeof(ddivisor)/sizeof(ddivisor[0]) || !timestep || code < 0 ||
+		timestamp < 0 || window > INT32_MAX)
+	{
+		METRICS_COUNT(METRICS_VERIFY_WINDOW_MISSES, 1);
+		MUTOTP_PROBE2(totp_verify_return, TOTP_VERIFY_INVALID, 0);
+		return TOTP_VERIFY_INVALID;
+	}
+
+	uint64_t counter = timestamp / timestep;
+	int64_t lowest = counter > window ? -(int64_t) window : -(int64_t) counter;
+	int64_t expected = drift ? totp_drift_steps(drift) : 0;
+	expected = expected < lowest ? lowest : expected > window ? window : expected;
+
+	//The expected step, then its neighbours, and only then the rest of the
+	//window in batches
+	struct hmacsha1_key key;
+	hmacsha1_key_init(&key, secret, secretlen);
+	const int64_t probes[3] = {expected, expected - 1, expected + 1};
+	uint64_t matched = 0;
+	int found = 0;
+	size_t idx = 0;
+	for(; idx < 3 && !found; ++idx)
+	{
+		if(probes[idx] < lowest || probes[idx] > window)
+		{
+			continue;
+		}
+		uint64_t step = counter + probes[idx];
+		found = totp_at_counter(&key, step, digits) == code;
+		matched = step;
+	}
+	if(!found)
+	{
+		METRICS_COUNT(METRICS_VERIFY_WIDENED, 1);
+		uint64_t first = counter + lowest;
+		found = hotp_find(&key, first, counter + window - first + 1, digits, code, -1, &matched);
+	}
+	hmacsha1_key_wipe(&key);
+
+	int result = verify_outcome(found, matched, lastcounter);
+	if(result == TOTP_VERIFY_OK && drift)
+	{
+		totp_drift_update(drift, (int64_t) (matched - counter));
+	}
+	MUTOTP_PROBE2(totp_verify_return, result, found ? (int64_t) (matched - counter) : 0);
+	METRICS_TIME(METRICS_TIME_VERIFY, start);
+	return result;
+}
+
+static const uint32_t sha1_iv[5] =
 {
-	char okeypad[64] = {0};
-	char ikeypad[64] = {0};
-	char keybuf[128] = {0};
-	memcpy(keybuf, key, min(128, key_len));
+	0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
 
-	if(strnlen(keybuf, 128) > 64)
+static void sha1_state_digest(const uint32_t state[5], uint8_t* digest)
+{
+	size_t idx = 0;
+	for(; idx < 20; ++idx)
 	{
-		//Hash a key which is longer than the SHA1 block size (64 bytes)
-		char keyout[128] = {0};
-		SHA1(keyout, keybuf, strnlen(keybuf, 128));
-		memset(keybuf, 0, 128);
-		memcpy(keybuf, keyout, 128);
+		digest[idx] = state[idx / 4] >> (24 - 8 * (idx % 4));
 	}
+}
 
+static void sha1_last_block(uint32_t state[5], const uint8_t* data, size_t len,
+		uint64_t totalbits)
+{
+	//Pads and hashes the final len (< 56) bytes of a message as one block
+	uint8_t block[64] = {0};
+	memcpy(block, data, len);
+	block[len] = 0x80;
 	size_t idx = 0;
-	for(; idx < 16; ++idx)
+	for(; idx < 8; ++idx)
+	{
+		block[56 + idx] = totalbits >> (56 - 8 * idx);
+	}
+	MUTOTP_PROBE1(sha1_blocks_entry, 1);
+	SHA1Transform(state, block);
+	MUTOTP_PROBE1(sha1_blocks_return, 1);
+	memset(block, 0, sizeof(block));
+}
+
+static void sha1_update_long(SHA1_CTX* ctx, const char* data, size_t len)
+{
+	//SHA1Update takes 32 bit lengths
+	while(len)
+	{
+		uint32_t chunk = len > 0x10000000 ? 0x10000000 : (uint32_t) len;
+		SHA1Update(ctx, (const unsigned char*) data, chunk);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+void hmacsha1_key_init(struct hmacsha1_key* key, const char* secret, size_t secretlen)
+{
+	uint8_t keyblock[64] = {0};
+	if(secretlen > 64)
+	{
+		//Keys longer than the SHA1 block size are hashed first (RFC 2104)
+		SHA1_CTX ctx;
+		SHA1Init(&ctx);
+		sha1_update_long(&ctx, secret, secretlen);
+		SHA1Final(keyblock, &ctx);
+		memset(&ctx, 0, sizeof(ctx));
+	}
+	else if(secretlen)
+	{
+		memcpy(keyblock, secret, secretlen);
+	}
+
+	uint8_t pad[64];
+	size_t idx = 0;
+	for(; idx < 64; ++idx)
+	{
+		pad[idx] = keyblock[idx] ^ 0x36;
+	}
+	MUTOTP_PROBE1(sha1_blocks_entry, 2);
+	memcpy(key->istate, sha1_iv, sizeof(sha1_iv));
+	SHA1Transform(key->istate, pad);
+
+	for(idx = 0; idx < 64; ++idx)
+	{
+		pad[idx] = keyblock[idx] ^ 0x5c;
+	}
+	memcpy(key->ostate, sha1_iv, sizeof(sha1_iv));
+	SHA1Transform(key->ostate, pad);
+	MUTOTP_PROBE1(sha1_blocks_return, 2);
+
+	memset(pad, 0, sizeof(pad));
+	memset(keyblock, 0, sizeof(keyblock));
+}
+
+static void hmacsha1_midstate_mac(const struct hmacsha1_key* key, char* output,
+		const char* message, size_t message_len)
+{
+	METRICS_COUNT(METRICS_HMACS, 1);
+	uint8_t inner[HMACSHA1_DIGEST_SIZE];
+	uint32_t state[5];
+
+	//Hash(ikeypad + message), resuming after the key block
+	if(message_len < 56)
+	{
+		memcpy(state, key->istate, sizeof(state));
+		sha1_last_block(state, (const uint8_t*) message, message_len,
+				(64 + (uint64_t) message_len) * 8);
+		sha1_state_digest(state, inner);
+	}
+	else
 	{
-		((unsigned int*) okeypad)[idx] = ((unsigned int*) keybuf)[idx] ^ 0x5c5c5c5c;
-		((unsigned int*) ikeypad)[idx] = ((unsigned int*) keybuf)[idx] ^ 0x36363636;
+		SHA1_CTX ctx;
+		memcpy(ctx.state, key->istate, sizeof(ctx.state));
+		ctx.count[0] = 512;
+		ctx.count[1] = 0;
+		sha1_update_long(&ctx, message, message_len);
+		SHA1Final(inner, &ctx);
+		memset(&ctx, 0, sizeof(ctx));
 	}
 
-	//bc = ikeypad + message
-	//a = okeypad + Hash(bc)
-	//HMAC = Hash(a)
+	//Hash(okeypad + inner digest), always a single block
+	memcpy(state, key->ostate, sizeof(state));
+	sha1_last_block(state, inner, sizeof(inner), (64 + sizeof(inner)) * 8);
+	sha1_state_digest(state, (uint8_t*) output);
 
-	size_t bc_len = 64 + message_len;
-	size_t a_len = 84; //64 + 20
-	char* bc = malloc(bc_len + 1);
-	char* a = malloc(a_len + 1);
+	memset(state, 0, sizeof(state));
+	memset(inner, 0, sizeof(inner));
+}
+
+void hmacsha1_key_mac(const struct hmacsha1_key* key, char* output,
+		const char* message, size_t message_len)
+{
+	//The key was padded and hashed beforehand, so its length is unknown
+	MUTOTP_PROBE2(hmacsha1_entry, 0, message_len);
+	hmacsha1_midstate_mac(key, output, message, message_len);
+	MUTOTP_PROBE(hmacsha1_return);
+}
 
-	memcpy(bc, ikeypad, 64);
-	memcpy(&bc[64], message, message_len);
+void hmacsha1_key_wipe(struct hmacsha1_key* key)
+{
+	//Volatile so that wiping a key about to go out of scope is not elided
+	volatile uint8_t* bytes = (volatile uint8_t*) key;
+	size_t idx = 0;
+	for(; idx < sizeof(struct hmacsha1_key); ++idx)
+	{
+		bytes[idx] = 0;
+	}
+}
 
-	memcpy(a, okeypad, 64);
-	SHA1(&a[64], bc, bc_len);
-	SHA1(output, a, a_len);
+void hmacsha1(char* output, const char* key, size_t key_len, const char* message, size_t message_len)
+{
+	MUTOTP_PROBE2(hmacsha1_entry, key_len, message_len);
+	struct hmacsha1_key ctx;
+	hmacsha1_key_init(&ctx, key, key_len);
+	hmacsha1_midstate_mac(&ctx, output, message, message_len);
+	hmacsha1_key_wipe(&ctx);
+	MUTOTP_PROBE(hmacsha1_return);
+}
 
-	free(a);
-	free(bc);
+int totp_derive_secret(const struct hmacsha1_key* master, const char* user, size_t userlen,
+		uint32_t generation, char* secret)
+{
+	//The generation has a fixed length at the end, so user || generation is
+	//never ambiguous. Short ids fit in the last block behind the midstate,
+	//making a derivation cost two SHA1 blocks.
+	uint8_t message[TOTP_DERIVE_USER_MAX + 4];
+	if(userlen > TOTP_DERIVE_USER_MAX)
+	{
+		return -1;
+	}
+	memcpy(message, user, userlen);
+	message[userlen] = generation >> 24;
+	message[userlen + 1] = generation >> 16;
+	message[userlen + 2] = generation >> 8;
+	message[userlen + 3] = generation;
+	hmacsha1_key_mac(master, secret, (const char*) message, userlen + 4);
+	return 0;
+}
+
+int totp_derive_secret_base32(const struct hmacsha1_key* master, const char* user,
+		size_t userlen, uint32_t generation, char* out, size_t outlen)
+{
+	char secret[HMACSHA1_DIGEST_SIZE];
+	if(outlen < 33 || totp_derive_secret(master, user, userlen, generation, secret) < 0)
+	{
+		return -1;
+	}
+	int32_t result = base32encode(secret, sizeof(secret), out, outlen);
+	memset(secret, 0, sizeof(secret));
+	return result;
+}
+
+int totp_verify_derived(const struct hmacsha1_key* master, const char* user, size_t userlen,
+		uint32_t generation, int32_t code, time_t timestamp, size_t timestep,
+		size_t digits, uint32_t window, uint64_t* lastcounter)
+{
+	char secret[HMACSHA1_DIGEST_SIZE];
+	if(totp_derive_secret(master, user, userlen, generation, secret) < 0)
+	{
+		return TOTP_VERIFY_INVALID;
+	}
+	int result = totp_verify(secret, sizeof(secret), code, timestamp, timestep,
+				digits, window, lastcounter);
+	memset(secret, 0, sizeof(secret));
+	return result;
 }
@@ -24,6 +24,11 @@
 #include <stddef.h>
 #include <time.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 struct totpuri
 {
 /* A Time-based One Time Password Uniform Resource Identifier
@@ -44,8 +49,34 @@ void totpuri_init(struct totpuri* uri, const char* label, const char* issuer,
  */
 
 
+struct qrcode_workspace;
+struct QRCode;
+
+#define TOTP_QRCODE_ANSI_MAX 9584
+/* Largest ANSI QR code graphic, including its null terminator (7 bytes per
+ * module of a v5 code plus one)
+ */
+
+int32_t totpuri_render_ansi(const struct totpuri* uri, char* out, size_t outlen,
+		struct qrcode_workspace* workspace);
+/* totpuri_render_ansi: writes the ANSI QR code graphic for a URI into out
+ * without allocating. Returns the length of the graphic or -1 on error.
+ *
+ * out - output buffer, null terminated on success
+ * outlen - size of out; TOTP_QRCODE_ANSI_MAX is always enough
+ * workspace - a QR encoder workspace sized for version 5 or more (see
+ *	       qrcode_initWorkspace), reused across calls by the same thread
+ */
+
+int32_t totp_render_qrcode_ansi(const struct QRCode* qrcode, char* out, size_t outlen);
+/* totp_render_qrcode_ansi: writes the ANSI graphic for an already encoded QR
+ * code of any version into out. Returns its length, or -1 if outlen is below
+ * 7 * size * size + 1 bytes (the most the graphic can take).
+ */
+
 char* create_totp_qrcode(const char* label, const char* issuer, const char* secret);
-/* create_totp_qrcode: generates an ANSI v4 QR code with a TOTP secret
+/* create_totp_qrcode: generates an ANSI v4 QR code with a TOTP secret (v5 if
+ * the URI is too long for v4)
  * label - null-terminated string. Descriptive label up to 16 + 1 characters long
  * issuer - null-terminated string. Name of issuer up to 16 + 1 characters long
 */
@@ -60,19 +91,151 @@ int32_t compute_totp(const char* secret, size_t secretlen,
  * timestep - how many seconds OTP should remain valid; almost always 30
  * digits - how many digits (1 - 8) should be in the OTP. 6 is common
  */
+#define TOTP_VERIFY_OK 0
+#define TOTP_VERIFY_INVALID -1
+#define TOTP_VERIFY_REPLAYED -2
+
+int totp_verify(const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter);
+/* totp_verify: checks an OTP entered by a user. Returns TOTP_VERIFY_OK if
+ * code is the OTP of a time step within window steps of timestamp's,
+ * TOTP_VERIFY_REPLAYED if it is, but for a step no later than *lastcounter,
+ * and TOTP_VERIFY_INVALID otherwise.
+ *
+ * secret, secretlen, timestep, digits - as for compute_totp
+ * window - steps accepted either side of the current one to allow for clock
+ *	    skew; 1 is common
+ * lastcounter - the user's last accepted time step, updated on success. Each
+ *		 OTP is then accepted only once. NULL disables replay checks.
+ */
+
+struct totp_drift
+{
+	int32_t offset;		//Smoothed offset of the user's clock, in 1/256 steps
+	uint32_t samples;	//Accepted codes the estimate is based on
+};
+/* Per-user clock drift estimate for totp_verify_drift. Zero it (or use
+ * TOTP_DRIFT_INIT) when the user enrolls and store it alongside lastcounter.
+ */
+
+#define TOTP_DRIFT_INIT {0, 0}
+
+int totp_verify_drift(const char* secret, size_t secretlen, int32_t code,
+		time_t timestamp, size_t timestep, size_t digits,
+		uint32_t window, uint64_t* lastcounter, struct totp_drift* drift);
+/* totp_verify_drift: totp_verify that learns how far the user's clock is off.
+ * Tries the step the estimate points to first, then its two neighbours, and
+ * searches the rest of the window only if those miss, so a generous window
+ * costs one HMAC for most logins. The estimate is updated from the offset of
+ * every accepted code.
+ *
+ * Unlike totp_verify, the time taken shows roughly where in the window the
+ * code matched (it reveals the clock offset, not the secret).
+ *
+ * window - the most steps accepted either side, however large the estimate
+ * drift - the user's estimate; NULL searches outwards from the current step
+ */
+
+int32_t totp_drift_steps(const struct totp_drift* drift);
+/* totp_drift_steps: the estimated clock offset rounded to whole time steps */
+
+int32_t compute_hotp(const char* secret, size_t secretlen, uint64_t counter, size_t digits);
+/* compute_hotp: RFC 4226 event based OTP for counter, as made by hardware
+ * tokens that count button presses instead of reading a clock
+ *
+ * secret, secretlen, digits - as for compute_totp
+ */
+
+int hotp_verify(const char* secret, size_t secretlen, int32_t code, size_t digits,
+		uint32_t lookahead, uint64_t* counter);
+/* hotp_verify: checks an HOTP against counters *counter to *counter +
+ * lookahead, the presses a token may have made without a login. Returns
+ * TOTP_VERIFY_OK and moves *counter past the matching counter, so each code is
+ * accepted once, or TOTP_VERIFY_INVALID.
+ *
+ * Codes for the window are computed 8 counters at a time from one prepared
+ * key, with SIMD where the CPU has it, and all of them are always computed.
+ */
+
+int hotp_resync(const char* secret, size_t secretlen, int32_t code, int32_t nextcode,
+		size_t digits, uint32_t lookahead, uint64_t* counter);
+/* hotp_resync: RFC 4226 section 7.4 resynchronization for a token that has
+ * drifted beyond the usual lookahead. The user enters two consecutive codes;
+ * they are accepted only as a pair matching counters c and c + 1 somewhere in
+ * *counter to *counter + lookahead, so a large window (hundreds of counters)
+ * stays safe. On success *counter becomes c + 2.
+ */
+
 int generate_random_secret(char* out, size_t outlen, int32_t (*rgen)(uint8_t*, size_t));
 /* generate_random_secret: generates a random secret encoded in base32.
  *
  * out - pointer to output buffer
  * outlen - size of buffer in bytes. Must be at least 33 bytes long.
  * rgen - a function that fills the buffer pointed to by the first argument, of length equal to the 2nd argument, with random bytes
- *	  and which returns -1 on failure and anything else on success
+ *	  and which returns -1 on failure and anything else on success. NULL uses
+ *	  the library's own generator, csprng_fill (see csprng.h).
  */
 
  void hmacsha1(char* output, const char* key,
 	size_t key_len, const char* message,
 	size_t message_len);
-/* hmacsha1: hashed message authentication code using SHA1
+/* hmacsha1: hashed message authentication code using SHA1. Writes the
+ * HMACSHA1_DIGEST_SIZE byte MAC to output; keys may be any length.
  */
 
+#define HMACSHA1_DIGEST_SIZE 20
+
+struct hmacsha1_key
+{
+	uint32_t istate[5];	//SHA1 state after hashing the key XOR ipad block
+	uint32_t ostate[5];	//SHA1 state after hashing the key XOR opad block
+};
+/* A key prepared for HMAC-SHA1: the midstates left after its two padded key
+ * blocks, so that each MAC of a short message costs two SHA1 blocks instead
+ * of four. Holds key material; wipe it with hmacsha1_key_wipe.
+ */
+
+void hmacsha1_key_init(struct hmacsha1_key* key, const char* secret, size_t secretlen);
+/* hmacsha1_key_init: prepares key from a raw (not base32) secret */
+
+void hmacsha1_key_mac(const struct hmacsha1_key* key, char* output,
+		const char* message, size_t message_len);
+/* hmacsha1_key_mac: same as hmacsha1 with the prepared key, without allocating */
+
+void hmacsha1_key_wipe(struct hmacsha1_key* key);
+/* hmacsha1_key_wipe: zeroes key in a way the compiler will not optimize out */
+
+//Secrets derived from a master key, so that none are stored per user
+#define TOTP_DERIVE_USER_MAX 256
+
+int totp_derive_secret(const struct hmacsha1_key* master, const char* user, size_t userlen,
+		uint32_t generation, char* secret);
+/* totp_derive_secret: writes the user's HMACSHA1_DIGEST_SIZE byte raw secret,
+ * HMAC-SHA1(master key, user || generation) with generation as 4 big endian
+ * bytes. Returns 0, or -1 if userlen is over TOTP_DERIVE_USER_MAX.
+ *
+ * master - the master key, prepared once with hmacsha1_key_init
+ * user - the user's stable id, e.g. an account number or name
+ * generation - bumped to give the user a new secret (re-enrollment)
+ */
+
+int totp_derive_secret_base32(const struct hmacsha1_key* master, const char* user,
+		size_t userlen, uint32_t generation, char* out, size_t outlen);
+/* totp_derive_secret_base32: the derived secret base32 encoded into out (at
+ * least 33 bytes), for totpuri_init or create_totp_qrcode at enrollment.
+ * Returns its length or -1.
+ */
+
+int totp_verify_derived(const struct hmacsha1_key* master, const char* user, size_t userlen,
+		uint32_t generation, int32_t code, time_t timestamp, size_t timestep,
+		size_t digits, uint32_t window, uint64_t* lastcounter);
+/* totp_verify_derived: totp_verify with the user's derived secret, so the only
+ * per user state to look up is generation and lastcounter
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,200 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+//totp_enroll: bulk provisioning of TOTP secrets and QR codes.
+//
+//Reads one account label per line (from a file or stdin) and writes one
+//record per account; see totp_enroll_bulk in enroll.h for the format.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "enroll.h"
+
+static char* read_all(FILE* fp, size_t* len)
+{
+	size_t cap = 1 << 16, used = 0;
+	char* buf = (char*) malloc(cap + 1);
+	while(buf)
+	{
+		used += fread(&buf[used], 1, cap - used, fp);
+		if(used < cap)
+		{
+			break;
+		}
+		cap <<= 1;
+		char* grown = (char*) realloc(buf, cap + 1);
+		if(!grown)
+		{
+			free(buf);
+			return 0;
+		}
+		buf = grown;
+	}
+	if(buf)
+	{
+		buf[used] = 0;
+		*len = used;
+	}
+	return buf;
+}
+
+static const char** split_lines(char* buf, size_t len, size_t* count)
+{
+	//Labels point into buf; newlines are overwritten with terminators
+	size_t lines = 0, idx = 0;
+	for(; idx < len; ++idx)
+	{
+		lines += buf[idx] == '\n';
+	}
+
+	const char** labels = (const char**) malloc((lines + 1) * sizeof(const char*));
+	if(!labels)
+	{
+		return 0;
+	}
+
+	size_t n = 0;
+	char* line = buf;
+	char* end = buf + len;
+	while(line < end)
+	{
+		char* nl = memchr(line, '\n', end - line);
+		char* lineend = nl ? nl : end;
+		*lineend = 0;
+		if(lineend > line && lineend[-1] == '\r')
+		{
+			lineend[-1] = 0;
+		}
+		if(*line)
+		{
+			labels[n++] = line;
+		}
+		line = lineend + 1;
+	}
+	*count = n;
+	return labels;
+}
+
+static void usage(const char* argv0)
+{
+	fprintf(stderr, "Usage: %s [-i issuer] [-t threads] [-d depth] [-q] [-o output] [labels]\n"
+		"  -i issuer   issuer name in every URI\n"
+		"  -t threads  QR encoding threads (default: one per CPU)\n"
+		"  -d depth    records in flight (default: 4 per thread)\n"
+		"  -q          write each account's ANSI QR code after its record\n"
+		"  -o output   output file (default: stdout)\n"
+		"  labels      file with one account label per line (default: stdin)\n",
+		argv0);
+}
+
+int main(int argc, char** argv)
+{
+	struct totp_enroll_options options;
+	memset(&options, 0, sizeof(options));
+	options.issuer = "";
+	const char* outpath = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "i:t:d:qo:h")) != -1)
+	{
+		switch(opt)
+		{
+		case 'i': options.issuer = optarg; break;
+		case 't': options.threads = strtoul(optarg, 0, 10); break;
+		case 'd': options.queue_depth = strtoul(optarg, 0, 10); break;
+		case 'q': options.render_qrcode = 1; break;
+		case 'o': outpath = optarg; break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	FILE* in = optind < argc ? fopen(argv[optind], "r") : stdin;
+	if(!in)
+	{
+		perror(argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	size_t len = 0, count = 0;
+	char* buf = read_all(in, &len);
+	const char** labels = buf ? split_lines(buf, len, &count) : 0;
+	if(in != stdin)
+	{
+		fclose(in);
+	}
+	if(!labels)
+	{
+		fprintf(stderr, "Out of memory reading labels\n");
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	//Checked here too, to say which label is at fault
+	size_t idx = 0;
+	for(; idx < count; ++idx)
+	{
+		if(strlen(labels[idx]) > TOTP_ENROLL_LABEL_MAX)
+		{
+			fprintf(stderr, "Label longer than %d characters: %s\n",
+				TOTP_ENROLL_LABEL_MAX, labels[idx]);
+			free(labels);
+			free(buf);
+			return EXIT_FAILURE;
+		}
+	}
+	if(strlen(options.issuer) > TOTP_ENROLL_LABEL_MAX)
+	{
+		fprintf(stderr, "Issuer longer than %d characters\n", TOTP_ENROLL_LABEL_MAX);
+		free(labels);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	FILE* out = outpath ? fopen(outpath, "w") : stdout;
+	if(!out)
+	{
+		perror(outpath);
+		free(labels);
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	int result = totp_enroll_bulk(labels, count, &options, out);
+	if(fflush(out) != 0)
+	{
+		result = -1;
+	}
+	if(result < 0)
+	{
+		fprintf(stderr, "Enrollment failed\n");
+	}
+
+	if(out != stdout)
+	{
+		fclose(out);
+	}
+	free(labels);
+	free(buf);
+	return result < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "totp.h"
+#include "base32codec.h"
+#include "metrics.h"
+
+static const char rfc_secret[] = "12345678901234567890";
+
+int check_hotp()
+{
+	//RFC 4226 appendix D
+	static const int32_t expected[] =
+	{
+		755224, 287082, 359152, 969429, 338314,
+		254676, 287922, 162583, 399871, 520489
+	};
+	uint64_t counter = 0;
+	for(; counter < 10; ++counter)
+	{
+		if(compute_hotp(rfc_secret, 20, counter, 6) != expected[counter])
+		{
+			return -1;
+		}
+	}
+
+	//The batched window search agrees with compute_hotp at every lane and
+	//across batch boundaries
+	uint64_t offset = 0;
+	for(; offset < 40; ++offset)
+	{
+		uint64_t next = 1000;
+		int32_t code = compute_hotp(rfc_secret, 20, next + offset, 6);
+		if(hotp_verify(rfc_secret, 20, code, 6, 39, &next) != TOTP_VERIFY_OK ||
+			next != 1000 + offset + 1)
+		{
+			return -1;
+		}
+	}
+
+	//Accepted once, and not beyond the lookahead
+	counter = 5;
+	if(hotp_verify(rfc_secret, 20, expected[7], 6, 3, &counter) != TOTP_VERIFY_OK ||
+		counter != 8 ||
+		hotp_verify(rfc_secret, 20, expected[7], 6, 3, &counter) != TOTP_VERIFY_INVALID ||
+		hotp_verify(rfc_secret, 20, compute_hotp(rfc_secret, 20, 12, 6), 6, 3, &counter) !=
+			TOTP_VERIFY_INVALID || counter != 8)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int check_resync()
+{
+	//Pressed 300 times away from the server
+	uint64_t counter = 10;
+	int32_t code = compute_hotp(rfc_secret, 20, 310, 6);
+	int32_t nextcode = compute_hotp(rfc_secret, 20, 311, 6);
+	if(hotp_resync(rfc_secret, 20, code, compute_hotp(rfc_secret, 20, 312, 6), 6, 500,
+			&counter) != TOTP_VERIFY_INVALID || counter != 10 ||
+		hotp_resync(rfc_secret, 20, code, nextcode, 6, 299, &counter) != TOTP_VERIFY_INVALID ||
+		hotp_resync(rfc_secret, 20, code, nextcode, 6, 500, &counter) != TOTP_VERIFY_OK ||
+		counter != 312)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int check_totp()
+{
+	//RFC 6238 appendix B, SHA1
+	static const struct
+	{
+		time_t time;
+		int32_t code;
+	} vectors[] =
+	{
+		{59, 94287082}, {1111111109, 7081804}, {1111111111, 14050471},
+		{1234567890, 89005924}, {2000000000, 69279037}, {20000000000, 65353130}
+	};
+	size_t idx = 0;
+	for(; idx < sizeof(vectors) / sizeof(vectors[0]); ++idx)
+	{
+		uint64_t last = 0;
+		if(compute_totp(rfc_secret, 20, vectors[idx].time, 30, 8) != vectors[idx].code ||
+			totp_verify(rfc_secret, 20, vectors[idx].code, vectors[idx].time + 30, 30, 8,
+				1, &last) != TOTP_VERIFY_OK ||
+			last != (uint64_t) vectors[idx].time / 30 ||
+			totp_verify(rfc_secret, 20, vectors[idx].code, vectors[idx].time, 30, 8,
+				1, &last) != TOTP_VERIFY_REPLAYED)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static uint64_t widened(void)
+{
+	struct metrics_snapshot snapshot;
+	metrics_snapshot(&snapshot);
+	return snapshot.counters[METRICS_VERIFY_WIDENED];
+}
+
+int check_drift()
+{
+	//A phone three steps fast: the first login searches the window, later
+	//ones hit the learned step straight away
+	struct totp_drift drift = TOTP_DRIFT_INIT;
+	uint64_t last = 0;
+	time_t now = 1600000000;
+	uint64_t before = widened();
+	int login = 0;
+	for(; login < 5; ++login, now += 30)
+	{
+		int32_t code = compute_totp(rfc_secret, 20, now + 3 * 30, 30, 6);
+		if(totp_verify_drift(rfc_secret, 20, code, now, 30, 6, 5, &last, &drift) !=
+			TOTP_VERIFY_OK || last != (uint64_t) (now / 30 + 3) ||
+			totp_drift_steps(&drift) != 3)
+		{
+			return -1;
+		}
+	}
+	if(widened() - before != 1)
+	{
+		return -1;
+	}
+
+	//The clock corrected itself (after a break, so the steps already used
+	//are behind it): found by widening, then relearned
+	for(now += 3 * 30, login = 0; login < 8; ++login, now += 30)
+	{
+		int32_t code = compute_totp(rfc_secret, 20, now, 30, 6);
+		if(totp_verify_drift(rfc_secret, 20, code, now, 30, 6, 5, &last, &drift) !=
+			TOTP_VERIFY_OK)
+		{
+			return -1;
+		}
+	}
+	if(totp_drift_steps(&drift) != 0)
+	{
+		return -1;
+	}
+
+	//Replays and codes beyond the window are still refused
+	int32_t code = compute_totp(rfc_secret, 20, now - 30, 30, 6);
+	if(totp_verify_drift(rfc_secret, 20, code, now, 30, 6, 5, &last, &drift) !=
+			TOTP_VERIFY_REPLAYED ||
+		totp_verify_drift(rfc_secret, 20, compute_totp(rfc_secret, 20, now + 6 * 30, 30, 6),
+			now, 30, 6, 5, &last, &drift) != TOTP_VERIFY_INVALID)
+	{
+		return -1;
+	}
+
+	//An offset of millions of steps saturates the estimate instead of
+	//wrapping it around to a negative one
+	struct totp_drift far = {(INT32_MAX / 256) * 256, 1};
+	int64_t steps = INT32_MAX / 256 + 1;
+	code = compute_totp(rfc_secret, 20, now + steps * 30, 30, 6);
+	last = 0;
+	if(totp_verify_drift(rfc_secret, 20, code, now, 30, 6, 9000000, &last, &far) !=
+			TOTP_VERIFY_OK || totp_drift_steps(&far) != INT32_MAX / 256)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+int check_derived()
+{
+	//The derived secret is a plain HMAC of user || generation
+	struct hmacsha1_key master;
+	hmacsha1_key_init(&master, rfc_secret, 20);
+	char secret[HMACSHA1_DIGEST_SIZE], again[HMACSHA1_DIGEST_SIZE], expected[HMACSHA1_DIGEST_SIZE];
+	hmacsha1(expected, rfc_secret, 20, "alice\0\0\0\1", 9);
+	if(totp_derive_secret(&master, "alice", 5, 1, secret) < 0 ||
+		memcmp(secret, expected, sizeof(secret)) ||
+		totp_derive_secret(&master, "alice", 5, 2, again) < 0 ||
+		!memcmp(secret, again, sizeof(secret)))
+	{
+		return -1;
+	}
+
+	//Enrollment hands out the same secret verification derives
+	char encoded[33], decoded[21];
+	time_t now = 1600000000;
+	uint64_t lastcounter = 0;
+	if(totp_derive_secret_base32(&master, "alice", 5, 1, encoded, sizeof(encoded)) != 32 ||
+		base32decode(encoded, 32, decoded, sizeof(decoded)) != 20 ||
+		totp_verify_derived(&master, "alice", 5, 1, compute_totp(decoded, 20, now, 30, 6),
+				now, 30, 6, 1, &lastcounter) != TOTP_VERIFY_OK ||
+		totp_verify_derived(&master, "alice", 5, 2, compute_totp(decoded, 20, now + 30, 30, 6),
+				now + 30, 30, 6, 1, &lastcounter) != TOTP_VERIFY_INVALID)
+	{
+		return -1;
+	}
+	hmacsha1_key_wipe(&master);
+	return 0;
+}
+
+int main(void)
+{
+	int hotpfailed = check_hotp() < 0;
+	printf("HOTP test %s.\n", hotpfailed ? "failed" : "passed");
+	int resyncfailed = check_resync() < 0;
+	printf("Resync test %s.\n", resyncfailed ? "failed" : "passed");
+	int totpfailed = check_totp() < 0;
+	printf("TOTP test %s.\n", totpfailed ? "failed" : "passed");
+	int driftfailed = check_drift() < 0;
+	printf("Drift test %s.\n", driftfailed ? "failed" : "passed");
+	int derivedfailed = check_derived() < 0;
+	printf("Derived secret test %s.\n", derivedfailed ? "failed" : "passed");
+
+	return hotpfailed || resyncfailed || totpfailed || driftfailed || derivedfailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
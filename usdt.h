@@ -0,0 +1,68 @@
+/*
+ * libmutotp - a library for using and making TOTP QR codes
+ * Copyright (C) 2020 kmeow
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as publ-
+ * ished by the Free Software Foundation; either version 2.1 of the
+ * License, or (at your option) any later version.
+
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+*/
+
+#ifndef USDT_H_
+#define USDT_H_
+
+//USDT (SystemTap SDT) static probes under the "mutotp" provider, for perf,
+//bpftrace or SystemTap on a running process. They are compiled in with
+//-DMUTOTP_USDT (make MUTOTP_USDT=1), which needs sys/sdt.h from SystemTap's
+//SDT headers. A probe nobody is attached to is a single nop plus an ELF note;
+//without MUTOTP_USDT the probes compile to nothing at all.
+//
+//	bpftrace -e 'usdt:./totp_loadgen:mutotp:totp_verify_return
+//		{ @[arg0, arg1] = count(); }'
+//
+//Probes and their arguments:
+//	compute_totp_entry(timestep, digits)	compute_totp_return(totp)
+//	totp_verify_entry(window, digits)	totp_verify_return(result, offset)
+//		offset is the matched step relative to the current one
+//	hmacsha1_entry(key_len, message_len)	hmacsha1_return()
+//		key_len is 0 for a MAC with a key prepared by hmacsha1_key_init
+//	sha1_blocks_entry(blocks)		sha1_blocks_return(blocks)
+//		a batch of SHA1 block compressions: from SHA1Update, from the
+//		HMAC key midstate code, or both blocks of every lane of a
+//		window search batch (whose HMACs fire no hmacsha1 probes)
+//	base32decode_entry(input_len, output_len)
+//	base32decode_return(result, kernel_blocks)
+//	qrcode_encode_entry(version, ecc, length)
+//	qrcode_data_encoded(version, mode, bits)
+//	qrcode_patterns_drawn(version)
+//	qrcode_ecc_done(version, codeword_bits)
+//	qrcode_codewords_placed(version)
+//	qrcode_encode_return(result, version, mask)
+//	ansi_render_entry(size)			ansi_render_return(bytes)
+//	ratelimit_reject(result)
+//		a RATELIMIT_* result other than RATELIMIT_OK
+
+#ifdef MUTOTP_USDT
+#include <sys/sdt.h>
+#define MUTOTP_PROBE(name) DTRACE_PROBE(mutotp, name)
+#define MUTOTP_PROBE1(name, a) DTRACE_PROBE1(mutotp, name, a)
+#define MUTOTP_PROBE2(name, a, b) DTRACE_PROBE2(mutotp, name, a, b)
+#define MUTOTP_PROBE3(name, a, b, c) DTRACE_PROBE3(mutotp, name, a, b, c)
+#else
+#define MUTOTP_PROBE(name) ((void) 0)
+#define MUTOTP_PROBE1(name, a) ((void) 0)
+#define MUTOTP_PROBE2(name, a, b) ((void) 0)
+#define MUTOTP_PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+#endif